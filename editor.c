@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -7,6 +8,17 @@
 #include <time.h>
 #include <errno.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/xattr.h>
+#include <sys/vfs.h>
+#include <linux/magic.h>
+#include <sys/syscall.h>
+#include <stdatomic.h>
+#include <wctype.h>
+#include <locale.h>
 
 /*
  * This program works in the command line and takes input through command line 
@@ -27,38 +39,63 @@
  * are open). 
  * 
  * Operations include: 
- * create_file, copy_file, del_file, show_file, show_line, del_line, append_line
- * ins_line, rep_line, search, regex_search, replace, count_lines, display_log
+ * create_file, copy_file, del_file, show_file, show_lines, del_line, append_line
+ * ins_line, rep_line, search, regex_search, replace, count_lines, display_log,
+ * build_index, build_sa, eol_file, space_file, fuzzy_search, build_widx,
+ * query_words, lookup, merge_files
  * 
  * create-file - create a new file or if exists overwrite with user confirmation
  * copy-file - copy contents of source file to destination (if exists overwrite 
  *             with user confirmation)
  * del_file - delete file 
  * show_file - display contents of file with line numbers
- * show_line - display specified line in file
+ * show_lines - display specified lines in file
  * del_line - delete specified line from file
  * append_line - add specified line to end of file
  * ins_line - add specfied line to provided position (line num) in file
  * rep_line - replace specified line in file with string 
  * search - search for string in file
  * regex_search - search for regex matches in file
+ * fuzzy_search - search for approximate matches of string in file (within a
+ *                number of edits)
+ * lookup - find lines starting with a prefix in a sorted file by binary search
+ * merge_files - merge a sorted file into another, or join the lines of two 
+ *               files sorted by key
  * replace - replace instances of string in file with another string
  * count_lines - count number of lines in file (0 if empty)
  * display_log - displays the history of operations performed on file (if no 
  *               file provided, display for all files)
+ * build_index - build a line index of file (blocks of lines and the trigrams 
+ *               they contain) used by searches to skip blocks without matches
+ * build_sa - build a suffix array and LCP array of file used to answer searches
+ *            by binary search
+ * build_widx - build a word index of file (the lines and positions of each 
+ *              word) used to answer word queries, kept up to date by edits 
+ *              that record their changes in a delta of the index
+ * query_words - find lines of file containing words and phrases (with AND and
+ *               OR) using the word index of the file
+ * eol_file - convert line endings of file to LF or CRLF (or report their mix)
+ * space_file - trim trailing whitespace of lines, expand tabs to spaces or turn
+ *              the indentation of lines into tabs
  * 
- * Some operations (truncate_log, del_line, ins_line, rep_line, replace) 
- * require a temporary intermediate file that is renamed to replace the 
+ * Some operations (truncate_log, del_line, ins_line, rep_line, replace, 
+ * eol_file, space_file, merge_files) require a temporary intermediate file that is renamed to replace the 
  * original file. Some operations (copy_file, create_file) require confirmation
  * from the user when the file exists and will be overwritten. This input is 
  * taken from the standard input stream and is also validated.
  * 
- * Some operations (display_log, truncate_log, replace, search, regex_search) 
- * read files line by line using fgets() and therefore files used for these 
- * operations are verified for their max line length and whether they contain 
- * NULL characters before any edits are made. Other operations read files char 
- * by char and thereby can handle files with larger lines and null characters 
- * - (more versatile)
+ * Some operations (display_log, truncate_log) read files line by line using 
+ * fgets() and therefore files used for these operations are verified for their
+ * max line length and whether they contain NULL characters before any edits 
+ * are made. Searches and replaces (search, regex_search, replace) step through
+ * the file loaded into memory by load_file() with explicit lengths, and other
+ * operations read files char by char or in blocks, so they can handle files 
+ * with larger lines and null characters - (more versatile)
+ * 
+ * How files are read (stdio, memory map, large buffers or O_DIRECT) and how 
+ * many threads are used is chosen for each file by choose_io() from its size,
+ * its filesystem and the number of cores, and can be overridden with global 
+ * options given before the flag argument (e.g. --io=mmap --threads=4).
  * 
  * Operations that modify the file, log the operation that was carried with: a 
  * timestamp, the files involved, the inputs involved as well as the number of 
@@ -82,12 +119,145 @@
  * MAX - maximum length of general string inputs
  * MAXF - maximum length of file path or regex expression
  * CLOG_BUFFER - how far back the log file stores log statements from (minimum 10)
+ * CHUNK - size of the buffer used for block based reads and writes
+ * PAR_MIN - minimum file size before copies are split between worker threads
+ * PAR_RANGE - size of the ranges handed out to worker threads
+ * MAX_THREADS - maximum number of worker threads used by an operation
+ * IDX_BLOCK - minimum size of the blocks files are split into by the line index
+ * IDX_BLOOM_BYTES - size of the Bloom filter of each block of the line index
+ * IDX_BLOOM_K - number of bits set in the Bloom filter for each trigram
+ * WIDX_TERM - maximum length of the terms of the word index (longer words are cut)
+ * WDELTA_RECORDS - edits recorded in the delta of a word index before it is merged
+ * WDELTA_BYTES - size the delta of a word index can reach before it is merged
+ * META_SAMPLE - number of bytes from each end of a file used in its fingerprint
+ * IO_SMALL - files smaller than this are read with stdio (lowest latency)
+ * IO_BUFSIZE - size of the reads used by the large buffer I/O method
+ * IO_ALIGN - alignment of buffers, offsets and lengths used with O_DIRECT
+ * PROGRESS_MS - milliseconds between updates of the progress line
+ * CKPT_BYTES - bytes of the source processed between checkpoints of rewrites
  */
 enum {
     LOGLEN = 2560,
     MAX = 1024,
     MAXF = 256,
-    CLOG_BUFFER = 200
+    CLOG_BUFFER = 200,
+    CHUNK = 1048576,
+    PAR_MIN = 67108864,
+    PAR_RANGE = 16777216,
+    MAX_THREADS = 16,
+    IDX_BLOCK = 65536,
+    IDX_BLOOM_BYTES = 4096,
+    IDX_BLOOM_K = 3,
+    WIDX_TERM = 64,
+    WDELTA_RECORDS = 4096,
+    WDELTA_BYTES = 4194304,
+    META_SAMPLE = 4096,
+    IO_SMALL = 262144,
+    IO_BUFSIZE = 8388608,
+    IO_ALIGN = 4096,
+    PROGRESS_MS = 500,
+    CKPT_BYTES = 268435456
+};
+
+/*
+ * enum that defines the version of the checkpoint file format and the rewrite
+ * operations that can be resumed from a checkpoint.
+ * CKPT_VERSION - version of checkpoint format (checkpoints of other versions are ignored)
+ * CKPT_REPLACE, CKPT_DEL_LINE, CKPT_INS_LINE, CKPT_REP_LINE - operation being checkpointed
+ * CKPT_ICASE - flag marking that the operation ignores case (-i)
+ * CKPT_WORD - flag marking that the operation only matches whole words (-w)
+ */
+enum {
+    CKPT_VERSION = 3,
+    CKPT_REPLACE = 1,
+    CKPT_DEL_LINE,
+    CKPT_INS_LINE,
+    CKPT_REP_LINE,
+    CKPT_ICASE = 1,
+    CKPT_WORD = 2
+};
+
+/*
+ * enum that defines the methods used to read files, chosen for each file by
+ * choose_io() or forced with the --io option.
+ * IO_AUTO - let choose_io() pick the method from the size and filesystem
+ * IO_STDIO - buffered reads with stdio (small files)
+ * IO_MMAP - memory map the file (large files on local filesystems)
+ * IO_BUF - read() into memory in IO_BUFSIZE pieces (network filesystems)
+ * IO_DIRECT - read() with O_DIRECT, bypassing the page cache
+ */
+enum {
+    IO_AUTO,
+    IO_STDIO,
+    IO_MMAP,
+    IO_BUF,
+    IO_DIRECT
+};
+
+/*
+ * enum that defines how an operation reads a file, passed to choose_io().
+ * LOAD_STREAM - read in pieces as it is processed (copies)
+ * LOAD_WHOLE - loaded into memory by load_file() and read in full
+ * LOAD_SPARSE - loaded into memory by load_file(), but only parts are read
+ */
+enum {
+    LOAD_STREAM,
+    LOAD_WHOLE,
+    LOAD_SPARSE
+};
+
+/*
+ * enum that defines the line endings files can be converted to by -eol.
+ * EOL_LF - newline char alone (Unix)
+ * EOL_CRLF - carriage return and newline char (Windows)
+ */
+enum {
+    EOL_LF = 1,
+    EOL_CRLF
+};
+
+/*
+ * enum that defines the whitespace rewrites done by space_file().
+ * WS_TRIM - remove spaces and tabs at the end of lines (-trim)
+ * WS_EXPAND - replace tabs with spaces up to the next tab stop (-expandtab)
+ * WS_UNEXPAND - replace spaces in the indentation of lines with tabs (-unexpand)
+ */
+enum {
+    WS_TRIM = 1,
+    WS_EXPAND,
+    WS_UNEXPAND
+};
+
+/*
+ * enum that defines how case-insensitive searches (-i) compare strings.
+ * ICASE_ASCII - only ASCII letters are folded (strings of ASCII chars)
+ * ICASE_UTF8 - chars are decoded as UTF-8 and folded with towlower() and towupper()
+ */
+enum {
+    ICASE_ASCII = 1,
+    ICASE_UTF8
+};
+
+/*
+ * enum that defines the version of the metadata stored in the extended 
+ * attribute of files.
+ * META_VERSION - version of metadata format (metadata of other versions is ignored)
+ */
+enum {
+    META_VERSION = 1
+};
+
+/*
+ * enum that defines the version of the line index sidecar file format and the 
+ * flags marking which sections are contained in a line index.
+ * IDXVERSION - version of sidecar format (indexes of other versions are ignored)
+ * IDX_TRIGRAM - index contains trigram directory and posting lists
+ * IDX_BLOOM - index contains a Bloom filter of the trigrams in each block
+ */
+enum {
+    IDXVERSION = 2,
+    IDX_TRIGRAM = 1,
+    IDX_BLOOM = 2
 };
 
 // Regex Expression to check validty of new filepaths
@@ -96,6 +266,72 @@ static const char FNAME[] = "^((\\/)?[0-9a-zA-Z._-][0-9a-zA-Z._ -]*)+$";
 static const char LOGF[] = "editorback.log";
 // file path of temporary file used in some edit operations
 static const char TEMPF[] = "tempeditor.tmp";
+// extension added to file path to give path of line index sidecar file
+static const char IDXEXT[] = ".lidx";
+// magic bytes at start of line index sidecar files
+static const char IDXMAGIC[] = "EDLINDEX";
+// extension added to file path to give path of suffix array sidecar file
+static const char SAEXT[] = ".sa";
+// magic bytes at start of suffix array sidecar files
+static const char SAMAGIC[] = "EDSUFARR";
+// extension added to file path to give path of word index sidecar file
+static const char WIDXEXT[] = ".widx";
+// magic bytes at start of word index sidecar files
+static const char WIDXMAGIC[] = "EDWORDIX";
+// extension added to file path to give path of word index delta sidecar file
+static const char WDELTAEXT[] = ".wdelta";
+// magic bytes at start of word index delta sidecar files
+static const char WDELTAMAGIC[] = "EDWDELTA";
+// name of extended attribute used to cache metadata of files
+static const char META_XATTR[] = "user.editor.meta";
+// file path of checkpoint file used to resume interrupted rewrite operations
+static const char CKPTF[] = "tempeditor.ckpt";
+// magic bytes at start of checkpoint files
+static const char CKPTMAGIC[] = "EDCHKPNT";
+// names of the I/O methods (indexed by the IO_ enum)
+static const char *IO_NAMES[] = { "auto", "stdio", "mmap", "buf", "direct" };
+
+/*
+ * Struct holding the global options given before the flag argument. These 
+ * change how operations are carried out, not what they do.
+ * io - I/O method to use for files (IO_AUTO lets choose_io() decide)
+ * threads - number of worker threads to use (0 lets choose_io() decide)
+ * verbose - print the I/O plan chosen for each file to stderr
+ * bwlimit - maximum bytes read and written per second (0 for no limit)
+ * iops - maximum reads and writes per second (0 for no limit)
+ * idle - run with the idle I/O priority class
+ * progress - show progress on stderr (1 forced, -1 disabled, 0 only if TTY)
+ * before - lines of context printed before matches of searches (-B)
+ * after - lines of context printed after matches of searches (-A)
+ * count - searches only print the total number of matches
+ * first - searches stop after this many matching lines (0 for no limit)
+ * quiet - searches print nothing and exit with status 0 at the first match
+ * json - operations print JSON Lines records instead of text
+ * tabs - distance between tab stops for -expandtab and -unexpand (0 for 8)
+ * icase - searches and replaces ignore case (ICASE_ enum, 0 if case matters)
+ * word - searches and replaces only match whole words
+ * sep - separator ending the key of lines joined by -join (NULL for a tab)
+ */
+struct options {
+    int io;
+    int threads;
+    int verbose;
+    uint64_t bwlimit;
+    uint64_t iops;
+    int idle;
+    int progress;
+    int before;
+    int after;
+    int count;
+    size_t first;
+    int quiet;
+    int json;
+    int tabs;
+    int icase;
+    int word;
+    const char *sep;
+};
+static struct options opts = { IO_AUTO, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, NULL };
 
 /* --- MISC --- */
 
@@ -232,360 +468,4625 @@ ssize_t verify_lines(FILE **fptr, int max_val) {
     return lines;
 }
 
-/* --- INPUT PROCESSING --- */
-
 /*
- * Function: empty_buffer()
+ * Function count_newlines()
  * -----------------------------
- * Empties the stdin buffer so that no characters carry over to next fgets
- * call by reading each character until a newline character is read
+ * Counts the number of newline characters in a block of memory. Uses memchr()
+ * to jump between newlines rather than checking each character individually.
+ *
+ * buf: pointer to start of block being counted
+ * len: number of bytes in the block
+ *
+ * returns: number of newline characters in the block
  */
-void empty_buffer() {
-    char c;
-    // Reads characters from stdin until end of line is reached
-    while ((c = getchar()) != '\n' && c != EOF) {}
+size_t count_newlines(const char *buf, size_t len) {
+    const char *end = buf + len;
+    size_t lines = 0;
+
+    // Jump to each newline char until the end of the block is reached
+    while (buf < end && (buf = memchr(buf, '\n', end - buf)) != NULL) {
+        lines++;
+        buf++;
+    }
+
+    return lines;
 }
 
 /*
- * Function: confirm()
+ * Function: count_endings()
  * -----------------------------
- * Prompts user to confirm and enter y or n to stdin. Whilst the input is not 
- * 'y' or 'n', user is continously prompted. Checks for validation include
- * whether EOF character was entered, whether the string is of correct length, 
- * and finally whether the string corresponds to 'y' or 'n'. Empties input
- * buffer when required to. 
+ * Counts the carriage returns in a block of memory, and those followed by a
+ * newline char in the block, by jumping from one to the next with memchr().
  * 
- * returns: 1 if 'y' entered, else 0
+ * buf: pointer to start of block being counted
+ * len: number of bytes in the block
+ * crs: pointer to the count of carriage returns
+ * crlfs: pointer to the count of carriage returns followed by newline chars
  */
-int confirm() {
-    char buf[5];
-    char c;
-    // While input is invalid 
-    while (1) {
-        // Prompt for input
-        printf("\nConfirm (y/n): ");
-
-        // Take user input and if error or EOF, print error and exit
-        if (!fgets(buf, 4, stdin)) {
-            if (ferror(stdin)) {
-                die("fgets");
-            } else {
-                fprintf(stderr, "\nEOF Character entered. Program quitting.\n");
-                exit(1);
-            }
-        }
+void count_endings(const char *buf, size_t len, size_t *crs, size_t *crlfs) {
+    const char *end = buf + len;
+
+    // Jump to each carriage return until the end of the block is reached
+    while (buf < end && (buf = memchr(buf, '\r', end - buf)) != NULL) {
+        (*crs)++;
+        if (buf + 1 < end && buf[1] == '\n') (*crlfs)++;
+        buf++;
+    }
+}
 
-        // If user input is not correct length, inform user
-        if (strlen(buf) != 2) {
-            printf("Invalid input.\n");
-            // Empty buffer if input overloaded
-            if (strlen(buf) > 2 && buf[2] != '\n') empty_buffer();
-            continue;
-        }
+/*
+ * Function: buf_reserve()
+ * -----------------------------
+ * Grows a buffer that is reused between calls so it holds at least the given
+ * number of bytes (with error handling).
+ * 
+ * buf: pointer to the buffer (NULL to allocate one)
+ * cap: pointer to the size of the buffer
+ * need: number of bytes the buffer must hold
+ */
+void buf_reserve(char **buf, size_t *cap, size_t need) {
+    if (*buf && need <= *cap) return;
 
-        c = buf[0];
-        // If input is valid option, return 1 is y and 0 if n
-        if (c == 'y' || c == 'n') {
-            return c == 'y' ? 1 : 0;
-        // If input not valid, inform user
-        } else {
-            printf("Invalid input.\n");
-        }
-    }
+    char *grown = (char *) realloc(*buf, need ? need : 1);
+    if (!grown) die("realloc");
+    *buf = grown;
+    *cap = need;
 }
 
 /*
- * Function: is_number() 
+ * Function file_size()
  * -----------------------------
- * Checks whether all characters in a string are numerical digits.
- * Used as validation function pointer passed to input() for numeric inputs.
+ * Finds the length of an opened file.
  * 
- * str: pointer to Char array being checked
+ * fptr: pointer to the opened file
  * 
- * returns: 0 if characters are numerical else 1 
+ * returns: length of the file (0 if it cannot be found)
  */
-int is_number(const char* str) {
-    int i;
-    // Loops through char array
-    for (i = 0; str[i] != '\0'; i++) {
-        // If char at current index is not numerical returns 1
-        if (!isdigit(str[i])) {
-            return 1;
-        }
-    }
-    // If all chars numerical return 0
-    return 0;
+off_t file_size(FILE *fptr) {
+    struct stat sb;
+    return fstat(fileno(fptr), &sb) ? 0 : sb.st_size;
 }
 
 /*
- * Function parse_num()
+ * Function: regex_match()
  * -----------------------------
- * Checks whether string is a valid number, and is not too long (or too short 
- * - empty stry) before attempting to parse string to unsigned long int. If any
- * checks are failed, program quits.
+ * Runs a compiled regex on a line given by its length, from an offset within 
+ * it, so the line needs no NULL terminator and may contain NULL chars. Uses 
+ * REG_STARTEND where the C library supports it. Otherwise the rest of the line
+ * is copied to a buffer (reused between calls) and terminated, in which case 
+ * matching stops at the first NULL char.
  * 
- * input: string to validate as numerical and convert to number 
- * maxlen: maximum allowed length of string
+ * reg: compiled regex
+ * line: pointer to the start of the line
+ * off: offset within the line to start matching from
+ * len: length of the line
+ * m: set to the offsets of the match within the line (unless the regex was 
+ *    compiled with REG_NOSUB)
+ * eflags: flags passed on to regexec() (e.g. REG_NOTBOL)
  * 
- * return: unsigned long int retrieved from string
+ * returns: 0 if a match was found, else REG_NOMATCH
  */
-size_t parse_num (char *input, int maxlen) {
-    // If string is not numerical, error message printed and program quits
-    if (is_number(input)) {
-        fprintf(stderr, "Invalid Line number Input: Non-digit\n");
-        exit(1);
+int regex_match(regex_t *reg, const char *line, size_t off, size_t len, regmatch_t *m, int eflags) {
+#ifdef REG_STARTEND
+    m->rm_so = off;
+    m->rm_eo = len;
+    return regexec(reg, line, 1, m, eflags | REG_STARTEND);
+#else
+    static char *copy = NULL;
+    static size_t cap = 0;
+
+    // Grow buffer to hold the rest of the line and a terminator
+    buf_reserve(&copy, &cap, len - off + 1);
+    memcpy(copy, line + off, len - off);
+    copy[len - off] = '\0';
+
+    int ret = regexec(reg, copy, 1, m, eflags);
+    if (!ret) {
+        m->rm_so += off;
+        m->rm_eo += off;
     }
+    return ret;
+#endif
+}
 
-    // If string is too long, error message printed and program quits
-    if (strlen(input) > maxlen) {
-        fprintf(stderr, "Invalid Line number Input: Too long\n");
-        exit(1);
-    }
+/*
+ * Function: fold()
+ * -----------------------------
+ * Folds ASCII characters to lower case, so that trigrams can be used for both
+ * case-sensitive and case-insensitive searches and so that strings can be 
+ * compared ignoring case.
+ *
+ * c: char to be folded
+ *
+ * returns: folded char
+ */
+static inline unsigned char fold(unsigned char c) {
+    return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
 
-    //If string is empty, error message printed and program quits
-    if (strlen(input) < 1) {
-        fprintf(stderr, "Invalid Line number Input: Empty string\n");
-        exit(1);
-    }
+/*
+ * Function: find_letter()
+ * -----------------------------
+ * Finds the first instance of an ASCII letter in either case in a buffer. As
+ * the cases of a letter only differ in the 0x20 bit, setting that bit in each
+ * char leaves a single byte to look for, which is done 8 chars at a time by 
+ * checking words for a zero byte after XORing them with the letter.
+ *
+ * s: buffer to search
+ * n: length of the buffer
+ * lower: lower case letter to find
+ *
+ * returns: pointer to the first instance, or NULL if there is none
+ */
+const char *find_letter(const char *s, size_t n, unsigned char lower) {
+    const char *end = s + n;
+    uint64_t pat = 0x0101010101010101ull * lower, w;
 
-    // Attempt to convert string to unsigned long int 
-    char *endptr;
-    errno = 0;
-    size_t line = (size_t) strtol(input, &endptr, 10);
-    // If error occurred, error message printed and program quits
-    if (errno) {
-        fprintf(stderr, "Invalid argument for line number - must be a valid unsigned long int\n");
-        die("strtol");
+    // Check chars one at a time until the pointer is aligned to a word
+    for (; s < end && ((uintptr_t) s & 7); s++) {
+        if (((unsigned char) *s | 0x20) == lower) return s;
+    }
+    // Skip words that do not contain the letter
+    for (; end - s >= 8; s += 8) {
+        memcpy(&w, s, 8);
+        w = (w | 0x2020202020202020ull) ^ pat;
+        if ((w - 0x0101010101010101ull) & ~w & 0x8080808080808080ull) break;
     }
+    // Find the letter in the word containing it (or the last chars)
+    for (; s < end; s++) {
+        if (((unsigned char) *s | 0x20) == lower) return s;
+    }
+    return NULL;
+}
 
-    return line;
+/*
+ * Function: find_icase()
+ * -----------------------------
+ * Finds the first instance of a string in a buffer ignoring the case of ASCII
+ * letters. One char of the string is used as an anchor: the first char that is
+ * not a letter or space is found with memchr(), otherwise the first letter is
+ * found in either case with find_letter(). The rest of the string is compared
+ * at each instance of the anchor.
+ *
+ * hay: buffer to search
+ * hlen: length of the buffer
+ * key: string to find
+ * klen: length of the string
+ *
+ * returns: pointer to the first instance, or NULL if there is none
+ */
+const char *find_icase(const char *hay, size_t hlen, const char *key, size_t klen) {
+    size_t a, i;
+    unsigned char c;
+
+    if (klen > hlen) return NULL;
+
+    // Pick the anchor char of the string
+    for (a = 0; a < klen && (isalpha((unsigned char) key[a]) || key[a] == ' '); a++);
+    if (a == klen) a = 0;
+    c = fold(key[a]);
+
+    const char *p = hay + a, *last = hay + hlen - klen + a;
+    while (p <= last) {
+        p = c >= 'a' && c <= 'z' ? find_letter(p, last - p + 1, c) : (const char *) memchr(p, c, last - p + 1);
+        if (!p) return NULL;
+        // Compare the string at the instance of the anchor
+        const char *start = p - a;
+        for (i = 0; i < klen && fold(start[i]) == fold(key[i]); i++);
+        if (i == klen) return start;
+        p++;
+    }
+    return NULL;
 }
 
 /*
- * Function valid_fname()
+ * Function: utf8_decode()
  * -----------------------------
- * Checks whether provided string is a valid file path to be created using a 
- * regex expression. File names can start with alphanumerics and select symbols
- * including: (.) (_) (-); spaces can occur in the middle of a file name. 
- * 
- * input: file path being checked for validity
+ * Decodes the UTF-8 char at the start of a buffer. Bytes that do not start a
+ * valid char are decoded on their own to a value no char has (0xDC00 plus the
+ * byte), so they only match themselves.
+ *
+ * s: buffer to decode from
+ * len: length of the buffer (at least 1)
+ * cp: set to the decoded code point
+ *
+ * returns: number of bytes decoded
  */
-void valid_fname (char *input) {
-    regex_t reg;
-    int temp;
+size_t utf8_decode(const char *s, size_t len, uint32_t *cp) {
+    const unsigned char *u = (const unsigned char *) s;
+    size_t n, i;
 
-    // Compiles regex expression to check for valid file path
-    if (temp = regcomp(&reg, FNAME, REG_ICASE | REG_EXTENDED | REG_NOSUB)) {
-        // If error, error message printed and program quits
-        char *buffer = (char *) malloc(MAX);
-        regerror(temp, &reg, buffer, sizeof(buffer));
-        fprintf(stderr,"grep: %s (%s)\n", buffer, FNAME);
-        free(buffer);
-        exit(1);
+    if (u[0] < 0x80) {
+        *cp = u[0];
+        return 1;
     }
 
-    // Runs the compiled regex pattern on the string to check for matches
-    if (regexec(&reg, input, 0, NULL, 0) != 0) {
-        // If no matches, error message printed and program quits
-        printf("Invalid filename\n");
-        regfree(&reg);
-        exit(1);
-    }
+    // Find the length of the char from its first byte
+    if (u[0] >= 0xC2 && u[0] <= 0xDF) n = 2;
+    else if (u[0] >= 0xE0 && u[0] <= 0xEF) n = 3;
+    else if (u[0] >= 0xF0 && u[0] <= 0xF4) n = 4;
+    else n = 0;
 
-    regfree(&reg);
+    if (n && n <= len) {
+        *cp = u[0] & (0x7F >> n);
+        for (i = 1; i < n && (u[i] & 0xC0) == 0x80; i++) *cp = (*cp << 6) | (u[i] & 0x3F);
+        if (i == n) return n;
+    }
+    *cp = 0xDC00 + u[0];
+    return 1;
 }
 
 /*
- * Function parse_string()
+ * Function: find_utf8()
  * -----------------------------
- * Checks whether length of string is within a maximum and minimum length limit. 
- * If checks failed, program quits. 
+ * Finds the first instance of a string in a buffer ignoring case, for strings
+ * with chars outside of ASCII. The string is compared at the start of each 
+ * UTF-8 char of the buffer, one char at a time with towlower() and towupper()
+ * (chars such as final sigma only share an upper case). As the cases 
+ * of a char may have different lengths in UTF-8, the length of the instance 
+ * found is also given.
+ *
+ * hay: buffer to search
+ * hlen: length of the buffer
+ * key: string to find
+ * klen: length of the string
+ * mlen: set to the length of the instance found
+ *
+ * returns: pointer to the first instance, or NULL if there is none
  */
-void parse_string (char *input, int maxlen, int minlen, int arg) {
-    // If string is too long, error message printed and program quits
-    if (strlen(input) > maxlen) {
-        fprintf(stderr, "Invalid Input (Argument %d): Too long\n", arg);
-        exit(1);
-    }
-
-    // If string is too short, error message printed and program quits
-    if (strlen(input) < minlen) {
-        fprintf(stderr, "Invalid Input (Argument %d): Too short\n", arg);
-        exit(1);
+const char *find_utf8(const char *hay, size_t hlen, const char *key, size_t klen, size_t *mlen) {
+    const char *p, *end = hay + hlen;
+    size_t i, j;
+    uint32_t a, b;
+
+    for (p = hay; p < end; p++) {
+        // Instances start at the first byte of a char
+        if ((*p & 0xC0) == 0x80) continue;
+        // Compare chars until the end of the string or a mismatch
+        for (i = j = 0; j < klen && p + i < end; ) {
+            size_t n = utf8_decode(p + i, end - p - i, &a);
+            size_t m = utf8_decode(key + j, klen - j, &b);
+            if (a != b && towlower(a) != towlower(b) && towupper(a) != towupper(b)) break;
+            i += n;
+            j += m;
+        }
+        if (j == klen) {
+            *mlen = i;
+            return p;
+        }
     }
+    return NULL;
 }
 
-/* --- CHANGE LOG --- */
+/*
+ * Function: icase_key()
+ * -----------------------------
+ * Prepares a case-insensitive search (-i) for a string. Strings of ASCII chars
+ * are found with find_icase(), while strings with other chars need find_utf8()
+ * and the UTF-8 case mappings of the C.UTF-8 locale (or the locale of the 
+ * environment, if it is not installed).
+ *
+ * key: string to be searched for
+ */
+void icase_key(const char *key) {
+    const char *c;
+
+    if (!opts.icase) return;
+    for (c = key; *c && !(*c & 0x80); c++);
+    if (!*c) return;
+
+    opts.icase = ICASE_UTF8;
+    if (!setlocale(LC_CTYPE, "C.UTF-8")) setlocale(LC_CTYPE, "");
+}
 
 /*
- * Function truncate_log()
+ * Function: is_word()
  * -----------------------------
- * Ensures that the log file does not get too large, by checking how many logs 
- * there are, and if it exceeds the predefined limit, old logs are removed such
- * that there are 10 less than the limit. Before reading, validates that log 
- * file is safe for reading using fgets().
- * If there are any errors, any open files are closed, valid error messages are 
- * printed and the program safely quits. 
+ * Checks whether a char is part of a word for whole word searches (-w): ASCII
+ * letters, digits and underscores, and every byte of 0x80 or above. All 
+ * non-ASCII text (any UTF-8 char, including punctuation and spaces such as 
+ * U+00A0, and invalid bytes) is treated as part of a word, so a key never 
+ * matches as a whole word right next to it.
+ *
+ * c: char to be checked
+ *
+ * returns: 1 if the char is part of a word, else 0
  */
-void truncate_log() {
-    // Attempts to open log file in read mode (with error handling)
-    FILE *fptr = fopen(LOGF, "r");
-    if (!fptr) die("fopen log");
+static inline int is_word(unsigned char c) {
+    return isalnum(c) || c == '_' || c >= 0x80;
+}
 
-    ssize_t logs;
-    // Obtain number of logs in log file and check if log file is safe for fgets()
-    if ((logs = verify_lines(&fptr, LOGLEN - 2)) == -1){
-        // If not safe for fgets, user prompted and program quits
-        puts("Warning: Log file has been edited by another program. Modify file to meet constraint or Delete file.\n");
-        fclose(fptr);
-        exit(1);
+/*
+ * Function: find_key()
+ * -----------------------------
+ * Finds the first instance of the string searched for in a buffer, with 
+ * memmem(), or ignoring case with find_icase() or find_utf8() for -i. For 
+ * whole word searches (-w), instances are found in the same way and then only
+ * the chars either side of each instance are checked, skipping instances that
+ * are next to a word char. The char before the buffer is checked too if it is
+ * after base, as buffers are often the rest of a line after an earlier match.
+ *
+ * base: start of the line or file the buffer is in
+ * hay: buffer to search
+ * hlen: length of the buffer
+ * key: string to find
+ * klen: length of the string
+ * mlen: set to the length of the instance found (klen unless it is found by
+ *       find_utf8())
+ *
+ * returns: pointer to the first instance, or NULL if there is none
+ */
+const char *find_key(const char *base, const char *hay, size_t hlen, const char *key, size_t klen, size_t *mlen) {
+    const char *p, *end = hay + hlen;
+
+    *mlen = klen;
+    for (;;) {
+        if (opts.icase == ICASE_UTF8) p = find_utf8(hay, end - hay, key, klen, mlen);
+        else if (opts.icase) p = find_icase(hay, end - hay, key, klen);
+        else p = (const char *) memmem(hay, end - hay, key, klen);
+
+        // Instance is a whole word if there is no word char either side of it
+        if (!p || !opts.word) return p;
+        if ((p == base || !is_word(p[-1])) && (p + *mlen == end || !is_word(p[*mlen]))) return p;
+        hay = p + 1;
     }
+}
 
-    // If logs exceed limit
-    if (logs > CLOG_BUFFER) {
-        // Reset file pointer to start of file (with error handling)
-        if (fseek(fptr, 0, SEEK_SET)) {
-            fclose(fptr);
-            die("fseek");
-        }
-        
-        // Attempts to open temp file in write mode (with error handling)
-        FILE *temp = fopen(TEMPF, "w");
-        if (!temp) {
-            fclose(fptr);
-            die("fopen temp");
-        }
+/* --- I/O STRATEGY --- */
 
-        char *line = (char *) malloc(LOGLEN);
+/*
+ * Struct describing how a file is read, chosen by choose_io(): the I/O method,
+ * the number of worker threads used by operations that split their work and
+ * whether the file is kept out of the page cache (direct I/O, which memory 
+ * mapped files larger than memory get by dropping pages once streamed).
+ */
+struct io_plan {
+    int method;
+    int threads;
+    int nocache;
+};
 
-        // Read lines from log file until End Of File
-        while (fgets(line, LOGLEN - 1, fptr) != NULL) {
+/*
+ * Struct holding the contents of a file loaded into memory by load_file().
+ * data - contents of the file (NULL if the file is empty)
+ * len - length of the file
+ * fd - descriptor of the open file (for operations that also copy ranges of it)
+ * mapped - whether data is a memory map rather than allocated memory
+ * plan - plan chosen for the file by choose_io()
+ */
+struct fbuf {
+    char *data;
+    size_t len;
+    int fd;
+    int mapped;
+    struct io_plan plan;
+};
+
+/*
+ * Struct for the mix of line endings in a buffer, counted by count_buffer().
+ * lf - newline chars not preceded by a carriage return
+ * crlf - carriage returns followed by a newline char
+ * cr - carriage returns not followed by a newline char
+ */
+struct eol_mix {
+    size_t lf;
+    size_t crlf;
+    size_t cr;
+};
+
+/*
+ * Struct for the part of a buffer counted by a count_worker() thread. 
+ * Carriage returns (crs) and carriage returns followed by newline chars 
+ * (crlfs) are only counted if mix is set.
+ */
+struct count_job {
+    const char *buf;
+    size_t len;
+    size_t newlines;
+    int mix;
+    size_t crs;
+    size_t crlfs;
+};
+
+/*
+ * Struct for the token buckets limiting the bandwidth and IOPS of operations 
+ * (--bwlimit and --iops). Buckets fill at their rate up to a tenth of a 
+ * second's worth of tokens, and may go into debt when a request is larger 
+ * than the bucket holds.
+ */
+struct throttle_state {
+    double bytes;
+    double ops;
+    struct timespec last;
+    pthread_mutex_t lock;
+};
+static struct throttle_state bucket = { 0, 0, { 0, 0 }, PTHREAD_MUTEX_INITIALIZER };
+
+/*
+ * Function: throttle()
+ * -----------------------------
+ * Takes tokens for one read or write of a number of bytes from the token 
+ * buckets, sleeping until the buckets are out of debt if they did not hold 
+ * enough. Called from the read and write loops of bulk operations (by any 
+ * thread). Does nothing unless a limit is set.
+ * 
+ * bytes: number of bytes read or written
+ */
+void throttle(size_t bytes) {
+    struct timespec now;
+    double wait = 0;
+
+    if (!opts.bwlimit && !opts.iops) return;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    pthread_mutex_lock(&bucket.lock);
+    // Buckets start full, and fill for the time since they were last used
+    double elapsed = bucket.last.tv_sec ? (now.tv_sec - bucket.last.tv_sec) + (now.tv_nsec - bucket.last.tv_nsec) / 1e9 : 1;
+    bucket.last = now;
+
+    if (opts.bwlimit) {
+        bucket.bytes += elapsed * opts.bwlimit;
+        if (bucket.bytes > opts.bwlimit / 10.0) bucket.bytes = opts.bwlimit / 10.0;
+        bucket.bytes -= bytes;
+        if (bucket.bytes < 0) wait = -bucket.bytes / opts.bwlimit;
+    }
+    if (opts.iops) {
+        bucket.ops += elapsed * opts.iops;
+        if (bucket.ops > opts.iops / 10.0) bucket.ops = opts.iops / 10.0;
+        bucket.ops -= 1;
+        if (bucket.ops < 0 && -bucket.ops / opts.iops > wait) wait = -bucket.ops / opts.iops;
+    }
+    pthread_mutex_unlock(&bucket.lock);
+
+    // Sleep until the debt is paid off
+    if (wait > 0) {
+        struct timespec ts = { (time_t) wait, (long) ((wait - (time_t) wait) * 1e9) };
+        while (nanosleep(&ts, &ts) == -1 && errno == EINTR);
+    }
+}
+
+/*
+ * Function: choose_io()
+ * -----------------------------
+ * Picks the I/O method and the number of threads used for a file. Files 
+ * smaller than IO_SMALL are read with stdio, as setting up a memory map or a 
+ * large buffer costs more than reading them. Files on network and FUSE 
+ * filesystems (found with fstatfs()) are read with large buffers, as each page
+ * fault of a memory map would be a round trip to the server. Files larger than
+ * physical memory are read with O_DIRECT, as they cannot stay in the page 
+ * cache and would only evict other files from it. Other files are memory 
+ * mapped. Files of at least PAR_MIN bytes are split between one thread per 
+ * core (up to MAX_THREADS). The --io and --threads options override the 
+ * choices. Files loaded into memory by load_file() are memory mapped instead
+ * when they are too large for half of physical memory (kept out of the page 
+ * cache if direct I/O was chosen), and when only parts of them will be read 
+ * (sparse, --quiet, --first) unless --io is given. This is the only place 
+ * the method is decided, and --verbose prints the plan to stderr.
+ * 
+ * fpath: path to the file (used for --verbose)
+ * fd: file descriptor of the file
+ * size: length of the file
+ * load: how the file is read (LOAD_STREAM, LOAD_WHOLE or LOAD_SPARSE)
+ * 
+ * returns: plan for reading the file
+ */
+struct io_plan choose_io(const char *fpath, int fd, off_t size, int load) {
+    struct io_plan plan = { IO_MMAP, 1, 0 };
+    struct statfs fs;
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    long pages = sysconf(_SC_PHYS_PAGES);
+    long pagesize = sysconf(_SC_PAGESIZE);
+
+    // Large files are split between one thread per core
+    if (size >= PAR_MIN && cores > 1) plan.threads = cores > MAX_THREADS ? MAX_THREADS : cores;
+
+    // Choose method from the size of the file and the filesystem it is stored on
+    if (size < IO_SMALL) {
+        plan.method = IO_STDIO;
+    } else if (!fstatfs(fd, &fs) && (fs.f_type == NFS_SUPER_MAGIC || fs.f_type == SMB_SUPER_MAGIC 
+            || fs.f_type == (typeof(fs.f_type)) CIFS_SUPER_MAGIC || fs.f_type == (typeof(fs.f_type)) SMB2_SUPER_MAGIC
+            || fs.f_type == FUSE_SUPER_MAGIC)) {
+        plan.method = IO_BUF;
+    } else if (pages > 0 && pagesize > 0 && (uint64_t) size > (uint64_t) pages * pagesize) {
+        plan.method = IO_DIRECT;
+    }
+
+    // Options given by the user override the choices
+    if (opts.io != IO_AUTO) plan.method = opts.io;
+    if (opts.threads) plan.threads = opts.threads;
+    plan.nocache = plan.method == IO_DIRECT;
+
+    // Files that would not fit in memory, or are only read in parts, are memory mapped when loaded
+    if (load != LOAD_STREAM && (((load == LOAD_SPARSE || opts.quiet || opts.first) && opts.io == IO_AUTO) 
+            || (pages > 0 && pagesize > 0 && (uint64_t) size > (uint64_t) pages * pagesize / 2))) plan.method = IO_MMAP;
+
+    if (opts.verbose) fprintf(stderr, "I/O plan for \'%s\': %s%s, %d thread/s\n", fpath, IO_NAMES[plan.method], 
+            plan.method == IO_MMAP && plan.nocache ? " (dropped from page cache)" : "", plan.threads);
+    return plan;
+}
+
+/*
+ * Function: load_file()
+ * -----------------------------
+ * Opens a file and loads its contents into memory with the method chosen by 
+ * choose_io(), which memory maps files too large for half of physical memory
+ * and files of which only a few parts will be read (sparse) or that searches 
+ * may stop reading early (--quiet, --first). Memory maps are advised for 
+ * sequential access. The stdio, buf and direct methods read the whole file 
+ * into allocated memory. O_DIRECT reads use aligned memory and fall back to 
+ * normal reads on filesystems without O_DIRECT support. The file must be 
+ * released with unload_file(). If there is an error, error message is printed
+ * and program quits.
+ * 
+ * fpath: path to the file
+ * fb: struct filled in with the contents of the file
+ * sparse: whether only parts of the file will be read
+ * 
+ * returns: plan used for the file
+ */
+struct io_plan load_file(const char *fpath, struct fbuf *fb, int sparse) {
+    struct stat sb;
+
+    // Attempts to open file and retrieve its size (with error handling)
+    fb->fd = open(fpath, O_RDONLY);
+    if (fb->fd == -1) die("open");
+    if (fstat(fb->fd, &sb)) die("fstat");
+    fb->data = NULL;
+    fb->len = sb.st_size;
+    fb->mapped = 0;
+
+    struct io_plan plan = fb->plan = choose_io(fpath, fb->fd, sb.st_size, sparse ? LOAD_SPARSE : LOAD_WHOLE);
+    if (fb->len == 0) return plan;
+    int method = plan.method;
+
+    if (method == IO_MMAP) {
+        // Attempts to map file (with error handling)
+        fb->data = (char *) mmap(NULL, fb->len, PROT_READ, MAP_PRIVATE, fb->fd, 0);
+        if (fb->data == MAP_FAILED) die("mmap");
+        madvise(fb->data, fb->len, sparse ? MADV_RANDOM : MADV_SEQUENTIAL);
+        fb->mapped = 1;
+        return plan;
+    }
+
+    // Allocate memory rounded up to whole aligned blocks, as O_DIRECT requires (with error handling)
+    size_t cap = (fb->len + IO_ALIGN - 1) & ~((size_t) IO_ALIGN - 1);
+    if (posix_memalign((void **) &fb->data, IO_ALIGN, cap)) die("posix_memalign");
+
+    if (method == IO_STDIO) {
+        // Attempts to read file through stdio (with error handling)
+        FILE *fptr = fdopen(dup(fb->fd), "r");
+        if (!fptr) die("fdopen");
+        fb->len = fread(fb->data, 1, fb->len, fptr);
+        if (ferror(fptr)) die("fread");
+        throttle(fb->len);
+        fclose(fptr);
+        return plan;
+    }
+
+    // Direct reads use a second descriptor opened with O_DIRECT (if supported by filesystem)
+    int rfd = fb->fd;
+    if (method == IO_DIRECT && (rfd = open(fpath, O_RDONLY | O_DIRECT)) == -1) rfd = fb->fd;
+    if (method == IO_BUF) posix_fadvise(rfd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    size_t off = 0;
+    ssize_t n = 0;
+    // Read file in IO_BUFSIZE pieces until the end of the file
+    while (off < fb->len) {
+        n = pread(rfd, fb->data + off, cap - off > IO_BUFSIZE ? IO_BUFSIZE : cap - off, off);
+        if (n == -1 && errno == EINTR) continue;
+        // If O_DIRECT reads are refused, continue with normal reads
+        if (n == -1 && errno == EINVAL && rfd != fb->fd) {
+            close(rfd);
+            rfd = fb->fd;
+            continue;
+        }
+        if (n <= 0) break;
+        throttle(n);
+        off += n;
+    }
+    if (rfd != fb->fd) close(rfd);
+    if (n == -1) die("read");
+
+    // If file shrank while being read, only the part read is used
+    fb->len = off;
+    return plan;
+}
+
+/*
+ * Function: unload_file()
+ * -----------------------------
+ * Releases the memory holding a file loaded by load_file() and closes it.
+ * 
+ * fb: struct filled in by load_file()
+ */
+void unload_file(struct fbuf *fb) {
+    if (fb->mapped) munmap(fb->data, fb->len);
+    else free(fb->data);
+    close(fb->fd);
+}
+
+/*
+ * Function: count_worker()
+ * -----------------------------
+ * Thread function for parallel line counts. Counts the newlines in its part of
+ * the buffer with count_newlines(), and the carriage returns with 
+ * count_endings() if the mix of line endings is wanted.
+ * 
+ * arg: pointer to the count_job struct of the thread
+ * 
+ * returns: NULL
+ */
+void *count_worker(void *arg) {
+    struct count_job *job = (struct count_job *) arg;
+    job->newlines = count_newlines(job->buf, job->len);
+    job->crs = job->crlfs = 0;
+    if (job->mix) count_endings(job->buf, job->len, &job->crs, &job->crlfs);
+    return NULL;
+}
+
+/*
+ * Function: count_buffer()
+ * -----------------------------
+ * Counts the newlines in a buffer, splitting it into equal parts counted by 
+ * worker threads when more than one thread is to be used. Parts whose thread
+ * could not be created are counted by this thread. The mix of line endings 
+ * (LF, CRLF and lone CR) can be counted in the same pass, joining up CRLF 
+ * pairs split between two parts.
+ * 
+ * buf: pointer to start of buffer being counted
+ * len: number of bytes in the buffer
+ * threads: number of threads to use
+ * mix: struct filled in with the mix of line endings (NULL if not wanted)
+ * 
+ * returns: number of newline characters in the buffer
+ */
+size_t count_buffer(const char *buf, size_t len, int threads, struct eol_mix *mix) {
+    struct count_job jobs[MAX_THREADS];
+    pthread_t tids[MAX_THREADS];
+    int started[MAX_THREADS];
+    size_t total = 0, crs = 0, crlfs = 0;
+    int i;
+
+    if (threads <= 1 && !mix) return count_newlines(buf, len);
+    if (threads < 1) threads = 1;
+
+    // Start a thread for each part after the first
+    for (i = 0; i < threads; i++) {
+        jobs[i].buf = buf + len / threads * i;
+        jobs[i].len = i == threads - 1 ? len - len / threads * i : len / threads;
+        jobs[i].mix = mix != NULL;
+        started[i] = i > 0 && !pthread_create(&tids[i], NULL, count_worker, &jobs[i]);
+    }
+
+    // Count the first part, and any part without a thread, in this thread
+    for (i = 0; i < threads; i++) {
+        if (!started[i]) count_worker(&jobs[i]);
+    }
+
+    // Wait for threads and add up the counts
+    for (i = 0; i < threads; i++) {
+        if (started[i]) pthread_join(tids[i], NULL);
+        total += jobs[i].newlines;
+        crs += jobs[i].crs;
+        crlfs += jobs[i].crlfs;
+        // A part ending in a carriage return may continue with the newline char starting the next part
+        if (i > 0 && jobs[i].len > 0 && jobs[i].buf[0] == '\n' && jobs[i].buf[-1] == '\r') crlfs++;
+    }
+
+    if (mix) {
+        mix->crlf = crlfs;
+        mix->lf = total - crlfs;
+        mix->cr = crs - crlfs;
+    }
+    return total;
+}
+
+/*
+ * Function: count_file()
+ * -----------------------------
+ * Counts the number of lines in a file (0 if empty), loading the file with 
+ * load_file() and counting it with count_buffer().
+ * 
+ * fpath: path to the file
+ * 
+ * returns: number of lines in the file
+ */
+size_t count_file(const char *fpath) {
+    struct fbuf fb;
+    struct io_plan plan = load_file(fpath, &fb, 0);
+
+    // Non-empty files have one more line than newline characters
+    size_t lines = fb.len > 0 ? count_buffer(fb.data, fb.len, plan.threads, NULL) + 1 : 0;
+
+    unload_file(&fb);
+    return lines;
+}
+
+/*
+ * Struct for the pool of aligned CHUNK buffers shared by the threads of an 
+ * operation. Buffers are allocated when first needed and kept for reuse once
+ * returned, up to one for each thread (and the main thread).
+ */
+struct buf_pool {
+    char *bufs[MAX_THREADS + 1];
+    int nfree;
+    pthread_mutex_t lock;
+};
+static struct buf_pool pool = { { NULL }, 0, PTHREAD_MUTEX_INITIALIZER };
+
+/*
+ * Function: pool_get()
+ * -----------------------------
+ * Takes a buffer of CHUNK bytes aligned to IO_ALIGN (as needed by O_DIRECT) 
+ * from the pool, allocating a new one if none are free. The buffer must be
+ * returned with pool_put().
+ * 
+ * returns: pointer to the buffer, or NULL if allocation fails
+ */
+char *pool_get() {
+    char *buf = NULL;
+
+    // Reuse a free buffer if there is one
+    pthread_mutex_lock(&pool.lock);
+    if (pool.nfree > 0) buf = pool.bufs[--pool.nfree];
+    pthread_mutex_unlock(&pool.lock);
+
+    // Otherwise allocate a new aligned buffer
+    if (!buf && posix_memalign((void **) &buf, IO_ALIGN, CHUNK)) buf = NULL;
+    return buf;
+}
+
+/*
+ * Function: pool_put()
+ * -----------------------------
+ * Returns a buffer taken with pool_get() to the pool, freeing it if the pool 
+ * is already full.
+ * 
+ * buf: buffer being returned (NULL is ignored)
+ */
+void pool_put(char *buf) {
+    if (!buf) return;
+
+    pthread_mutex_lock(&pool.lock);
+    if (pool.nfree < MAX_THREADS + 1) {
+        pool.bufs[pool.nfree++] = buf;
+        buf = NULL;
+    }
+    pthread_mutex_unlock(&pool.lock);
+
+    free(buf);
+}
+
+/*
+ * Function: drop_cache()
+ * -----------------------------
+ * Removes a range of a file from the page cache once it has been streamed 
+ * through, so that bulk operations on large files do not evict the cached 
+ * data of other programs. Written ranges are first flushed to storage with 
+ * sync_file_range(), as dirty pages cannot be dropped. Failures are ignored,
+ * as the page cache only affects performance.
+ * 
+ * fd: file descriptor of the file
+ * start: offset of the start of the range
+ * end: offset of the end of the range
+ * written: whether the range has been written (rather than only read)
+ */
+void drop_cache(int fd, off_t start, off_t end, int written) {
+    if (end <= start) return;
+    if (written) sync_file_range(fd, start, end - start, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+    posix_fadvise(fd, start, end - start, POSIX_FADV_DONTNEED);
+}
+
+/*
+ * Function: drop_loaded()
+ * -----------------------------
+ * Removes a range of a file loaded by load_file() from the page cache with 
+ * drop_cache(). Pages of a memory map cannot be dropped while mapped, so the 
+ * range is first released from the map with madvise() (it is read back from 
+ * the file if used again).
+ * 
+ * fb: struct filled in by load_file()
+ * start: offset of the start of the range
+ * end: offset of the end of the range
+ */
+void drop_loaded(struct fbuf *fb, size_t start, size_t end) {
+    // Release whole pages of the range from the memory map
+    if (fb->mapped) {
+        size_t page = sysconf(_SC_PAGESIZE);
+        size_t first = (start + page - 1) / page * page;
+        size_t last = end / page * page;
+        if (last > first) madvise(fb->data + first, last - first, MADV_DONTNEED);
+    }
+    drop_cache(fb->fd, start, end, 0);
+}
+
+/*
+ * Function: drop_streamed()
+ * -----------------------------
+ * Drops the part of a file loaded by load_file() that has been streamed 
+ * through, and the part of the output file written from it, from the page 
+ * cache. Drops are batched until IO_BUFSIZE bytes have been streamed since the
+ * last one, so that the flushes of the output stay large and sequential. The
+ * final drop covers both files from the start, as pages that straddled the 
+ * edge of an earlier batch are only dropped whole.
+ * 
+ * fb: struct filled in by load_file()
+ * done: offset of the loaded file up to which it has been streamed through
+ * dropped: pointer to offset of the loaded file up to which it has been dropped
+ * out: output file being written
+ * outdropped: pointer to offset of the output file up to which it has been dropped
+ * force: whether this is the final drop
+ */
+void drop_streamed(struct fbuf *fb, size_t done, size_t *dropped, FILE *out, off_t *outdropped, int force) {
+    off_t written;
+
+    if (done - *dropped < IO_BUFSIZE && !force) return;
+    drop_loaded(fb, force ? 0 : *dropped, done);
+    *dropped = done;
+
+    // Output must be flushed before its pages can be dropped
+    if (fflush(out) || (written = ftello(out)) == -1) return;
+    drop_cache(fileno(out), force ? 0 : *outdropped, written, 1);
+    *outdropped = written;
+}
+
+/* --- PROGRESS --- */
+
+/*
+ * Struct for the progress of the current long operation. The hot loops add 
+ * to the atomic counters in batches (with progress_add()), and a timer thread
+ * samples them every PROGRESS_MS milliseconds to print the progress line, so
+ * the loops never wait on the terminal.
+ */
+struct progress_state {
+    const char *label;
+    uint64_t total;
+    int matches;
+    int active;
+    int stop;
+    atomic_uint_fast64_t done;
+    atomic_uint_fast64_t found;
+    struct timespec start;
+    pthread_t tid;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+static struct progress_state prog = { NULL, 0, 0, 0, 0, 0, 0, { 0, 0 }, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+/*
+ * Function: format_bytes()
+ * -----------------------------
+ * Writes a number of bytes in a human readable form (e.g. "12.3 MB").
+ * 
+ * bytes: number of bytes
+ * out: buffer of at least 16 chars the result is written to
+ */
+void format_bytes(double bytes, char *out) {
+    static const char *units[] = { "B", "KB", "MB", "GB", "TB" };
+    int u = 0;
+
+    while (bytes >= 1024 && u < 4) {
+        bytes /= 1024;
+        u++;
+    }
+    snprintf(out, 16, "%.1f %s", bytes, units[u]);
+}
+
+/*
+ * Function: progress_print()
+ * -----------------------------
+ * Prints the progress line to stderr, overwriting the previous one: bytes 
+ * processed, percentage, throughput, estimated time remaining and matches 
+ * found (for operations that count them).
+ */
+void progress_print() {
+    char done[16], total[16], rate[16];
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double elapsed = (now.tv_sec - prog.start.tv_sec) + (now.tv_nsec - prog.start.tv_nsec) / 1e9;
+    uint64_t bytes = atomic_load_explicit(&prog.done, memory_order_relaxed);
+    double speed = elapsed > 0 ? bytes / elapsed : 0;
+
+    format_bytes(bytes, done);
+    format_bytes(prog.total, total);
+    format_bytes(speed, rate);
+    fprintf(stderr, "\r%s: %s / %s (%d%%) %s/s", prog.label, done, total, prog.total ? (int) (bytes * 100 / prog.total) : 100, rate);
+
+    // Time remaining assumes the rest is processed at the average rate so far
+    if (speed > 0 && bytes < prog.total) {
+        long eta = (long) ((prog.total - bytes) / speed);
+        fprintf(stderr, " ETA %ld:%02ld:%02ld", eta / 3600, eta / 60 % 60, eta % 60);
+    }
+    if (prog.matches) fprintf(stderr, " | %lu matches", (unsigned long) atomic_load_explicit(&prog.found, memory_order_relaxed));
+    fprintf(stderr, "\033[K");
+}
+
+/*
+ * Function: progress_worker()
+ * -----------------------------
+ * Thread function of the progress timer. Prints the progress line every 
+ * PROGRESS_MS milliseconds until progress_stop() is called.
+ * 
+ * arg: unused
+ * 
+ * returns: NULL
+ */
+void *progress_worker(void *arg) {
+    struct timespec wake;
+    // No argument is passed to the thread
+    (void) arg;
+
+    pthread_mutex_lock(&prog.lock);
+    while (!prog.stop) {
+        clock_gettime(CLOCK_REALTIME, &wake);
+        wake.tv_nsec += PROGRESS_MS * 1000000L;
+        wake.tv_sec += wake.tv_nsec / 1000000000L;
+        wake.tv_nsec %= 1000000000L;
+        // Wait for the next update, or until told to stop
+        if (pthread_cond_timedwait(&prog.cond, &prog.lock, &wake) == ETIMEDOUT) progress_print();
+    }
+    pthread_mutex_unlock(&prog.lock);
+
+    return NULL;
+}
+
+/*
+ * Function: progress_start()
+ * -----------------------------
+ * Starts reporting the progress of an operation on stderr, if stderr is a 
+ * terminal (or --progress was given, and not --no-progress). A failure to 
+ * start the timer thread only loses the progress line.
+ * 
+ * label: name of the operation shown on the progress line
+ * total: number of bytes the operation is expected to process
+ * matches: whether the operation counts matches
+ */
+void progress_start(const char *label, uint64_t total, int matches) {
+    if (opts.progress < 0 || (opts.progress == 0 && !isatty(STDERR_FILENO))) return;
+
+    prog.label = label;
+    prog.total = total;
+    prog.matches = matches;
+    prog.stop = 0;
+    atomic_store(&prog.done, 0);
+    atomic_store(&prog.found, 0);
+    clock_gettime(CLOCK_MONOTONIC, &prog.start);
+    prog.active = !pthread_create(&prog.tid, NULL, progress_worker, NULL);
+}
+
+/*
+ * Function: progress_add()
+ * -----------------------------
+ * Adds to the bytes processed and matches found by the current operation. 
+ * Safe to call from any thread, and cheap enough for hot loops when called
+ * once per batch (does nothing if progress is not being reported).
+ * 
+ * bytes: number of bytes processed since the last call
+ * matches: number of matches found since the last call
+ */
+static inline void progress_add(uint64_t bytes, uint64_t matches) {
+    if (!prog.active) return;
+    atomic_fetch_add_explicit(&prog.done, bytes, memory_order_relaxed);
+    if (matches) atomic_fetch_add_explicit(&prog.found, matches, memory_order_relaxed);
+}
+
+/*
+ * Function: progress_stop()
+ * -----------------------------
+ * Stops the progress timer of the current operation and prints the final 
+ * progress line, ending it with a newline.
+ */
+void progress_stop() {
+    if (!prog.active) return;
+
+    pthread_mutex_lock(&prog.lock);
+    prog.stop = 1;
+    pthread_cond_signal(&prog.cond);
+    pthread_mutex_unlock(&prog.lock);
+    pthread_join(prog.tid, NULL);
+
+    progress_print();
+    fprintf(stderr, "\n");
+    prog.active = 0;
+}
+
+/* --- JSON OUTPUT --- */
+
+// time the program started, used for the timings of JSON records
+static struct timespec json_start;
+
+/*
+ * Function: json_init()
+ * -----------------------------
+ * Prepares stdout for JSON Lines output (--json): records are written into a 
+ * fully buffered IO_BUFSIZE output buffer, so millions of records cost a few
+ * large writes rather than one per line, and the start time is recorded for
+ * the timings of the records.
+ */
+void json_init() {
+    char *buf = (char *) malloc(IO_BUFSIZE);
+    if (!buf) die("malloc");
+    setvbuf(stdout, buf, _IOFBF, IO_BUFSIZE);
+    clock_gettime(CLOCK_MONOTONIC, &json_start);
+}
+
+/*
+ * Function: utf8_len()
+ * -----------------------------
+ * Finds the length of the UTF-8 sequence starting at a byte of 0x80 or above.
+ * Overlong sequences, surrogates, code points above U+10FFFF and sequences 
+ * cut short by the end of the string are not valid.
+ * 
+ * s: first byte of the sequence
+ * end: end of the string
+ * 
+ * returns: length of the sequence (2 to 4), or 0 if it is not valid UTF-8
+ */
+int utf8_len(const unsigned char *s, const unsigned char *end) {
+    int len, i;
+    // Lowest and highest value of the second byte (narrower for the first bytes
+    // that would allow overlong sequences, surrogates or code points past U+10FFFF)
+    unsigned char lo = 0x80, hi = 0xbf;
+
+    if (*s >= 0xc2 && *s <= 0xdf) len = 2;
+    else if (*s >= 0xe0 && *s <= 0xef) len = 3;
+    else if (*s >= 0xf0 && *s <= 0xf4) len = 4;
+    else return 0;
+
+    if (*s == 0xe0) lo = 0xa0;
+    else if (*s == 0xed) hi = 0x9f;
+    else if (*s == 0xf0) lo = 0x90;
+    else if (*s == 0xf4) hi = 0x8f;
+
+    if (end - s < len || s[1] < lo || s[1] > hi) return 0;
+    for (i = 2; i < len; i++) {
+        if (s[i] < 0x80 || s[i] > 0xbf) return 0;
+    }
+    return len;
+}
+
+/*
+ * Function: json_str()
+ * -----------------------------
+ * Writes a string as a quoted JSON string to stdout. Runs of characters that
+ * need no escaping (including valid UTF-8 sequences) are written as a whole,
+ * and quotes, backslashes and control characters are escaped. Bytes that are 
+ * not part of valid UTF-8 (binary data) are escaped as \u00XX, so they read 
+ * back as the latin-1 character of the byte and the record stays valid JSON.
+ * 
+ * s: string to write (need not be NUL terminated)
+ * len: length of the string
+ */
+void json_str(const char *s, size_t len) {
+    static const char hex[] = "0123456789abcdef";
+    const char *run = s, *end = s + len;
+    unsigned char c;
+    int n;
+
+    putchar('"');
+    for (; s < end; s++) {
+        c = *s;
+        if (c >= 0x20 && c < 0x80 && c != '"' && c != '\\') continue;
+        // Valid UTF-8 sequences are kept in the run
+        if (c >= 0x80 && (n = utf8_len((const unsigned char *) s, (const unsigned char *) end))) {
+            s += n - 1;
+            continue;
+        }
+        // Write the run of plain characters before the character, then the character escaped
+        fwrite(run, 1, s - run, stdout);
+        run = s + 1;
+        putchar('\\');
+        if (c == '"' || c == '\\') putchar(c);
+        else if (c == '\n') putchar('n');
+        else if (c == '\r') putchar('r');
+        else if (c == '\t') putchar('t');
+        else printf("u00%c%c", hex[c >> 4], hex[c & 15]);
+    }
+    fwrite(run, 1, s - run, stdout);
+    putchar('"');
+}
+
+/*
+ * Function: json_begin()
+ * -----------------------------
+ * Starts a JSON record with its type, the operation that produced it and the
+ * file it describes. Further fields are printed by the caller (starting with a
+ * comma), and the record is finished with json_end().
+ * 
+ * type: type of the record (e.g. "match", "summary", "result")
+ * op: name of the operation
+ * fpath: path to the file (NULL if none)
+ */
+void json_begin(const char *type, const char *op, const char *fpath) {
+    printf("{\"type\":\"%s\",\"op\":\"%s\"", type, op);
+    if (fpath) {
+        printf(",\"file\":");
+        json_str(fpath, strlen(fpath));
+    }
+}
+
+/*
+ * Function: json_end()
+ * -----------------------------
+ * Finishes a JSON record started with json_begin(), optionally adding the 
+ * time in milliseconds since the program started.
+ * 
+ * timed: whether to add the elapsed time to the record
+ */
+void json_end(int timed) {
+    if (timed) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        printf(",\"elapsed_ms\":%.3f", (now.tv_sec - json_start.tv_sec) * 1e3 + (now.tv_nsec - json_start.tv_nsec) / 1e6);
+    }
+    fputs("}\n", stdout);
+}
+
+/*
+ * Function: json_line()
+ * -----------------------------
+ * Starts a JSON record describing a line of a file: its line number, the byte
+ * offset of its start in the file and its text (without newline chars). The
+ * record is finished with json_end().
+ * 
+ * type: type of the record (e.g. "line", "match", "context")
+ * op: name of the operation
+ * fpath: path to the file
+ * lineno: line number of the line
+ * offset: byte offset of the start of the line in the file
+ * line: pointer to the start of the line
+ * len: length of the line
+ */
+void json_line(const char *type, const char *op, const char *fpath, size_t lineno, uint64_t offset, const char *line, size_t len) {
+    json_begin(type, op, fpath);
+    printf(",\"line\":%lu,\"offset\":%lu,\"text\":", lineno, (unsigned long) offset);
+    json_str(line, len);
+}
+
+/*
+ * Function: json_spans()
+ * -----------------------------
+ * Adds the spans of the matches in a line to a JSON record, as a list of 
+ * [start, end) byte offsets within the line. Matches of a string are found 
+ * with memmem() without overlapping, as searches count them. Matches of a 
+ * compiled regex are found with regex_match() over the line itself, stepping
+ * past empty matches.
+ * 
+ * line: pointer to the start of the line
+ * len: length of the line
+ * key: string whose matches are listed (NULL for regex)
+ * klen: length of the string
+ * reg: compiled regex whose matches are listed (NULL for string)
+ * 
+ * returns: number of matches listed
+ */
+int json_spans(const char *line, size_t len, const char *key, size_t klen, regex_t *reg) {
+    const char *p, *end = line + len;
+    const char *sep = "";
+    regmatch_t m;
+    size_t off, mlen;
+    int n = 0;
+
+    printf(",\"spans\":[");
+    if (reg) {
+        for (off = 0; off <= len; off = m.rm_eo > m.rm_so ? (size_t) m.rm_eo : (size_t) m.rm_eo + 1) {
+            if (regex_match(reg, line, off, len, &m, off ? REG_NOTBOL : 0)) break;
+            printf("%s[%ld,%ld]", sep, (long) m.rm_so, (long) m.rm_eo);
+            sep = ",";
+            n++;
+        }
+    } else {
+        for (p = line; (p = find_key(line, p, end - p, key, klen, &mlen)) != NULL; p += mlen) {
+            printf("%s[%ld,%ld]", sep, (long) (p - line), (long) (p - line + mlen));
+            sep = ",";
+            n++;
+        }
+    }
+    putchar(']');
+    return n;
+}
+
+/*
+ * Function: json_result()
+ * -----------------------------
+ * Prints the JSON record of an operation that changed a file, with the number
+ * of lines in the file afterwards and the time taken.
+ * 
+ * op: name of the operation
+ * fpath: path to the file changed
+ * lines: number of lines in the file after the operation (-1 if none)
+ */
+void json_result(const char *op, const char *fpath, ssize_t lines) {
+    json_begin("result", op, fpath);
+    if (lines >= 0) printf(",\"lines\":%ld", (long) lines);
+    json_end(1);
+}
+
+/*
+ * Function: json_summary()
+ * -----------------------------
+ * Prints the JSON record ending a search, with the number of matches found, 
+ * the number of lines they were found in and the time taken.
+ * 
+ * op: name of the operation
+ * fpath: path to the file searched
+ * matches: number of matches found
+ * lines: number of lines containing matches (-1 if not known)
+ */
+void json_summary(const char *op, const char *fpath, long matches, long lines) {
+    json_begin("summary", op, fpath);
+    printf(",\"matches\":%ld", matches);
+    if (lines >= 0) printf(",\"lines\":%ld", lines);
+    json_end(1);
+}
+
+/*
+ * Function: json_error()
+ * -----------------------------
+ * Prints the JSON record of an error that stops an operation.
+ * 
+ * op: name of the operation
+ * fpath: path to the file (NULL if none)
+ * msg: description of the error
+ */
+void json_error(const char *op, const char *fpath, const char *msg) {
+    json_begin("error", op, fpath);
+    printf(",\"message\":");
+    json_str(msg, strlen(msg));
+    json_end(1);
+}
+
+/* --- METADATA --- */
+
+/*
+ * Struct stored in the META_XATTR extended attribute of files edited by the
+ * program. Caches the number of lines in the file (flags are reserved and 
+ * always 0). The cache is only trusted while the size, modification time and
+ * fingerprint still match the file.
+ */
+struct file_meta {
+    uint32_t version;
+    uint32_t idxversion;
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t fingerprint;
+    uint64_t lines;
+    uint64_t flags;
+};
+
+/*
+ * Function: fingerprint()
+ * -----------------------------
+ * Computes a cheap fingerprint of a file's contents: an FNV-1a hash of the
+ * size and the first and last META_SAMPLE bytes of the file. Reads at most two
+ * small blocks, so it takes the same time whatever the size of the file.
+ *
+ * fd: file descriptor of the file
+ * size: length of the file
+ *
+ * returns: fingerprint of the file
+ */
+uint64_t fingerprint(int fd, off_t size) {
+    unsigned char buf[META_SAMPLE];
+    uint64_t hash = 0xcbf29ce484222325ull ^ (uint64_t) size;
+    ssize_t n, i;
+    int part;
+
+    // Hash the start of the file, then the end of the file
+    for (part = 0; part < 2; part++) {
+        off_t off = part == 0 ? 0 : size - META_SAMPLE;
+        if (off < 0) off = 0;
+        n = pread(fd, buf, META_SAMPLE, off);
+        for (i = 0; i < n; i++) hash = (hash ^ buf[i]) * 0x100000001b3ull;
+    }
+
+    return hash;
+}
+
+/*
+ * Function: meta_load()
+ * -----------------------------
+ * Reads the cached metadata of a file from its extended attribute and checks
+ * that it still describes the file. Filesystems without extended attributes
+ * and files that have never been edited simply have no valid metadata.
+ *
+ * fpath: path to the file
+ * meta: struct filled in with the cached metadata
+ *
+ * returns: 0 if valid metadata was loaded, else -1
+ */
+int meta_load(const char *fpath, struct file_meta *meta) {
+    struct stat sb;
+
+    // Read attribute and check its version (missing attribute or no xattr support is not an error)
+    if (getxattr(fpath, META_XATTR, meta, sizeof(*meta)) != sizeof(*meta)) return -1;
+    if (meta->version != META_VERSION || meta->idxversion != IDXVERSION) return -1;
+
+    // If the size or modification time of the file have changed, metadata is not used
+    int fd = open(fpath, O_RDONLY);
+    if (fd == -1) return -1;
+    if (fstat(fd, &sb) || meta->size != (uint64_t) sb.st_size || meta->mtime_sec != sb.st_mtim.tv_sec
+            || meta->mtime_nsec != sb.st_mtim.tv_nsec || meta->fingerprint != fingerprint(fd, sb.st_size)) {
+        close(fd);
+        return -1;
+    }
+
+    close(fd);
+    return 0;
+}
+
+/*
+ * Function: meta_store()
+ * -----------------------------
+ * Stores the metadata of a file in its extended attribute, recording the
+ * current size, modification time and fingerprint of the file along with the
+ * provided line count. Failures (such as filesystems without extended
+ * attributes, or files the program cannot write) are ignored, as the cache is
+ * only an optimisation.
+ *
+ * fpath: path to the file
+ * lines: number of lines in the file
+ */
+void meta_store(const char *fpath, size_t lines) {
+    struct file_meta meta;
+    struct stat sb;
+
+    int fd = open(fpath, O_RDONLY);
+    if (fd == -1) return;
+    if (fstat(fd, &sb)) {
+        close(fd);
+        return;
+    }
+
+    memset(&meta, 0, sizeof(meta));
+    meta.version = META_VERSION;
+    meta.idxversion = IDXVERSION;
+    meta.size = sb.st_size;
+    meta.mtime_sec = sb.st_mtim.tv_sec;
+    meta.mtime_nsec = sb.st_mtim.tv_nsec;
+    meta.fingerprint = fingerprint(fd, sb.st_size);
+    meta.lines = lines;
+    close(fd);
+
+    setxattr(fpath, META_XATTR, &meta, sizeof(meta), 0);
+}
+
+/*
+ * Function: file_lines()
+ * -----------------------------
+ * Finds the number of lines in a file, using the cached metadata when it is
+ * valid. Otherwise, lines are counted with count_file(). The count is not 
+ * cached, as read-only operations (-cl, -sh, -lsh) must not change the ctime 
+ * of the file or fail on read-only mounts, and edits cache the line count of
+ * the file they leave with after_edit().
+ *
+ * fpath: path to the file
+ *
+ * returns: number of lines in the file
+ */
+size_t file_lines(const char *fpath) {
+    struct file_meta meta;
+
+    // If metadata is valid, return cached line count
+    if (!meta_load(fpath, &meta)) return meta.lines;
+
+    // Otherwise count lines
+    return count_file(fpath);
+}
+
+/* --- INPUT PROCESSING --- */
+
+/*
+ * Function: empty_buffer()
+ * -----------------------------
+ * Empties the stdin buffer so that no characters carry over to next fgets
+ * call by reading each character until a newline character is read
+ */
+void empty_buffer() {
+    char c;
+    // Reads characters from stdin until end of line is reached
+    while ((c = getchar()) != '\n' && c != EOF) {}
+}
+
+/*
+ * Function: confirm()
+ * -----------------------------
+ * Prompts user to confirm and enter y or n to stdin. Whilst the input is not 
+ * 'y' or 'n', user is continously prompted. Checks for validation include
+ * whether EOF character was entered, whether the string is of correct length, 
+ * and finally whether the string corresponds to 'y' or 'n'. Empties input
+ * buffer when required to. With --json, prompts are written to stderr, so 
+ * they are shown straight away and stdout only holds JSON records.
+ * 
+ * returns: 1 if 'y' entered, else 0
+ */
+int confirm() {
+    FILE *out = opts.json ? stderr : stdout;
+    char buf[5];
+    char c;
+    // While input is invalid 
+    while (1) {
+        // Prompt for input
+        fprintf(out, "\nConfirm (y/n): ");
+
+        // Take user input and if error or EOF, print error and exit
+        if (!fgets(buf, 4, stdin)) {
+            if (ferror(stdin)) {
+                die("fgets");
+            } else {
+                fprintf(stderr, "\nEOF Character entered. Program quitting.\n");
+                exit(1);
+            }
+        }
+
+        // If user input is not correct length, inform user
+        if (strlen(buf) != 2) {
+            fprintf(out, "Invalid input.\n");
+            // Empty buffer if input overloaded
+            if (strlen(buf) > 2 && buf[2] != '\n') empty_buffer();
+            continue;
+        }
+
+        c = buf[0];
+        // If input is valid option, return 1 is y and 0 if n
+        if (c == 'y' || c == 'n') {
+            return c == 'y' ? 1 : 0;
+        // If input not valid, inform user
+        } else {
+            fprintf(out, "Invalid input.\n");
+        }
+    }
+}
+
+/*
+ * Function: is_number() 
+ * -----------------------------
+ * Checks whether all characters in a string are numerical digits.
+ * Used as validation function pointer passed to input() for numeric inputs.
+ * 
+ * str: pointer to Char array being checked
+ * 
+ * returns: 0 if characters are numerical else 1 
+ */
+int is_number(const char* str) {
+    int i;
+    // Loops through char array
+    for (i = 0; str[i] != '\0'; i++) {
+        // If char at current index is not numerical returns 1
+        if (!isdigit(str[i])) {
+            return 1;
+        }
+    }
+    // If all chars numerical return 0
+    return 0;
+}
+
+/*
+ * Function parse_num()
+ * -----------------------------
+ * Checks whether string is a valid number, and is not too long (or too short 
+ * - empty stry) before attempting to parse string to unsigned long int. If any
+ * checks are failed, program quits.
+ * 
+ * input: string to validate as numerical and convert to number 
+ * maxlen: maximum allowed length of string
+ * 
+ * return: unsigned long int retrieved from string
+ */
+size_t parse_num (char *input, int maxlen) {
+    // If string is not numerical, error message printed and program quits
+    if (is_number(input)) {
+        fprintf(stderr, "Invalid Line number Input: Non-digit\n");
+        exit(1);
+    }
+
+    // If string is too long, error message printed and program quits
+    if (strlen(input) > maxlen) {
+        fprintf(stderr, "Invalid Line number Input: Too long\n");
+        exit(1);
+    }
+
+    //If string is empty, error message printed and program quits
+    if (strlen(input) < 1) {
+        fprintf(stderr, "Invalid Line number Input: Empty string\n");
+        exit(1);
+    }
+
+    // Attempt to convert string to unsigned long int 
+    char *endptr;
+    errno = 0;
+    size_t line = (size_t) strtol(input, &endptr, 10);
+    // If error occurred, error message printed and program quits
+    if (errno) {
+        fprintf(stderr, "Invalid argument for line number - must be a valid unsigned long int\n");
+        die("strtol");
+    }
+
+    return line;
+}
+
+/*
+ * Function valid_fname()
+ * -----------------------------
+ * Checks whether provided string is a valid file path to be created using a 
+ * regex expression. File names can start with alphanumerics and select symbols
+ * including: (.) (_) (-); spaces can occur in the middle of a file name. 
+ * 
+ * input: file path being checked for validity
+ */
+void valid_fname (char *input) {
+    regex_t reg;
+    int temp;
+
+    // Compiles regex expression to check for valid file path
+    if (temp = regcomp(&reg, FNAME, REG_ICASE | REG_EXTENDED | REG_NOSUB)) {
+        // If error, error message printed and program quits
+        char *buffer = (char *) malloc(MAX);
+        regerror(temp, &reg, buffer, sizeof(buffer));
+        fprintf(stderr,"grep: %s (%s)\n", buffer, FNAME);
+        free(buffer);
+        exit(1);
+    }
+
+    // Runs the compiled regex pattern on the string to check for matches
+    if (regexec(&reg, input, 0, NULL, 0) != 0) {
+        // If no matches, error message printed and program quits
+        printf("Invalid filename\n");
+        regfree(&reg);
+        exit(1);
+    }
+
+    regfree(&reg);
+}
+
+/*
+ * Function parse_string()
+ * -----------------------------
+ * Checks whether length of string is within a maximum and minimum length limit. 
+ * If checks failed, program quits. 
+ */
+void parse_string (char *input, int maxlen, int minlen, int arg) {
+    // If string is too long, error message printed and program quits
+    if (strlen(input) > maxlen) {
+        fprintf(stderr, "Invalid Input (Argument %d): Too long\n", arg);
+        exit(1);
+    }
+
+    // If string is too short, error message printed and program quits
+    if (strlen(input) < minlen) {
+        fprintf(stderr, "Invalid Input (Argument %d): Too short\n", arg);
+        exit(1);
+    }
+}
+
+/* --- CHANGE LOG --- */
+
+/*
+ * Function truncate_log()
+ * -----------------------------
+ * Ensures that the log file does not get too large, by checking how many logs 
+ * there are, and if it exceeds the predefined limit, old logs are removed such
+ * that there are 10 less than the limit. Before reading, validates that log 
+ * file is safe for reading using fgets().
+ * If there are any errors, any open files are closed, valid error messages are 
+ * printed and the program safely quits. 
+ */
+void truncate_log() {
+    // Attempts to open log file in read mode (with error handling)
+    FILE *fptr = fopen(LOGF, "r");
+    if (!fptr) die("fopen log");
+
+    ssize_t logs;
+    // Obtain number of logs in log file and check if log file is safe for fgets()
+    if ((logs = verify_lines(&fptr, LOGLEN - 2)) == -1){
+        // If not safe for fgets, user prompted and program quits
+        puts("Warning: Log file has been edited by another program. Modify file to meet constraint or Delete file.\n");
+        fclose(fptr);
+        exit(1);
+    }
+
+    // If logs exceed limit
+    if (logs > CLOG_BUFFER) {
+        // Reset file pointer to start of file (with error handling)
+        if (fseek(fptr, 0, SEEK_SET)) {
+            fclose(fptr);
+            die("fseek");
+        }
+        
+        // Attempts to open temp file in write mode (with error handling), dropping
+        // any checkpoint that refers to the temp file about to be overwritten
+        remove(CKPTF);
+        FILE *temp = fopen(TEMPF, "w");
+        if (!temp) {
+            fclose(fptr);
+            die("fopen temp");
+        }
+
+        char *line = (char *) malloc(LOGLEN);
+
+        // Read lines from log file until End Of File
+        while (fgets(line, LOGLEN - 1, fptr) != NULL) {
             // Write line to temp file if, number of remaing logs is 10 less than the limits
             if (logs > CLOG_BUFFER - 10) --logs;
             else fputs(line, temp);
         }
-        
-        // Close both log and temp files
-        fclose(temp);
-        fclose(fptr);
+        
+        // Close both log and temp files
+        fclose(temp);
+        fclose(fptr);
+
+        // Attempts to delete original log file (with error handling)
+        if (remove(LOGF)) {
+            fprintf(stderr, "Error removing original log file. Warning there will be temp files remaining.\n");
+            die("remove");
+        }
+
+        // Attempts to rename temp file to replace log file (with error handling)
+        if (rename(TEMPF, LOGF)) {
+            fprintf(stderr, "Error renaming temp file. Warning temp file will be remaining.\n");
+            die("rename");
+        }
+
+    // Otherwise, if logs does not exceed limit, close log file
+    } else {
+        fclose(fptr);
+    }
+}
+
+/*
+ * Function: change_log()
+ * -----------------------------
+ * Write the provided logstr argment to the end of the log file (if log file 
+ * does not exist, it is created). The logstr is written alongside a timestamp. 
+ * After writing, truncateLog() is called to ensure the log file does not become
+ * too long.
+ * 
+ * logstr: formatted log string (describing operation) to be appended to log file 
+ */
+void change_log(char *logstr) {
+    // Retrieve current time
+    time_t t = time(NULL);
+    struct tm* timeinfo;
+    timeinfo = localtime(&t);
+    
+    // Attempt to open log file in append plus mode (with error handling)
+    FILE *fptr = fopen(LOGF, "a+");
+    if (!fptr) die("fopen log");
+
+    // Add time in correct format with log string to the end of the log file
+    fprintf(fptr, "[%04d-%02d-%02d %02d:%02d:%02d] %s\n", timeinfo->tm_year + 1900, timeinfo->tm_mon + 1, 
+        timeinfo->tm_mday, timeinfo->tm_hour, timeinfo->tm_min, timeinfo->tm_sec, logstr);
+    
+    // Close the log file
+    fclose(fptr);
+    // Manage log file length
+    truncate_log();
+}
+
+/*
+ * Function: json_log()
+ * -----------------------------
+ * Prints a line of the log file as a JSON record, with the timestamp written
+ * by change_log() ("[YYYY-MM-DD HH:MM:SS] ") split from the message. Lines 
+ * without a timestamp are printed with the whole line as the message.
+ * 
+ * line: line read from the log file
+ */
+void json_log(const char *line) {
+    size_t len = strlen(line);
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) len--;
+
+    json_begin("log", "log", NULL);
+    if (len >= 22 && line[0] == '[' && line[20] == ']' && line[21] == ' ') {
+        printf(",\"time\":");
+        json_str(line + 1, 19);
+        line += 22;
+        len -= 22;
+    }
+    printf(",\"message\":");
+    json_str(line, len);
+    json_end(0);
+}
+
+/*
+ * Function display_log()
+ * -----------------------------
+ * Verifies the log file is safe for reading with fgets and then proceeds to 
+ * read logs from the log file. If a file path is specified, then only logs 
+ * related to the file path will be printed, otherwise if the file path is NULL,
+ * all the logs will be printed. This is done by searching for a search key in 
+ * each of the lines and ensuring it occurs before any quotation marks used to 
+ * encase literal strings that were added to the files. With --json, lines are
+ * printed as records by json_log().
+ * 
+ * fpath: path to file for which the change log is to be displayed (if NULL all
+ * logs will be displayed)
+ */
+void display_log(char *fpath) {
+    // If log file does not exist (or cannot be accessed), error message is printed and program quits
+    if (access(LOGF, F_OK)) {
+        if (opts.json) json_error("log", fpath, "Log file does not exist.");
+        else printf("Log file does not exist.\n");
+        exit(1);
+    }
+
+    // Attempt to open log file in read mode (with error handling)
+    FILE *fptr = fopen(LOGF, "r");
+    if (!fptr) die("fopen log");
+
+    // If log file is not safe for fgets(), error message is printed and program quits
+    if (verify_lines(&fptr, LOGLEN - 2) == -1){
+        puts("Warning: Log file has been edited by another program. Modify file to meet constraint or Delete file.\n");
+        fclose(fptr);
+        exit(1);
+    }
+
+    // File pointer is reset to start of file (with error handling)
+    if (fseek(fptr, 0, SEEK_SET)) {
+        fclose(fptr);
+        die("fseek");
+    }
+
+    // If fpath is not NULL, a search key is constructed 
+    char key[MAX];
+    if (fpath != NULL) {
+        snprintf(key, MAX, "File \'%s\'", fpath);    
+    }
+
+    char *line = (char *) malloc(LOGLEN);
+    char *found;
+    int index;
+    int show;
+    
+    // Read lines from log file until End Of File
+    while (fgets(line, LOGLEN - 1, fptr) != NULL) {
+        // If fpath is NULL, print all lines
+        if (fpath == NULL) {
+            show = 1;
+        // Otherwise, if search key found in line
+        } else if ((found = strstr(line, key)) != NULL) {
+            // Ensure that the search key occurs before any quotation marks
+            index = found - line;
+            show = (found = strchr(line, '\"')) == NULL || index < found - line;
+        } else {
+            show = 0;
+        }
+
+        if (!show) continue;
+        if (opts.json) {
+            json_log(line);
+        } else {
+            printf("%s", line);
+        }
+    }
+
+    free(line);
+    // Close the log file
+    fclose(fptr);
+}
+
+/* --- CHECKPOINTS --- */
+
+/*
+ * Struct stored in the checkpoint file (CKPTF) by rewrite operations (replace,
+ * del_line, ins_line, rep_line). Records the operation and its arguments, the
+ * identity of the source file when the operation started, and the state of 
+ * the operation at the last checkpoint: the offset of the source up to which
+ * it was processed, the length of the temp file at that point, the line 
+ * number reached and the counters of the operation (count is the number of 
+ * replacements for replace and the line counter for line operations, newlines
+ * is the number of newlines written for line operations and whether a newline
+ * was added for replace). Flags record the options the operation was run 
+ * with (CKPT_ICASE, CKPT_WORD). The device, inode and fingerprint of the temp
+ * file (up to temp_len) identify the temp file the checkpoint refers to, so 
+ * that a temp file overwritten by another operation is never resumed from.
+ */
+struct checkpoint {
+    char magic[8];
+    uint32_t version;
+    uint32_t op;
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t fingerprint;
+    uint64_t src_off;
+    uint64_t temp_len;
+    uint64_t line;
+    uint64_t count;
+    uint64_t newlines;
+    uint64_t lineno;
+    uint64_t flags;
+    uint64_t temp_dev;
+    uint64_t temp_ino;
+    uint64_t temp_fingerprint;
+    char fpath[MAXF + 1];
+    char key[MAX + 1];
+    char sub[MAX + 1];
+};
+
+/*
+ * Function: ckpt_init()
+ * -----------------------------
+ * Prepares the checkpoint of a rewrite operation that is starting, recording 
+ * the operation, its arguments and the identity of the source file. Any 
+ * checkpoint left by an earlier interrupted operation is removed, as the temp
+ * file it refers to is about to be overwritten.
+ * 
+ * ck: checkpoint being prepared
+ * op: operation (CKPT_ enum)
+ * fpath: path to the file being rewritten
+ * key: first string argument of the operation (NULL if none)
+ * sub: second string argument of the operation (NULL if none)
+ * lineno: line number argument of the operation (0 if none)
+ */
+void ckpt_init(struct checkpoint *ck, int op, const char *fpath, const char *key, const char *sub, size_t lineno) {
+    struct stat sb;
+
+    memset(ck, 0, sizeof(*ck));
+    memcpy(ck->magic, CKPTMAGIC, 8);
+    ck->version = CKPT_VERSION;
+    ck->op = op;
+    ck->lineno = lineno;
+    ck->flags = (opts.icase ? CKPT_ICASE : 0) | (opts.word ? CKPT_WORD : 0);
+    snprintf(ck->fpath, sizeof(ck->fpath), "%s", fpath);
+    if (key) snprintf(ck->key, sizeof(ck->key), "%s", key);
+    if (sub) snprintf(ck->sub, sizeof(ck->sub), "%s", sub);
+
+    // Record the identity of the source, checked before resuming
+    int fd = open(fpath, O_RDONLY);
+    if (fd != -1) {
+        if (!fstat(fd, &sb)) {
+            ck->size = sb.st_size;
+            ck->mtime_sec = sb.st_mtim.tv_sec;
+            ck->mtime_nsec = sb.st_mtim.tv_nsec;
+            ck->fingerprint = fingerprint(fd, sb.st_size);
+        }
+        close(fd);
+    }
+
+    remove(CKPTF);
+}
+
+/*
+ * Function: ckpt_save()
+ * -----------------------------
+ * Saves a checkpoint of a rewrite operation. The temp file is flushed and 
+ * synced first, so the checkpoint never refers to data that could be lost. 
+ * The checkpoint is written to a new file which is synced and renamed over 
+ * the old one, so an interruption leaves either the old or new checkpoint.
+ * Failures are ignored, as they only lose the ability to resume.
+ * 
+ * ck: checkpoint of the operation (from ckpt_init())
+ * temp: temp file being written by the operation
+ * src_off: offset of the source up to which it has been processed
+ * line: line number reached
+ * count: first counter of the operation
+ * newlines: second counter of the operation
+ */
+void ckpt_save(struct checkpoint *ck, FILE *temp, uint64_t src_off, uint64_t line, uint64_t count, uint64_t newlines) {
+    char path[sizeof(CKPTF) + 4];
+    struct stat tb;
+    off_t len;
+
+    // Make the temp file durable up to its current length
+    if (fflush(temp) || (len = ftello(temp)) == -1 || fdatasync(fileno(temp)) || fstat(fileno(temp), &tb)) return;
+
+    ck->src_off = src_off;
+    ck->temp_len = len;
+    ck->temp_dev = tb.st_dev;
+    ck->temp_ino = tb.st_ino;
+    ck->temp_fingerprint = fingerprint(fileno(temp), len);
+    ck->line = line;
+    ck->count = count;
+    ck->newlines = newlines;
+
+    // Write the checkpoint to a new file and rename it over the old checkpoint
+    snprintf(path, sizeof(path), "%s.new", CKPTF);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd == -1) return;
+    if (write(fd, ck, sizeof(*ck)) != sizeof(*ck) || fsync(fd)) {
+        close(fd);
+        remove(path);
+        return;
+    }
+    close(fd);
+    rename(path, CKPTF);
+}
+
+/*
+ * Function: ckpt_temp()
+ * -----------------------------
+ * Opens the temp file of a rewrite operation (for reading as well, so that 
+ * ckpt_save() can fingerprint it). A new operation truncates the temp file, 
+ * while a resumed operation keeps the temp file up to the length
+ * recorded in its checkpoint (discarding anything written after it) and 
+ * continues writing from there.
+ * 
+ * resume: checkpoint being resumed from (NULL for a new operation)
+ * 
+ * returns: pointer to the opened temp file, or NULL if it cannot be opened
+ */
+FILE *ckpt_temp(struct checkpoint *resume) {
+    if (!resume) return fopen(TEMPF, "w+");
+
+    FILE *temp = fopen(TEMPF, "r+");
+    if (!temp) return NULL;
+    if (ftruncate(fileno(temp), resume->temp_len) || fseeko(temp, 0, SEEK_END)) {
+        fclose(temp);
+        return NULL;
+    }
+    return temp;
+}
+
+/*
+ * Function: ckpt_load()
+ * -----------------------------
+ * Loads the checkpoint of an interrupted rewrite operation and checks that it
+ * can be resumed: the source file must be unchanged since the operation 
+ * started, and the temp file must be the one written by the operation (same
+ * device, inode and fingerprint) and hold all the data written up to the 
+ * checkpoint. If not, error message is printed.
+ * 
+ * ck: struct filled in with the checkpoint
+ * 
+ * returns: 0 if the operation can be resumed, else -1
+ */
+int ckpt_load(struct checkpoint *ck) {
+    struct stat sb;
+
+    // Attempts to read checkpoint (with error handling)
+    int fd = open(CKPTF, O_RDONLY);
+    if (fd == -1) {
+        fprintf(stderr, "No interrupted operation to resume.\n");
+        return -1;
+    }
+    ssize_t n = read(fd, ck, sizeof(*ck));
+    close(fd);
+    if (n != sizeof(*ck) || memcmp(ck->magic, CKPTMAGIC, 8) || ck->version != CKPT_VERSION) {
+        fprintf(stderr, "Checkpoint file \'%s\' is not valid.\n", CKPTF);
+        return -1;
+    }
+    ck->fpath[MAXF] = ck->key[MAX] = ck->sub[MAX] = '\0';
+
+    // The source must not have changed since the operation started
+    fd = open(ck->fpath, O_RDONLY);
+    if (fd == -1 || fstat(fd, &sb) || ck->size != (uint64_t) sb.st_size || ck->mtime_sec != sb.st_mtim.tv_sec
+            || ck->mtime_nsec != sb.st_mtim.tv_nsec || ck->fingerprint != fingerprint(fd, sb.st_size)) {
+        if (fd != -1) close(fd);
+        fprintf(stderr, "File \'%s\' has changed since the operation was interrupted and it cannot be resumed.\n", ck->fpath);
+        return -1;
+    }
+    close(fd);
+
+    // The temp file must hold everything written before the checkpoint
+    fd = open(TEMPF, O_RDONLY);
+    if (fd == -1 || fstat(fd, &sb) || (uint64_t) sb.st_size < ck->temp_len) {
+        if (fd != -1) close(fd);
+        fprintf(stderr, "Temp file \'%s\' is missing or incomplete and the operation cannot be resumed.\n", TEMPF);
+        return -1;
+    }
+
+    // And must not have been overwritten by another operation since the checkpoint
+    if (ck->temp_dev != (uint64_t) sb.st_dev || ck->temp_ino != (uint64_t) sb.st_ino
+            || ck->temp_fingerprint != fingerprint(fd, ck->temp_len)) {
+        close(fd);
+        fprintf(stderr, "Temp file \'%s\' was overwritten by another operation and the operation cannot be resumed.\n", TEMPF);
+        return -1;
+    }
+    close(fd);
+
+    return 0;
+}
+
+/* --- INDEX --- */
+
+/*
+ * Header at the start of a line index sidecar file. Records the size and
+ * modification time of the file when it was indexed (so stale indexes can be
+ * detected), the results of the fgets() safety checks done by verify_lines()
+ * and the number of entries in each of the sections that follow the header.
+ * The header is followed by the block table, the trigram directory, the
+ * compressed posting lists and the Bloom filters of the blocks, in that order
+ * (the flags record which of the optional sections are present).
+ */
+struct lidx_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t flags;
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t lines;
+    uint64_t maxline;
+    uint64_t nul;
+    uint64_t nblocks;
+    uint64_t ntrigrams;
+    uint64_t postlen;
+    uint64_t bloomlen;
+};
+
+/*
+ * Entry of the block table. Blocks start at the beginning of a line, so each
+ * block records its byte offset and the line number of its first line.
+ */
+struct lidx_block {
+    uint64_t offset;
+    uint64_t line;
+};
+
+/*
+ * Entry of the trigram directory (sorted by trigram). The posting list of a
+ * trigram is a list of the blocks containing it, stored as varint encoded
+ * differences between consecutive block numbers.
+ */
+struct lidx_tri {
+    uint32_t tri;
+    uint32_t len;
+    uint64_t offset;
+};
+
+/*
+ * Struct describing a line index sidecar file that has been mapped into memory
+ * with load_index(), with pointers to each of the sections in the file.
+ */
+struct lidx {
+    void *map;
+    size_t maplen;
+    struct lidx_header *hdr;
+    struct lidx_block *blocks;
+    struct lidx_tri *dir;
+    unsigned char *post;
+    unsigned char *bloom;
+};
+
+/*
+ * Struct describing a range of lines of a file by its start and end offsets
+ * and the line number of the first line in the range.
+ */
+struct lidx_range {
+    uint64_t start;
+    uint64_t end;
+    uint64_t line;
+};
+
+/*
+ * Struct used while building a trigram index, holding the posting list of one
+ * trigram as it is built. last is one more than the last block added so that
+ * a trigram occurring many times in a block is only added once.
+ */
+struct tri_entry {
+    uint32_t tri;
+    uint32_t last;
+    unsigned char *post;
+    size_t len;
+    size_t cap;
+};
+
+/*
+ * Function: index_path()
+ * -----------------------------
+ * Builds the path of the line index sidecar file belonging to a file.
+ *
+ * fpath: path to the indexed file
+ * out: buffer of at least MAXF + 16 chars to write the sidecar path to
+ */
+void index_path(const char *fpath, char *out) {
+    snprintf(out, MAXF + 16, "%s%s", fpath, IDXEXT);
+}
+
+/*
+ * Function: drop_sidecar()
+ * -----------------------------
+ * Removes one of the sidecar files of a file (if it exists).
+ *
+ * fpath: path to the file whose sidecar is removed
+ * ext: extension of the sidecar file
+ */
+void drop_sidecar(const char *fpath, const char *ext) {
+    char ipath[MAXF + 16];
+    snprintf(ipath, sizeof(ipath), "%s%s", fpath, ext);
+    // Attempts to delete sidecar (a missing sidecar is not an error)
+    if (remove(ipath) && errno != ENOENT) perror("remove index");
+}
+
+/*
+ * Function: drop_index()
+ * -----------------------------
+ * Removes the index sidecar files of a file (if it has any). Called by 
+ * operations that modify a file without recording their changes, since the
+ * indexes no longer describe it.
+ *
+ * fpath: path to the file whose indexes are removed
+ */
+void drop_index(const char *fpath) {
+    drop_sidecar(fpath, IDXEXT);
+    drop_sidecar(fpath, SAEXT);
+    drop_sidecar(fpath, WIDXEXT);
+    drop_sidecar(fpath, WDELTAEXT);
+}
+
+/*
+ * Function: put_varint()
+ * -----------------------------
+ * Appends a number to a posting list using a variable length encoding of 7
+ * bits per byte, where the top bit marks that more bytes follow. Grows the
+ * list when required.
+ *
+ * post: pointer to the posting list
+ * len: pointer to the length of the posting list
+ * cap: pointer to the size of the posting list
+ * val: number to append
+ *
+ * returns: 0 if successful, else -1 if allocation fails
+ */
+int put_varint(unsigned char **post, size_t *len, size_t *cap, uint64_t val) {
+    // Ensure room for the largest encoding of a 64 bit number
+    if (*len + 10 > *cap) {
+        size_t size = *cap ? *cap * 2 : 16;
+        unsigned char *tmp = (unsigned char *) realloc(*post, size);
+        if (!tmp) return -1;
+        *post = tmp;
+        *cap = size;
+    }
+
+    // Write 7 bits at a time, lowest bits first
+    while (val >= 0x80) {
+        (*post)[(*len)++] = (unsigned char) (val | 0x80);
+        val >>= 7;
+    }
+    (*post)[(*len)++] = (unsigned char) val;
+    return 0;
+}
+
+/*
+ * Function: put_bytes()
+ * -----------------------------
+ * Appends bytes to a growing buffer (such as a posting list), doubling the 
+ * size of the buffer whenever it is full.
+ *
+ * buf: pointer to the buffer (may be NULL)
+ * len: pointer to the number of bytes used
+ * cap: pointer to the size of the buffer
+ * src: bytes to append
+ * n: number of bytes to append
+ *
+ * returns: 0 if successful, else -1 if allocation fails
+ */
+int put_bytes(unsigned char **buf, size_t *len, size_t *cap, const void *src, size_t n) {
+    if (*len + n > *cap) {
+        size_t size = *cap ? *cap * 2 : 16;
+        while (size < *len + n) size *= 2;
+        unsigned char *tmp = (unsigned char *) realloc(*buf, size);
+        if (!tmp) return -1;
+        *buf = tmp;
+        *cap = size;
+    }
+
+    memcpy(*buf + *len, src, n);
+    *len += n;
+    return 0;
+}
+
+/*
+ * Function: get_varint()
+ * -----------------------------
+ * Reads a number written by put_varint() and moves the pointer past it.
+ *
+ * p: pointer to position in posting list, moved past the number read
+ * end: end of the posting list
+ *
+ * returns: number read
+ */
+uint64_t get_varint(const unsigned char **p, const unsigned char *end) {
+    uint64_t val = 0;
+    int shift = 0;
+
+    // Read 7 bits at a time until a byte without the top bit is read
+    while (*p < end) {
+        unsigned char b = *(*p)++;
+        val |= (uint64_t) (b & 0x7f) << shift;
+        if (!(b & 0x80)) break;
+        shift += 7;
+    }
+    return val;
+}
+
+/*
+ * Function: cmp_tri()
+ * -----------------------------
+ * Comparison function for qsort() used to sort trigram entries by trigram.
+ */
+int cmp_tri(const void *a, const void *b) {
+    uint32_t x = ((const struct tri_entry *) a)->tri;
+    uint32_t y = ((const struct tri_entry *) b)->tri;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Function: bloom_bits()
+ * -----------------------------
+ * Finds the bits of a block's Bloom filter that represent a trigram. The bits
+ * are derived from two halves of a single multiplicative hash of the trigram.
+ *
+ * tri: trigram being hashed
+ * bits: array of IDX_BLOOM_K entries filled in with bit positions
+ */
+void bloom_bits(uint32_t tri, uint32_t *bits) {
+    uint64_t h = (tri + 1) * 0x9e3779b97f4a7c15ull;
+    uint32_t h1 = (uint32_t) (h >> 32), h2 = (uint32_t) h | 1;
+    int i;
+    for (i = 0; i < IDX_BLOOM_K; i++) bits[i] = (h1 + i * h2) & (IDX_BLOOM_BYTES * 8 - 1);
+}
+
+/*
+ * Function: build_index()
+ * -----------------------------
+ * Builds the line index of a file and writes it to the sidecar file. The file
+ * is read in chunks and split into blocks of about IDX_BLOCK bytes, which
+ * always end at the end of a line. For a trigram index, every (case folded) 
+ * trigram that does not contain a newline is added to a hash table, with a 
+ * posting list of the blocks it occurs in. For a Bloom index, the trigrams are
+ * instead added to a small Bloom filter of the block they occur in, which is
+ * cheaper to build and store but may report blocks that do not contain a key.
+ * Line counts and the checks of verify_lines() are done in the same pass and
+ * stored in the header. The sidecar is written to a temporary path and renamed
+ * into place so a partly written index is never used. If there are any errors,
+ * valid error messages are printed and program quits.
+ *
+ * fpath: path to file to be indexed
+ * flags: sections to be built (IDX_TRIGRAM and/or IDX_BLOOM)
+ */
+void build_index(char *fpath, int flags) {
+    // Attempts to open file in read mode (with error handling)
+    FILE *fptr = fopen(fpath, "r");
+    if (!fptr) die("fopen");
+
+    // Retrieves the size and modification time of the file (with error handling)
+    struct stat sb;
+    if (fstat(fileno(fptr), &sb)) {
+        fclose(fptr);
+        die("fstat");
+    }
+
+    size_t nblocks = 0, bcap = 64;
+    size_t cap = 1024, used = 0;
+    struct lidx_block *blocks = (struct lidx_block *) malloc(bcap * sizeof(struct lidx_block));
+    struct tri_entry *table = (struct tri_entry *) calloc(cap, sizeof(struct tri_entry));
+    unsigned char *buf = (unsigned char *) malloc(CHUNK);
+    size_t bloomlen = (flags & IDX_BLOOM) ? IDX_BLOOM_BYTES : 0;
+    unsigned char *blooms = (unsigned char *) calloc(bcap, bloomlen ? bloomlen : 1);
+    if (!blocks || !table || !buf || !blooms) {
+        fclose(fptr);
+        die("malloc");
+    }
+
+    uint64_t pos = 0, bstart = 0, line = 1, linelen = 0, maxline = 0, newlines = 0, nul = 0;
+    uint32_t tri = 0, bits[IDX_BLOOM_K];
+    int run = 0;
+    size_t n, i, h;
+
+    // First block starts at the first line
+    blocks[nblocks].offset = 0;
+    blocks[nblocks++].line = 1;
+
+    // Read chunks of the file until End-Of-File
+    while ((n = fread(buf, 1, CHUNK, fptr)) > 0) {
+        for (i = 0; i < n; i++, pos++) {
+            unsigned char c = buf[i];
+            linelen++;
+            if (c == '\0') nul = 1;
+
+            // At end of line, reset trigram and start a new block if current block is full
+            if (c == '\n') {
+                if (linelen > maxline) maxline = linelen;
+                linelen = 0;
+                run = 0;
+                newlines++;
+                line++;
+                if (pos + 1 - bstart >= IDX_BLOCK && pos + 1 < (uint64_t) sb.st_size) {
+                    // Grow the block table when full (with error handling)
+                    if (nblocks == bcap) {
+                        struct lidx_block *tmp = (struct lidx_block *) realloc(blocks, (bcap *= 2) * sizeof(struct lidx_block));
+                        unsigned char *btmp = (unsigned char *) realloc(blooms, bcap * (bloomlen ? bloomlen : 1));
+                        if (!tmp || !btmp) {
+                            fclose(fptr);
+                            die("realloc");
+                        }
+                        blocks = tmp;
+                        blooms = btmp;
+                        // Clear the Bloom filters of the new blocks
+                        memset(blooms + nblocks * bloomlen, 0, (bcap - nblocks) * bloomlen);
+                    }
+                    bstart = pos + 1;
+                    blocks[nblocks].offset = bstart;
+                    blocks[nblocks++].line = line;
+                }
+                continue;
+            }
+
+            // Shift char into the current trigram, and skip until 3 chars of line are read
+            tri = ((tri << 8) | fold(c)) & 0xffffff;
+            if (++run < 3) continue;
+
+            // Set the bits of the trigram in the Bloom filter of the block
+            if (bloomlen) {
+                unsigned char *bloom = blooms + (nblocks - 1) * bloomlen;
+                bloom_bits(tri, bits);
+                for (h = 0; h < IDX_BLOOM_K; h++) bloom[bits[h] / 8] |= 1 << (bits[h] % 8);
+            }
+
+            // Posting lists are only built for trigram indexes
+            if (!(flags & IDX_TRIGRAM)) continue;
+
+            // Find trigram in hash table (linear probing), the extra bit marks used slots
+            h = (tri * 2654435761u) & (cap - 1);
+            while (table[h].tri && table[h].tri != (tri | 0x1000000)) h = (h + 1) & (cap - 1);
+
+            // If new trigram, add it to the table
+            if (!table[h].tri) {
+                table[h].tri = tri | 0x1000000;
+                used++;
+            }
+
+            // If first occurence in the block, add block to posting list (as difference)
+            if (table[h].last != nblocks) {
+                if (put_varint(&table[h].post, &table[h].len, &table[h].cap, nblocks - 1 - table[h].last)) {
+                    fclose(fptr);
+                    die("realloc");
+                }
+                table[h].last = nblocks;
+            }
+
+            // Double the size of the hash table once it is half full (with error handling)
+            if (used * 2 > cap) {
+                struct tri_entry *bigger = (struct tri_entry *) calloc(cap * 2, sizeof(struct tri_entry));
+                if (!bigger) {
+                    fclose(fptr);
+                    die("calloc");
+                }
+                size_t j, k;
+                for (j = 0; j < cap; j++) {
+                    if (!table[j].tri) continue;
+                    k = ((table[j].tri & 0xffffff) * 2654435761u) & (cap * 2 - 1);
+                    while (bigger[k].tri) k = (k + 1) & (cap * 2 - 1);
+                    bigger[k] = table[j];
+                }
+                free(table);
+                table = bigger;
+                cap *= 2;
+            }
+        }
+    }
+
+    // If error while reading, program quits
+    if (ferror(fptr)) {
+        fclose(fptr);
+        die("fread");
+    }
+    fclose(fptr);
+    free(buf);
+
+    // Move used entries to the start of the table and sort them by trigram
+    size_t ntri = 0;
+    for (i = 0; i < cap; i++) {
+        if (table[i].tri) {
+            table[ntri] = table[i];
+            table[ntri++].tri &= 0xffffff;
+        }
+    }
+    qsort(table, ntri, sizeof(struct tri_entry), cmp_tri);
+
+    // Fill in header
+    struct lidx_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, IDXMAGIC, sizeof(hdr.magic));
+    hdr.version = IDXVERSION;
+    hdr.flags = flags;
+    hdr.size = sb.st_size;
+    hdr.mtime_sec = sb.st_mtim.tv_sec;
+    hdr.mtime_nsec = sb.st_mtim.tv_nsec;
+    hdr.lines = sb.st_size > 0 ? newlines + 1 : 0;
+    hdr.maxline = maxline;
+    hdr.nul = nul;
+    hdr.nblocks = nblocks;
+    hdr.ntrigrams = ntri;
+    hdr.bloomlen = bloomlen;
+
+    // Build the trigram directory with offsets into the posting lists
+    struct lidx_tri *dir = (struct lidx_tri *) malloc((ntri ? ntri : 1) * sizeof(struct lidx_tri));
+    if (!dir) die("malloc");
+    for (i = 0; i < ntri; i++) {
+        dir[i].tri = table[i].tri;
+        dir[i].len = table[i].len;
+        dir[i].offset = hdr.postlen;
+        hdr.postlen += table[i].len;
+    }
+
+    // Attempts to open temporary sidecar file in write mode (with error handling)
+    char ipath[MAXF + 16], tpath[MAXF + 24];
+    index_path(fpath, ipath);
+    snprintf(tpath, sizeof(tpath), "%s.tmp", ipath);
+    FILE *out = fopen(tpath, "w");
+    if (!out) die("fopen index");
+
+    // Write each section of the index (with error handling)
+    int err = fwrite(&hdr, sizeof(hdr), 1, out) != 1
+        || fwrite(blocks, sizeof(struct lidx_block), nblocks, out) != nblocks
+        || (ntri && fwrite(dir, sizeof(struct lidx_tri), ntri, out) != ntri);
+    for (i = 0; i < ntri && !err; i++) {
+        if (fwrite(table[i].post, 1, table[i].len, out) != table[i].len) err = 1;
+    }
+    if (bloomlen && !err && fwrite(blooms, bloomlen, nblocks, out) != nblocks) err = 1;
+    if (fclose(out) || err) {
+        remove(tpath);
+        die("write index");
+    }
+
+    // Attempts to rename temporary sidecar into place (with error handling)
+    if (rename(tpath, ipath)) {
+        fprintf(stderr, "Error renaming index file. Warning temp index file will be remaining.\n");
+        die("rename");
+    }
+
+    if (opts.json) {
+        json_begin("result", "index", fpath);
+        printf(",\"lines\":%lu,\"blocks\":%lu,\"trigrams\":%lu,\"bloom\":%s", hdr.lines, nblocks, ntri, bloomlen ? "true" : "false");
+        json_end(1);
+    } else {
+        printf("Indexed \'%s\': %lu lines, %lu blocks, %lu trigrams%s\n", fpath, hdr.lines, nblocks, ntri,
+            bloomlen ? ", Bloom filters" : "");
+    }
+
+    for (i = 0; i < ntri; i++) free(table[i].post);
+    free(table);
+    free(blooms);
+    free(blocks);
+    free(dir);
+}
+
+/*
+ * Function: load_index()
+ * -----------------------------
+ * Maps the index sidecar file of a file into memory and checks that it is
+ * usable: the magic and version must match, the sections must fit inside the
+ * sidecar and the size and modification time recorded must still match the
+ * file. A missing or stale index is not an error, the caller simply does not
+ * use the index.
+ *
+ * fpath: path to the indexed file
+ * idx: struct filled in with the mapped sections of the index
+ *
+ * returns: 0 if a valid index was loaded, else -1
+ */
+int load_index(const char *fpath, struct lidx *idx) {
+    char ipath[MAXF + 16];
+    struct stat sb, ib;
+    index_path(fpath, ipath);
+
+    // If file or index cannot be accessed, no index is used
+    if (stat(fpath, &sb)) return -1;
+    int fd = open(ipath, O_RDONLY);
+    if (fd == -1) return -1;
+    if (fstat(fd, &ib) || (size_t) ib.st_size < sizeof(struct lidx_header)) {
+        close(fd);
+        return -1;
+    }
+
+    // Map index into memory (file descriptor not needed after mapping)
+    void *map = mmap(NULL, ib.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return -1;
+
+    struct lidx_header *hdr = (struct lidx_header *) map;
+    uint64_t need = sizeof(struct lidx_header) + hdr->nblocks * sizeof(struct lidx_block)
+        + hdr->ntrigrams * sizeof(struct lidx_tri) + hdr->postlen + hdr->nblocks * hdr->bloomlen;
+
+    // If index is not a valid index of the current file contents, it is not used
+    if (memcmp(hdr->magic, IDXMAGIC, sizeof(hdr->magic)) || hdr->version != IDXVERSION
+            || need > (uint64_t) ib.st_size || hdr->nblocks == 0 || hdr->size != (uint64_t) sb.st_size
+            || ((hdr->flags & IDX_BLOOM) && hdr->bloomlen != IDX_BLOOM_BYTES)
+            || hdr->mtime_sec != sb.st_mtim.tv_sec || hdr->mtime_nsec != sb.st_mtim.tv_nsec) {
+        munmap(map, ib.st_size);
+        return -1;
+    }
+
+    idx->map = map;
+    idx->maplen = ib.st_size;
+    idx->hdr = hdr;
+    idx->blocks = (struct lidx_block *) (hdr + 1);
+    idx->dir = (struct lidx_tri *) (idx->blocks + hdr->nblocks);
+    idx->post = (unsigned char *) (idx->dir + hdr->ntrigrams);
+    idx->bloom = idx->post + hdr->postlen;
+    return 0;
+}
+
+/*
+ * Function: free_index()
+ * -----------------------------
+ * Unmaps an index that was loaded with load_index().
+ *
+ * idx: index to be unmapped
+ */
+void free_index(struct lidx *idx) {
+    munmap(idx->map, idx->maplen);
+}
+
+/*
+ * Function: index_candidates()
+ * -----------------------------
+ * Finds the blocks of an indexed file that may contain a string. The posting
+ * lists of every trigram in the (case folded) string are intersected, so only
+ * blocks containing all of them remain. If the index only has Bloom filters,
+ * blocks whose filter is missing a bit of any of the trigrams are removed 
+ * instead (some remaining blocks may not contain the string). The result is a list of ranges (the
+ * start offset, end offset and first line number of each candidate block),
+ * with neighbouring candidates merged into one range. The list is allocated by
+ * the function (must be freed outside of function in appropriate place).
+ *
+ * idx: loaded index of the file being searched
+ * key: string being searched for
+ * klen: length of the string
+ * ranges: pointer set to the allocated list of candidate ranges
+ *
+ * returns: number of candidate ranges, or -1 if the index cannot narrow the
+ * search (string too short or allocation failure)
+ */
+ssize_t index_candidates(struct lidx *idx, const char *key, size_t klen, struct lidx_range **ranges) {
+    // Index cannot be used for strings without a whole trigram
+    if (klen < 3 || !(idx->hdr->flags & (IDX_TRIGRAM | IDX_BLOOM))) return -1;
+
+    uint64_t nblocks = idx->hdr->nblocks;
+    unsigned char *cand = (unsigned char *) malloc(nblocks);
+    if (!cand) return -1;
+    memset(cand, 1, nblocks);
+
+    size_t i;
+    uint32_t tri = 0;
+    // For each trigram of the key
+    for (i = 0; i < klen; i++) {
+        tri = ((tri << 8) | fold(key[i])) & 0xffffff;
+        if (i < 2) continue;
+
+        // Without posting lists, remove blocks whose Bloom filter does not contain trigram
+        if (!(idx->hdr->flags & IDX_TRIGRAM)) {
+            uint32_t bits[IDX_BLOOM_K];
+            uint64_t b;
+            int k;
+            bloom_bits(tri, bits);
+            for (b = 0; b < nblocks; b++) {
+                const unsigned char *bloom = idx->bloom + b * idx->hdr->bloomlen;
+                for (k = 0; k < IDX_BLOOM_K && cand[b]; k++) {
+                    if (!(bloom[bits[k] / 8] & (1 << (bits[k] % 8)))) cand[b] = 0;
+                }
+            }
+            continue;
+        }
+
+        // Binary search directory for trigram
+        size_t lo = 0, hi = idx->hdr->ntrigrams;
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            if (idx->dir[mid].tri < tri) lo = mid + 1;
+            else hi = mid;
+        }
+
+        // If trigram is not in file, there are no candidate blocks
+        if (lo == idx->hdr->ntrigrams || idx->dir[lo].tri != tri) {
+            memset(cand, 0, nblocks);
+            break;
+        }
+
+        // Keep only blocks that are candidates and in the posting list of the trigram
+        const unsigned char *p = idx->post + idx->dir[lo].offset;
+        const unsigned char *end = p + idx->dir[lo].len;
+        uint64_t block, next = 0;
+        while (p < end) {
+            block = next + get_varint(&p, end);
+            if (block >= nblocks) break;
+            // Blocks between the previous posting and this one do not contain trigram
+            while (next < block) cand[next++] = 0;
+            next = block + 1;
+        }
+        // Blocks after the last posting do not contain trigram
+        while (next < nblocks) cand[next++] = 0;
+    }
+
+    *ranges = (struct lidx_range *) malloc(nblocks * sizeof(struct lidx_range));
+    if (!*ranges) {
+        free(cand);
+        return -1;
+    }
+
+    // Convert candidate blocks to ranges, merging neighbouring blocks
+    ssize_t count = 0;
+    uint64_t b;
+    for (b = 0; b < nblocks; b++) {
+        if (!cand[b]) continue;
+        uint64_t end = b + 1 < nblocks ? idx->blocks[b + 1].offset : idx->hdr->size;
+        if (count > 0 && (*ranges)[count - 1].end == idx->blocks[b].offset) {
+            (*ranges)[count - 1].end = end;
+        } else {
+            (*ranges)[count].start = idx->blocks[b].offset;
+            (*ranges)[count].end = end;
+            (*ranges)[count].line = idx->blocks[b].line;
+            count++;
+        }
+    }
+
+    free(cand);
+    return count;
+}
+
+/*
+ * Function: regex_literal()
+ * -----------------------------
+ * Finds the longest string of literal chars that every match of an extended
+ * regex must contain, so that the trigram index can be used to narrow regex
+ * searches. Chars inside brackets or groups, the counts of intervals, chars
+ * followed by a quantifier that allows zero repeats and escapes that are not
+ * literal chars all break the string. Patterns with alternation have no 
+ * required string.
+ *
+ * key: regex expression
+ * out: buffer of at least MAXF + 1 chars to write the literal string to
+ *
+ * returns: length of the literal string (0 if there is none)
+ */
+size_t regex_literal(const char *key, char *out) {
+    char run[MAXF + 1];
+    size_t len = 0, best = 0;
+    int depth = 0;
+    const char *p;
+
+    // Alternation means no string is required by every match
+    if (strchr(key, '|')) return 0;
+
+    for (p = key; *p; p++) {
+        char c = *p;
+        int literal = 0;
+
+        if (c == '\\' && p[1]) {
+            // Escaped punctuation is literal, other escapes are classes or anchors
+            c = *++p;
+            literal = !isalnum((unsigned char) c);
+        } else if (c == '[') {
+            // Skip bracket expression (a ']' straight after '[' or '[^' is part of the set)
+            p++;
+            if (*p == '^') p++;
+            if (*p == ']') p++;
+            while (*p && *p != ']') {
+                // Classes ([:digit:]), equivalence classes ([=a=]) and collating
+                // symbols ([.-.]) end at their own closing delimiter, not the first ']'
+                if (*p == '[' && (p[1] == ':' || p[1] == '=' || p[1] == '.')) {
+                    char delim[3] = { p[1], ']', '\0' };
+                    const char *end = strstr(p + 2, delim);
+
+                    // Unterminated, so no string can be trusted (search whole file)
+                    if (!end) return 0;
+                    p = end + 2;
+                } else {
+                    p++;
+                }
+            }
+            if (!*p) break;
+        } else if (c == '{') {
+            // Skip the counts of an interval ({m,n}), which are not chars of the text
+            p = strchr(p, '}');
+            // Unterminated, so no string can be trusted (search whole file)
+            if (!p) return 0;
+        } else if (c == '(') {
+            depth++;
+        } else if (c == ')') {
+            if (depth) depth--;
+        } else if (!strchr(".*+?{}^$", c)) {
+            literal = 1;
+        }
+
+        // A char followed by a quantifier allowing zero repeats is optional
+        if (literal && (p[1] == '*' || p[1] == '?' || p[1] == '{')) literal = 0;
+
+        // Add literal chars outside of groups to the run, otherwise end the run
+        if (literal && depth == 0 && len < MAXF) {
+            run[len++] = c;
+        } else {
+            if (len > best) {
+                memcpy(out, run, len);
+                best = len;
+            }
+            len = 0;
+        }
+    }
+
+    if (len > best) {
+        memcpy(out, run, len);
+        best = len;
+    }
+    out[best] = '\0';
+    return best;
+}
+
+/*
+ * Header at the start of a suffix array sidecar file. Records the size and
+ * modification time of the file when it was indexed and the results of the
+ * fgets() safety checks done by verify_lines(). The header is followed by the
+ * suffix array (size entries of 8 bytes), the LCP array (size entries of 4
+ * bytes, capped at UINT32_MAX) and the line start table (lines entries of 8
+ * bytes), in that order.
+ */
+struct sa_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t pad;
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t lines;
+    uint64_t maxline;
+};
+
+/*
+ * Struct describing a suffix array sidecar file mapped into memory along with
+ * the file it indexes (by load_sa()), with pointers to each of the sections.
+ */
+struct sa_index {
+    void *map;
+    size_t maplen;
+    struct sa_header *hdr;
+    uint64_t *sa;
+    uint32_t *lcp;
+    uint64_t *lstart;
+    unsigned char *text;
+};
+
+/*
+ * Struct holding the state shared by the threads computing part of the LCP
+ * array in build_sa(). Each thread handles the text positions from start to
+ * end.
+ */
+struct lcp_job {
+    const unsigned char *text;
+    int64_t n;
+    const int64_t *sa;
+    const int64_t *rank;
+    uint32_t *lcp;
+    int64_t start;
+    int64_t end;
+};
+
+// Bit masks and macros used by sais() to access the type array and chars
+static const unsigned char SAMASK[] = { 0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01 };
+#define tget(i) ((t[(i) / 8] & SAMASK[(i) % 8]) ? 1 : 0)
+#define tset(i, b) t[(i) / 8] = (b) ? (SAMASK[(i) % 8] | t[(i) / 8]) : ((~SAMASK[(i) % 8]) & t[(i) / 8])
+#define chr(i) (cs == sizeof(int64_t) ? ((const int64_t *) s)[i] : ((const unsigned char *) s)[i])
+#define isLMS(i) ((i) > 0 && tget(i) && !tget((i) - 1))
+
+/*
+ * Function: sa_buckets()
+ * -----------------------------
+ * Finds the start or end of the bucket of each char for sais().
+ *
+ * s: text being sorted
+ * bkt: array of K + 1 bucket positions to be filled in
+ * n: length of text
+ * K: largest char in text
+ * cs: size of each char in text (1 or sizeof(int64_t))
+ * end: non-zero to find the ends of buckets, 0 to find the starts
+ */
+void sa_buckets(const void *s, int64_t *bkt, int64_t n, int64_t K, int cs, int end) {
+    int64_t i, sum = 0;
+    for (i = 0; i <= K; i++) bkt[i] = 0;
+    for (i = 0; i < n; i++) bkt[chr(i)]++;
+    for (i = 0; i <= K; i++) {
+        sum += bkt[i];
+        bkt[i] = end ? sum : sum - bkt[i];
+    }
+}
+
+/*
+ * Function: sa_induce()
+ * -----------------------------
+ * Induces the order of the L-type suffixes from the sorted LMS suffixes and
+ * then the order of the S-type suffixes from the L-type suffixes for sais().
+ *
+ * t: bit array of suffix types (1 for S-type)
+ * SA: suffix array being built
+ * s: text being sorted
+ * bkt: array of K + 1 entries used for bucket positions
+ * n: length of text
+ * K: largest char in text
+ * cs: size of each char in text
+ */
+void sa_induce(const unsigned char *t, int64_t *SA, const void *s, int64_t *bkt, int64_t n, int64_t K, int cs) {
+    int64_t i, j;
+
+    // Scan forwards placing L-type suffixes at the starts of their buckets
+    sa_buckets(s, bkt, n, K, cs, 0);
+    for (i = 0; i < n; i++) {
+        j = SA[i] - 1;
+        if (j >= 0 && !tget(j)) SA[bkt[chr(j)]++] = j;
+    }
+
+    // Scan backwards placing S-type suffixes at the ends of their buckets
+    sa_buckets(s, bkt, n, K, cs, 1);
+    for (i = n - 1; i >= 0; i--) {
+        j = SA[i] - 1;
+        if (j >= 0 && tget(j)) SA[--bkt[chr(j)]] = j;
+    }
+}
+
+/*
+ * Function: sais()
+ * -----------------------------
+ * Builds the suffix array of a text using the SA-IS algorithm (induced
+ * sorting), in linear time. The LMS substrings are sorted by induction and
+ * named, the reduced problem of sorting the named LMS suffixes is solved
+ * (recursively if names are not unique) and the full order is induced from it.
+ * The text must end in a unique smallest char (0) and hold at least 2 chars.
+ *
+ * s: text to be sorted (chars of size cs)
+ * SA: array of n entries to be filled with the suffix array
+ * n: length of text including the final 0
+ * K: largest char in text
+ * cs: size of each char in text (1 or sizeof(int64_t))
+ *
+ * returns: 0 if successful, else -1 if allocation fails
+ */
+int sais(const void *s, int64_t *SA, int64_t n, int64_t K, int cs) {
+    int64_t i, j;
+    unsigned char *t = (unsigned char *) calloc(n / 8 + 1, 1);
+    int64_t *bkt = (int64_t *) malloc(sizeof(int64_t) * (K + 1));
+    if (!t || !bkt) {
+        free(t);
+        free(bkt);
+        return -1;
+    }
+
+    // Classify each suffix as S-type or L-type (final 0 is S-type)
+    tset(n - 2, 0);
+    tset(n - 1, 1);
+    for (i = n - 3; i >= 0; i--) tset(i, (chr(i) < chr(i + 1) || (chr(i) == chr(i + 1) && tget(i + 1) == 1)) ? 1 : 0);
+
+    // Sort the LMS substrings by placing them at bucket ends and inducing
+    sa_buckets(s, bkt, n, K, cs, 1);
+    for (i = 0; i < n; i++) SA[i] = -1;
+    for (i = 1; i < n; i++) {
+        if (isLMS(i)) SA[--bkt[chr(i)]] = i;
+    }
+    sa_induce(t, SA, s, bkt, n, K, cs);
+
+    // Move the sorted LMS substrings to the start of SA
+    int64_t n1 = 0;
+    for (i = 0; i < n; i++) {
+        if (isLMS(SA[i])) SA[n1++] = SA[i];
+    }
+
+    // Name the LMS substrings, equal substrings getting the same name
+    for (i = n1; i < n; i++) SA[i] = -1;
+    int64_t name = 0, prev = -1, pos, d;
+    for (i = 0; i < n1; i++) {
+        int diff = 0;
+        pos = SA[i];
+        for (d = 0; d < n; d++) {
+            if (prev == -1 || chr(pos + d) != chr(prev + d) || tget(pos + d) != tget(prev + d)) {
+                diff = 1;
+                break;
+            } else if (d > 0 && (isLMS(pos + d) || isLMS(prev + d))) {
+                break;
+            }
+        }
+        if (diff) {
+            name++;
+            prev = pos;
+        }
+        SA[n1 + pos / 2] = name - 1;
+    }
+    for (i = n - 1, j = n - 1; i >= n1; i--) {
+        if (SA[i] >= 0) SA[j--] = SA[i];
+    }
+
+    // Sort the reduced text of names (recursing if names are not unique)
+    int64_t *SA1 = SA, *s1 = SA + n - n1;
+    if (name < n1) {
+        if (sais(s1, SA1, n1, name - 1, sizeof(int64_t))) {
+            free(t);
+            free(bkt);
+            return -1;
+        }
+    } else {
+        for (i = 0; i < n1; i++) SA1[s1[i]] = i;
+    }
+
+    // Place the sorted LMS suffixes at the ends of their buckets and induce the rest
+    sa_buckets(s, bkt, n, K, cs, 1);
+    for (i = 1, j = 0; i < n; i++) {
+        if (isLMS(i)) s1[j++] = i;
+    }
+    for (i = 0; i < n1; i++) SA1[i] = s1[SA1[i]];
+    for (i = n1; i < n; i++) SA[i] = -1;
+    for (i = n1 - 1; i >= 0; i--) {
+        j = SA[i];
+        SA[i] = -1;
+        SA[--bkt[chr(j)]] = j;
+    }
+    sa_induce(t, SA, s, bkt, n, K, cs);
+
+    free(bkt);
+    free(t);
+    return 0;
+}
+
+#undef tget
+#undef tset
+#undef chr
+#undef isLMS
+
+/*
+ * Function: lcp_worker()
+ * -----------------------------
+ * Thread function computing part of the LCP array with Kasai's algorithm. The
+ * text positions of the job are visited in order, so the length found for one
+ * suffix (less one) is a lower bound for the next. Each thread starts its part
+ * from a length of 0, so the parts can be computed independently.
+ *
+ * arg: pointer to the lcp_job struct describing the part to compute
+ *
+ * returns: NULL
+ */
+void *lcp_worker(void *arg) {
+    struct lcp_job *job = (struct lcp_job *) arg;
+    int64_t i, j, h = 0;
+
+    for (i = job->start; i < job->end; i++) {
+        // First suffix in order has no previous suffix to compare to
+        if (job->rank[i] == 0) {
+            job->lcp[0] = 0;
+            h = 0;
+            continue;
+        }
+        // Extend the common prefix with the previous suffix (up to the end of the text, which may contain NULL chars)
+        j = job->sa[job->rank[i] - 1];
+        while (i + h < job->n && j + h < job->n && job->text[i + h] == job->text[j + h]) h++;
+        job->lcp[job->rank[i]] = h > UINT32_MAX ? UINT32_MAX : h;
+        if (h > 0) h--;
+    }
+
+    return NULL;
+}
+
+/*
+ * Function: build_sa()
+ * -----------------------------
+ * Builds the suffix array index of a file and writes it to the sidecar file.
+ * The file is read into memory with a 0 added to the end (files with NULL 
+ * characters are sorted as wide chars instead, so that the 0 stays unique, 
+ * using 8 times the memory). The suffix array is built with sais(), and the LCP array is computed by several threads with lcp_worker().
+ * The line start table (used to find the line of a match) and the checks of
+ * verify_lines() are done while the file is read. The sidecar is written to a
+ * temporary path and renamed into place. If there are any errors, valid error
+ * messages are printed and program quits.
+ *
+ * fpath: path to file to be indexed
+ */
+void build_sa(char *fpath) {
+    // Attempts to open file in read mode (with error handling)
+    FILE *fptr = fopen(fpath, "r");
+    if (!fptr) die("fopen");
+
+    // Retrieves the size and modification time of the file (with error handling)
+    struct stat sb;
+    if (fstat(fileno(fptr), &sb)) {
+        fclose(fptr);
+        die("fstat");
+    }
+
+    int64_t n = sb.st_size;
+    unsigned char *text = (unsigned char *) malloc(n + 1);
+    if (!text) {
+        fclose(fptr);
+        die("malloc");
+    }
+
+    // Read whole file into memory (with error handling)
+    if (fread(text, 1, n, fptr) != (size_t) n) {
+        fclose(fptr);
+        fprintf(stderr, "Error reading file.\n");
+        exit(1);
+    }
+    fclose(fptr);
+    text[n] = '\0';
+
+    // Find the start of each line and the longest line
+    uint64_t lines = n > 0 ? count_newlines((char *) text, n) + 1 : 0;
+    uint64_t *lstart = (uint64_t *) malloc((lines ? lines : 1) * sizeof(uint64_t));
+    if (!lstart) die("malloc");
+    uint64_t line = 0, maxline = 0;
+    unsigned char *p = text, *nl;
+    if (n > 0) lstart[line++] = 0;
+    while ((nl = memchr(p, '\n', text + n - p)) != NULL) {
+        if ((uint64_t) (nl + 1 - p) > maxline) maxline = nl + 1 - p;
+        p = nl + 1;
+        lstart[line++] = p - text;
+    }
+
+    // Build suffix array of file including the final 0 (with error handling)
+    int64_t *SA = (int64_t *) malloc((n + 1) * sizeof(int64_t));
+    if (!SA) die("malloc");
+    // Files with NULL chars are sorted as wide chars shifted up by one, so the final 0 stays the unique smallest char
+    if (n > 0 && memchr(text, '\0', n)) {
+        int64_t k, *wide = (int64_t *) malloc((n + 1) * sizeof(int64_t));
+        if (!wide) die("malloc");
+        for (k = 0; k < n; k++) wide[k] = text[k] + 1;
+        wide[n] = 0;
+        if (sais(wide, SA, n + 1, 256, sizeof(int64_t))) die("malloc");
+        free(wide);
+    } else if (n > 0 && sais(text, SA, n + 1, 255, 1)) {
+        die("malloc");
+    }
+    if (n == 0) SA[0] = 0;
+
+    // Compute rank of each suffix, used by LCP computation
+    int64_t *rank = (int64_t *) malloc((n + 1) * sizeof(int64_t));
+    uint32_t *lcp = (uint32_t *) malloc((n + 1) * sizeof(uint32_t));
+    if (!rank || !lcp) die("malloc");
+    int64_t i;
+    for (i = 0; i <= n; i++) rank[SA[i]] = i;
+
+    // Split computation of LCP array between worker threads
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads > MAX_THREADS) threads = MAX_THREADS;
+    if (threads < 1 || n < PAR_MIN) threads = 1;
+    struct lcp_job jobs[MAX_THREADS];
+    pthread_t tids[MAX_THREADS];
+    int started = 0;
+    for (i = 0; i < threads; i++) {
+        jobs[i].text = text;
+        jobs[i].n = n;
+        jobs[i].sa = SA;
+        jobs[i].rank = rank;
+        jobs[i].lcp = lcp;
+        jobs[i].start = n * i / threads;
+        jobs[i].end = n * (i + 1) / threads;
+        // The last part (or all of them, if threads cannot be created) is done by this thread
+        if (i == threads - 1 || pthread_create(&tids[started], NULL, lcp_worker, &jobs[i])) {
+            lcp_worker(&jobs[i]);
+        } else {
+            started++;
+        }
+    }
+    for (i = 0; i < started; i++) pthread_join(tids[i], NULL);
+    free(rank);
+
+    // Fill in header
+    struct sa_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, SAMAGIC, sizeof(hdr.magic));
+    hdr.version = IDXVERSION;
+    hdr.size = n;
+    hdr.mtime_sec = sb.st_mtim.tv_sec;
+    hdr.mtime_nsec = sb.st_mtim.tv_nsec;
+    hdr.lines = lines;
+    hdr.maxline = maxline;
+
+    // Attempts to open temporary sidecar file in write mode (with error handling)
+    char ipath[MAXF + 16], tpath[MAXF + 24];
+    snprintf(ipath, sizeof(ipath), "%s%s", fpath, SAEXT);
+    snprintf(tpath, sizeof(tpath), "%s.tmp", ipath);
+    FILE *out = fopen(tpath, "w");
+    if (!out) die("fopen index");
+
+    // Write each section of the index, leaving out the suffix of the final 0 (with error handling)
+    int err = fwrite(&hdr, sizeof(hdr), 1, out) != 1
+        || fwrite(SA + 1, sizeof(int64_t), n, out) != (size_t) n
+        || fwrite(lcp + 1, sizeof(uint32_t), n, out) != (size_t) n
+        || fwrite(lstart, sizeof(uint64_t), lines, out) != lines;
+    if (fclose(out) || err) {
+        remove(tpath);
+        die("write index");
+    }
+
+    // Attempts to rename temporary sidecar into place (with error handling)
+    if (rename(tpath, ipath)) {
+        fprintf(stderr, "Error renaming index file. Warning temp index file will be remaining.\n");
+        die("rename");
+    }
+
+    if (opts.json) {
+        json_begin("result", "index_sa", fpath);
+        printf(",\"suffixes\":%lu,\"lines\":%lu", (uint64_t) n, lines);
+        json_end(1);
+    } else {
+        printf("Suffix array built for \'%s\': %lu suffixes, %lu lines\n", fpath, (uint64_t) n, lines);
+    }
+
+    free(text);
+    free(SA);
+    free(lcp);
+    free(lstart);
+}
+
+/*
+ * Function: load_sa()
+ * -----------------------------
+ * Maps the suffix array sidecar file of a file into memory, along with the
+ * file itself, and checks that the index is usable (magic, version, length
+ * and the size and modification time of the file). A missing or stale index
+ * is not an error, the caller simply does not use the index.
+ *
+ * fpath: path to the indexed file
+ * sa: struct filled in with the mapped sections of the index
+ *
+ * returns: 0 if a valid index was loaded, else -1
+ */
+int load_sa(const char *fpath, struct sa_index *sa) {
+    char ipath[MAXF + 16];
+    struct stat sb, ib;
+    snprintf(ipath, sizeof(ipath), "%s%s", fpath, SAEXT);
+
+    // If index cannot be accessed, no index is used
+    int fd = open(ipath, O_RDONLY);
+    if (fd == -1) return -1;
+    if (fstat(fd, &ib) || (size_t) ib.st_size < sizeof(struct sa_header)) {
+        close(fd);
+        return -1;
+    }
+    void *map = mmap(NULL, ib.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return -1;
+
+    struct sa_header *hdr = (struct sa_header *) map;
+    // If file cannot be accessed or index is not a valid index of the current file contents, it is not used
+    if ((fd = open(fpath, O_RDONLY)) == -1 || fstat(fd, &sb) || memcmp(hdr->magic, SAMAGIC, sizeof(hdr->magic))
+            || hdr->version != IDXVERSION || hdr->size == 0 || hdr->size != (uint64_t) sb.st_size
+            || hdr->mtime_sec != sb.st_mtim.tv_sec || hdr->mtime_nsec != sb.st_mtim.tv_nsec
+            || sizeof(struct sa_header) + hdr->size * 12 + hdr->lines * 8 > (uint64_t) ib.st_size) {
+        if (fd != -1) close(fd);
+        munmap(map, ib.st_size);
+        return -1;
+    }
+
+    // Map the file itself, used to compare the key with suffixes
+    sa->text = (unsigned char *) mmap(NULL, hdr->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (sa->text == MAP_FAILED) {
+        munmap(map, ib.st_size);
+        return -1;
+    }
+
+    sa->map = map;
+    sa->maplen = ib.st_size;
+    sa->hdr = hdr;
+    sa->sa = (uint64_t *) (hdr + 1);
+    sa->lcp = (uint32_t *) (sa->sa + hdr->size);
+    sa->lstart = (uint64_t *) (sa->lcp + hdr->size);
+    return 0;
+}
+
+/*
+ * Function: free_sa()
+ * -----------------------------
+ * Unmaps a suffix array index (and its file) loaded with load_sa().
+ *
+ * sa: index to be unmapped
+ */
+void free_sa(struct sa_index *sa) {
+    munmap(sa->text, sa->hdr->size);
+    munmap(sa->map, sa->maplen);
+}
+
+/*
+ * Function: sa_compare()
+ * -----------------------------
+ * Compares a key with the start of a suffix of the indexed file.
+ *
+ * sa: loaded suffix array index
+ * pos: offset of the suffix in the file
+ * key: string being compared
+ * klen: length of the string
+ *
+ * returns: negative if suffix sorts before the key, 0 if the suffix starts with
+ * the key, else positive
+ */
+int sa_compare(struct sa_index *sa, uint64_t pos, const char *key, size_t klen) {
+    size_t avail = sa->hdr->size - pos;
+    int cmp = memcmp(sa->text + pos, key, avail < klen ? avail : klen);
+    // A suffix shorter than the key (and equal to its start) sorts before it
+    if (cmp == 0 && avail < klen) return -1;
+    return cmp;
+}
+
+/*
+ * Function: sa_range()
+ * -----------------------------
+ * Finds the suffixes of the indexed file that start with a key, by binary
+ * searching the suffix array for the first of them and then following the
+ * LCP array while neighbouring suffixes share at least klen chars. Takes
+ * O(m log n) time to find the range, plus the number of matches.
+ *
+ * sa: loaded suffix array index
+ * key: string being searched for
+ * klen: length of the string
+ * first: set to position of the first matching suffix in the suffix array
+ *
+ * returns: number of matching suffixes
+ */
+uint64_t sa_range(struct sa_index *sa, const char *key, size_t klen, uint64_t *first) {
+    uint64_t lo = 0, hi = sa->hdr->size, mid;
+
+    // Binary search for the first suffix not sorting before the key
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (sa_compare(sa, sa->sa[mid], key, klen) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    *first = lo;
+
+    // If no suffix starts with key, there are no matches
+    if (lo == sa->hdr->size || sa_compare(sa, sa->sa[lo], key, klen) != 0) return 0;
+
+    // Following suffixes match while they share at least klen chars with the previous
+    for (hi = lo + 1; hi < sa->hdr->size && sa->lcp[hi] >= klen; hi++) {}
+    return hi - lo;
+}
+
+/*
+ * Function: cmp_u64()
+ * -----------------------------
+ * Comparison function for qsort() used to sort offsets into ascending order.
+ */
+int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Function: self_overlaps()
+ * -----------------------------
+ * Checks whether two instances of a key can overlap, which is the case when a
+ * proper prefix of the key is also a suffix of it (such as "aba" or "aa").
+ *
+ * key: string being checked
+ * klen: length of the key
+ *
+ * returns: 1 if instances of the key can overlap, else 0
+ */
+int self_overlaps(const char *key, size_t klen) {
+    size_t k;
+
+    for (k = 1; k < klen; k++) {
+        if (!memcmp(key, key + klen - k, k)) return 1;
+    }
+    return 0;
+}
+
+/*
+ * Function: sa_search()
+ * -----------------------------
+ * Answers a search using the suffix array index of the file, if it has a valid
+ * one. The matching suffixes are found with sa_range() and their offsets are
+ * sorted, and the line of each offset is found by binary searching the line
+ * start table. Overlapping matches within a line are skipped so the counts
+ * match those of a scan with strstr(). Lines are printed from the mapped file
+ * in the same format as search(). Existence checks (--quiet) are answered by
+ * the size of the range alone, as are counts (--count) of keys whose instances
+ * cannot overlap (see self_overlaps()). Keys containing line breaks are left
+ * to the normal search.
+ *
+ * fpath: path to file in which to search for string
+ * key: string to search for in file
+ *
+ * returns: 1 if search was answered using the index, else 0
+ */
+int sa_search(char *fpath, char *key) {
+    struct sa_index sa;
+    size_t klen = strlen(key);
+
+    // Keys spanning lines and searches ignoring case or for whole words are left to search()
+    if (strpbrk(key, "\r\n") || opts.icase || opts.word || load_sa(fpath, &sa)) return 0;
+
+    // Finds the number of digits needs to display the line numbers
+    uint64_t lines = sa.hdr->lines;
+    int digits = 1;
+    while (lines > 9) {
+        lines /= 10;
+        digits ++;
+    }
+
+    // Find the matching suffixes and sort their offsets into file order
+    uint64_t first, i;
+    uint64_t matches = sa_range(&sa, key, klen, &first);
+
+    // Existence checks only need to know if there is a match
+    if (opts.quiet) {
+        free_sa(&sa);
+        exit(matches ? 0 : 1);
+    }
+    // If instances of key cannot overlap, every matching suffix is an instance found by search()
+    if (opts.count && !self_overlaps(key, klen)) {
+        free_sa(&sa);
+        if (opts.json) json_summary("search", fpath, matches, -1);
+        else printf("%d instance/s found in the file.\n", (int) matches);
+        return 1;
+    }
+
+    uint64_t *offs = (uint64_t *) malloc((matches ? matches : 1) * sizeof(uint64_t));
+    if (!offs) die("malloc");
+    for (i = 0; i < matches; i++) offs[i] = sa.sa[first + i];
+    qsort(offs, matches, sizeof(uint64_t), cmp_u64);
+
+    int count = 0, subcount;
+    size_t printed = 0;
+    uint64_t lo, hi, mid, start, end, last;
+    // For each line containing matches (up to the first opts.first lines)
+    for (i = 0; i < matches && (!opts.first || printed < opts.first); printed++) {
+        // Binary search line start table for line containing match
+        lo = 0;
+        hi = sa.hdr->lines;
+        while (hi - lo > 1) {
+            mid = lo + (hi - lo) / 2;
+            if (sa.lstart[mid] <= offs[i]) lo = mid;
+            else hi = mid;
+        }
+        start = sa.lstart[lo];
+        end = lo + 1 < sa.hdr->lines ? sa.lstart[lo + 1] : sa.hdr->size;
+
+        // Count the matches in the line that do not overlap an earlier match
+        subcount = 0;
+        for (last = start; i < matches && offs[i] < end; i++) {
+            if (offs[i] >= last) {
+                subcount++;
+                last = offs[i] + klen;
+            }
+        }
+        count += subcount;
+
+        // Remove trailing newline chars and print line with number of instances (unless only counting)
+        while (end > start && (sa.text[end - 1] == '\n' || sa.text[end - 1] == '\r')) end--;
+        if (opts.count) continue;
+        if (opts.json) {
+            json_line("match", "search", fpath, lo + 1, start, (const char *) sa.text + start, end - start);
+            printf(",\"count\":%d", subcount);
+            json_spans((const char *) sa.text + start, end - start, key, klen, NULL);
+            json_end(0);
+        } else {
+            printf("%d instance/s:\n%0*lu |", subcount, digits, lo + 1);
+            fwrite(sa.text + start, 1, end - start, stdout);
+            printf("\n\n");
+        }
+    }
+
+    free(offs);
+    free_sa(&sa);
+
+    // Print total instances of search key in file
+    if (opts.json) json_summary("search", fpath, count, printed);
+    else printf("%d instance/s found in the file.\n", count);
+    return 1;
+}
+
+/* --- WORD INDEX --- */
+
+/*
+ * Header at the start of a word index sidecar file. Records the size and 
+ * modification time of the file when it was indexed and the number of entries
+ * in each of the sections that follow the header: the line start table (8 
+ * bytes per line), the term directory (sorted by term), the names of the terms
+ * and the compressed posting lists, in that order.
+ */
+struct widx_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t pad;
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t lines;
+    uint64_t nterms;
+    uint64_t namelen;
+    uint64_t postlen;
+};
+
+/*
+ * Entry of the term directory. Terms are words of the file with ASCII letters
+ * folded to lower case. The posting list of a term holds every occurrence of
+ * the term in file order, each stored as the varint encoded difference from 
+ * the line of the previous occurrence (0 for the same line) followed by the 
+ * position of the word in the line (as a difference from the previous 
+ * position on the same line).
+ */
+struct widx_term {
+    uint64_t name;
+    uint32_t nlen;
+    uint32_t pad;
+    uint64_t lines;
+    uint64_t count;
+    uint64_t offset;
+    uint64_t len;
+};
+
+/*
+ * Header at the start of a word index delta sidecar file. Edits made by the
+ * program to a file with a word index are recorded in the delta instead of
+ * dropping the index. The header records the size and modification time of 
+ * the file when the index was built (the index the delta applies to) and 
+ * after the last edit recorded, the number of lines after the last edit and 
+ * the number and length of the records that follow the header. Each record 
+ * replaces a range of lines with new lines: the varint encoded line number, 
+ * the number of lines removed and the number of lines added, followed by the
+ * words of each added line (the number of words, then each term as its 
+ * length and chars).
+ */
+struct wdelta_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t pad;
+    uint64_t base_size;
+    int64_t base_sec;
+    int64_t base_nsec;
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t lines;
+    uint64_t records;
+    uint64_t len;
+};
+
+/*
+ * Struct describing a part of a file with a word index delta: either a run of
+ * lines unchanged since the index was built (starting at line base of the 
+ * index), or a single line added by an edit (with its words in the delta).
+ */
+struct wseg {
+    uint64_t base;
+    uint64_t count;
+    const unsigned char *words;
+};
+
+/*
+ * Struct describing a word index sidecar file that has been mapped into memory
+ * with load_widx(), with pointers to each of the sections in the file, and its
+ * delta sidecar (dhdr is NULL if the index has no delta). The parts of the 
+ * file the delta is applied to are found with delta_view() when needed.
+ */
+struct widx {
+    void *map;
+    size_t maplen;
+    struct widx_header *hdr;
+    uint64_t *lstart;
+    struct widx_term *dir;
+    const char *names;
+    const unsigned char *post;
+    void *dmap;
+    size_t dmaplen;
+    struct wdelta_header *dhdr;
+    const unsigned char *delta;
+    struct wseg *segs;
+    size_t nsegs;
+};
+
+/*
+ * Struct used by the operations that edit a file to record their changes in 
+ * the word index delta (see delta_begin()). The header is the header of the 
+ * delta being written, and rec holds its records (those recorded before, 
+ * followed by those of the edit). live is set if the changes are being 
+ * recorded, and merge once the delta has grown too large and the index is to
+ * be rebuilt instead.
+ */
+struct wdelta {
+    int live;
+    int merge;
+    struct wdelta_header hdr;
+    unsigned char *rec;
+    size_t len;
+    size_t cap;
+};
+
+/*
+ * Struct used while building a word index, holding a term and its posting list
+ * as it is built, along with the line and position of the last occurrence 
+ * added (positions are stored as differences within a line).
+ */
+struct word_entry {
+    char *name;
+    uint32_t nlen;
+    uint64_t hash;
+    uint64_t last;
+    uint64_t lastpos;
+    uint64_t lines;
+    uint64_t count;
+    unsigned char *post;
+    size_t len;
+    size_t cap;
+};
+
+/*
+ * Struct holding the occurrences of a term decoded from its posting list, as
+ * arrays of the line and position of each occurrence (in file order), and the
+ * distinct lines containing the term.
+ */
+struct postings {
+    uint64_t *line;
+    uint32_t *pos;
+    size_t n;
+    uint64_t *lines;
+    size_t nlines;
+};
+
+/*
+ * Function: cmp_term()
+ * -----------------------------
+ * Compares two terms by their bytes, with shorter terms sorting before longer
+ * terms that start with them.
+ *
+ * a, alen: first term and its length
+ * b, blen: second term and its length
+ *
+ * returns: negative if a sorts before b, 0 if they are equal, else positive
+ */
+int cmp_term(const char *a, size_t alen, const char *b, size_t blen) {
+    int c = memcmp(a, b, alen < blen ? alen : blen);
+    if (c) return c;
+    return (alen > blen) - (alen < blen);
+}
+
+/*
+ * Function: cmp_word()
+ * -----------------------------
+ * Comparison function for qsort() used to sort word entries by term.
+ */
+int cmp_word(const void *a, const void *b) {
+    const struct word_entry *x = (const struct word_entry *) a;
+    const struct word_entry *y = (const struct word_entry *) b;
+    return cmp_term(x->name, x->nlen, y->name, y->nlen);
+}
+
+/*
+ * Function: term_hash()
+ * -----------------------------
+ * Computes the FNV-1a hash of a term, used to find terms in the hash table of
+ * build_widx().
+ *
+ * s: term to hash
+ * len: length of the term
+ *
+ * returns: hash of the term
+ */
+uint64_t term_hash(const char *s, size_t len) {
+    uint64_t h = 0xcbf29ce484222325ull;
+    size_t i;
+    for (i = 0; i < len; i++) h = (h ^ (unsigned char) s[i]) * 0x100000001b3ull;
+    return h;
+}
+
+/*
+ * Function: next_word()
+ * -----------------------------
+ * Finds the next word in a buffer (a run of word chars, see is_word()) and 
+ * copies it folded to lower case as a term, truncated to WIDX_TERM chars.
+ *
+ * s: buffer to read the word from
+ * len: length of the buffer
+ * off: offset to start from, moved past the word found
+ * term: buffer of at least WIDX_TERM chars the term is written to
+ *
+ * returns: length of the term, or 0 if there are no more words
+ */
+size_t next_word(const char *s, size_t len, size_t *off, char *term) {
+    size_t i = *off, n = 0;
+
+    while (i < len && !is_word(s[i])) i++;
+    for (; i < len && is_word(s[i]); i++) {
+        if (n < WIDX_TERM) term[n++] = fold(s[i]);
+    }
+    *off = i;
+    return n;
+}
+
+/*
+ * Function: build_widx()
+ * -----------------------------
+ * Builds the word index of a file and writes it to the sidecar file. The file
+ * is loaded with load_file() and split into lines and words in a single pass.
+ * Each word is added to a hash table of terms (growing when half full), and 
+ * its line and position in the line are appended to the posting list of its
+ * term. The terms are then sorted to form the term directory, which is written
+ * with the line start table, the names of the terms and the posting lists to
+ * a temporary path and renamed into place, replacing any delta of the old 
+ * index. If there are any errors, valid error messages are printed and 
+ * program quits.
+ *
+ * fpath: path to file to be indexed
+ * report: print the result of indexing (0 when merging a delta after an edit)
+ */
+void build_widx(const char *fpath, int report) {
+    struct fbuf fb;
+    struct stat sb;
+
+    load_file(fpath, &fb, 0);
+    // Retrieves the size and modification time of the file (with error handling)
+    if (fstat(fb.fd, &sb)) {
+        unload_file(&fb);
+        die("fstat");
+    }
+
+    uint64_t lines = fb.len > 0 ? count_buffer(fb.data, fb.len, fb.plan.threads, NULL) + 1 : 0;
+    uint64_t *lstart = (uint64_t *) malloc((lines ? lines : 1) * sizeof(uint64_t));
+    size_t cap = 1024, used = 0;
+    struct word_entry *table = (struct word_entry *) calloc(cap, sizeof(struct word_entry));
+    if (!lstart || !table) die("malloc");
+
+    const char *line = fb.data, *end = fb.data + fb.len, *next;
+    char term[WIDX_TERM];
+    uint64_t lineno = 0, pos, words = 0, h;
+    size_t off, tlen, i, j;
+    progress_start("index words", fb.len, 0);
+
+    // For each line of the file
+    for (; line < end; line = next) {
+        next = memchr(line, '\n', end - line);
+        next = next ? next + 1 : end;
+        lstart[lineno++] = line - fb.data;
+
+        // For each word of the line
+        for (off = 0, pos = 0; (tlen = next_word(line, next - line, &off, term)) > 0; pos++) {
+            // Find term in hash table (linear probing)
+            uint64_t hash = term_hash(term, tlen);
+            h = hash & (cap - 1);
+            while (table[h].name && (table[h].hash != hash || table[h].nlen != tlen || memcmp(table[h].name, term, tlen))) {
+                h = (h + 1) & (cap - 1);
+            }
+
+            // If new term, add it to the table
+            if (!table[h].name) {
+                table[h].name = (char *) malloc(tlen);
+                if (!table[h].name) die("malloc");
+                memcpy(table[h].name, term, tlen);
+                table[h].nlen = tlen;
+                table[h].hash = hash;
+                used++;
+            }
+
+            // Append occurrence to posting list (line and position as differences)
+            struct word_entry *w = &table[h];
+            if (put_varint(&w->post, &w->len, &w->cap, lineno - w->last)
+                    || put_varint(&w->post, &w->len, &w->cap, w->last == lineno ? pos - w->lastpos : pos)) {
+                die("realloc");
+            }
+            if (w->last != lineno) w->lines++;
+            w->last = lineno;
+            w->lastpos = pos;
+            w->count++;
+            words++;
+
+            // Double the size of the hash table once it is half full (with error handling)
+            if (used * 2 > cap) {
+                struct word_entry *bigger = (struct word_entry *) calloc(cap * 2, sizeof(struct word_entry));
+                if (!bigger) die("calloc");
+                for (i = 0; i < cap; i++) {
+                    if (!table[i].name) continue;
+                    j = table[i].hash & (cap * 2 - 1);
+                    while (bigger[j].name) j = (j + 1) & (cap * 2 - 1);
+                    bigger[j] = table[i];
+                }
+                free(table);
+                table = bigger;
+                cap *= 2;
+            }
+        }
+        progress_add(next - line, 0);
+    }
+    // A file ending with a newline char has an empty last line
+    if (lineno < lines) lstart[lineno++] = fb.len;
+    progress_stop();
+    unload_file(&fb);
+
+    // Move used entries to the start of the table and sort them by term
+    size_t nterms = 0;
+    for (i = 0; i < cap; i++) {
+        if (table[i].name) table[nterms++] = table[i];
+    }
+    qsort(table, nterms, sizeof(struct word_entry), cmp_word);
+
+    // Fill in header
+    struct widx_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, WIDXMAGIC, sizeof(hdr.magic));
+    hdr.version = IDXVERSION;
+    hdr.size = sb.st_size;
+    hdr.mtime_sec = sb.st_mtim.tv_sec;
+    hdr.mtime_nsec = sb.st_mtim.tv_nsec;
+    hdr.lines = lines;
+    hdr.nterms = nterms;
+
+    // Build the term directory with offsets into the names and posting lists
+    struct widx_term *dir = (struct widx_term *) calloc(nterms ? nterms : 1, sizeof(struct widx_term));
+    if (!dir) die("calloc");
+    for (i = 0; i < nterms; i++) {
+        dir[i].name = hdr.namelen;
+        dir[i].nlen = table[i].nlen;
+        dir[i].lines = table[i].lines;
+        dir[i].count = table[i].count;
+        dir[i].offset = hdr.postlen;
+        dir[i].len = table[i].len;
+        hdr.namelen += table[i].nlen;
+        hdr.postlen += table[i].len;
+    }
 
-        // Attempts to delete original log file (with error handling)
-        if (remove(LOGF)) {
-            fprintf(stderr, "Error removing original log file. Warning there will be temp files remaining.\n");
-            die("remove");
+    // Attempts to open temporary sidecar file in write mode (with error handling)
+    char ipath[MAXF + 16], tpath[MAXF + 24];
+    snprintf(ipath, sizeof(ipath), "%s%s", fpath, WIDXEXT);
+    snprintf(tpath, sizeof(tpath), "%s.tmp", ipath);
+    FILE *out = fopen(tpath, "w");
+    if (!out) die("fopen index");
+
+    // Write each section of the index (with error handling)
+    int err = fwrite(&hdr, sizeof(hdr), 1, out) != 1
+        || fwrite(lstart, sizeof(uint64_t), lines, out) != lines
+        || fwrite(dir, sizeof(struct widx_term), nterms, out) != nterms;
+    for (i = 0; i < nterms && !err; i++) {
+        if (fwrite(table[i].name, 1, table[i].nlen, out) != table[i].nlen) err = 1;
+    }
+    for (i = 0; i < nterms && !err; i++) {
+        if (fwrite(table[i].post, 1, table[i].len, out) != table[i].len) err = 1;
+    }
+    if (fclose(out) || err) {
+        remove(tpath);
+        die("write index");
+    }
+
+    // Attempts to rename temporary sidecar into place (with error handling)
+    if (rename(tpath, ipath)) {
+        fprintf(stderr, "Error renaming index file. Warning temp index file will be remaining.\n");
+        die("rename");
+    }
+    // Delta of the old index does not apply to the new one
+    drop_sidecar(fpath, WDELTAEXT);
+
+    if (report && opts.json) {
+        json_begin("result", "index_words", fpath);
+        printf(",\"lines\":%lu,\"words\":%lu,\"terms\":%lu", lines, words, nterms);
+        json_end(1);
+    } else if (report) {
+        printf("Indexed \'%s\': %lu lines, %lu words, %lu terms\n", fpath, lines, words, nterms);
+    }
+
+    for (i = 0; i < nterms; i++) {
+        free(table[i].name);
+        free(table[i].post);
+    }
+    free(table);
+    free(dir);
+    free(lstart);
+}
+
+/*
+ * Function: free_widx()
+ * -----------------------------
+ * Unmaps a word index that was loaded with load_widx(), along with its delta
+ * and the parts of the file found from it.
+ *
+ * wx: index to be unmapped
+ */
+void free_widx(struct widx *wx) {
+    munmap(wx->map, wx->maplen);
+    if (wx->dmap) munmap(wx->dmap, wx->dmaplen);
+    free(wx->segs);
+}
+
+/*
+ * Function: load_wdelta()
+ * -----------------------------
+ * Maps the delta sidecar file of a word index into memory and checks that it
+ * applies to the index: the magic and version must match, the records must 
+ * fit inside the sidecar and the size and modification time the delta was 
+ * started from must match those recorded in the index. 
+ *
+ * fpath: path to the indexed file
+ * wx: loaded word index, filled in with the mapped delta
+ *
+ * returns: 0 if a delta was loaded, else -1 (the index has no usable delta)
+ */
+int load_wdelta(const char *fpath, struct widx *wx) {
+    char dpath[MAXF + 16];
+    struct stat db;
+    snprintf(dpath, sizeof(dpath), "%s%s", fpath, WDELTAEXT);
+
+    // If delta cannot be accessed, the index has no delta
+    int fd = open(dpath, O_RDONLY);
+    if (fd == -1) return -1;
+    if (fstat(fd, &db) || (size_t) db.st_size < sizeof(struct wdelta_header)) {
+        close(fd);
+        return -1;
+    }
+
+    // Map delta into memory (file descriptor not needed after mapping)
+    void *map = mmap(NULL, db.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return -1;
+
+    // If delta does not apply to this index, it is not used
+    struct wdelta_header *dh = (struct wdelta_header *) map;
+    if (memcmp(dh->magic, WDELTAMAGIC, sizeof(dh->magic)) || dh->version != IDXVERSION
+            || dh->len > (uint64_t) db.st_size - sizeof(struct wdelta_header) || dh->base_size != wx->hdr->size
+            || dh->base_sec != wx->hdr->mtime_sec || dh->base_nsec != wx->hdr->mtime_nsec) {
+        munmap(map, db.st_size);
+        return -1;
+    }
+
+    wx->dmap = map;
+    wx->dmaplen = db.st_size;
+    wx->dhdr = dh;
+    wx->delta = (const unsigned char *) (dh + 1);
+    return 0;
+}
+
+/*
+ * Function: load_widx()
+ * -----------------------------
+ * Maps the word index sidecar file of a file into memory and checks that it is
+ * usable: the magic and version must match, the sections must fit inside the
+ * sidecar and the size and modification time recorded must still match the
+ * file. If the index has a delta (see load_wdelta()), the size and 
+ * modification time after the last edit recorded in the delta must match the
+ * file instead. A missing or stale index is not an error, the caller decides
+ * what to do without it.
+ *
+ * fpath: path to the indexed file
+ * wx: struct filled in with the mapped sections of the index
+ *
+ * returns: 0 if a valid index was loaded, else -1
+ */
+int load_widx(const char *fpath, struct widx *wx) {
+    char ipath[MAXF + 16];
+    struct stat sb, ib;
+    snprintf(ipath, sizeof(ipath), "%s%s", fpath, WIDXEXT);
+    memset(wx, 0, sizeof(*wx));
+
+    // If file or index cannot be accessed, no index is used
+    if (stat(fpath, &sb)) return -1;
+    int fd = open(ipath, O_RDONLY);
+    if (fd == -1) return -1;
+    if (fstat(fd, &ib) || (size_t) ib.st_size < sizeof(struct widx_header)) {
+        close(fd);
+        return -1;
+    }
+
+    // Map index into memory (file descriptor not needed after mapping)
+    void *map = mmap(NULL, ib.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return -1;
+
+    struct widx_header *hdr = (struct widx_header *) map;
+    uint64_t need = sizeof(struct widx_header) + hdr->lines * sizeof(uint64_t)
+        + hdr->nterms * sizeof(struct widx_term) + hdr->namelen + hdr->postlen;
+
+    // If index is not a valid index, it is not used
+    if (memcmp(hdr->magic, WIDXMAGIC, sizeof(hdr->magic)) || hdr->version != IDXVERSION || need > (uint64_t) ib.st_size) {
+        munmap(map, ib.st_size);
+        return -1;
+    }
+    wx->map = map;
+    wx->maplen = ib.st_size;
+    wx->hdr = hdr;
+
+    // The file must be as it was indexed, or as it was after the last edit recorded in the delta
+    uint64_t size = hdr->size;
+    int64_t sec = hdr->mtime_sec, nsec = hdr->mtime_nsec;
+    if (!load_wdelta(fpath, wx)) {
+        size = wx->dhdr->size;
+        sec = wx->dhdr->mtime_sec;
+        nsec = wx->dhdr->mtime_nsec;
+    }
+    if (size != (uint64_t) sb.st_size || sec != sb.st_mtim.tv_sec || nsec != sb.st_mtim.tv_nsec) {
+        free_widx(wx);
+        memset(wx, 0, sizeof(*wx));
+        return -1;
+    }
+
+    wx->lstart = (uint64_t *) (hdr + 1);
+    wx->dir = (struct widx_term *) (wx->lstart + hdr->lines);
+    wx->names = (const char *) (wx->dir + hdr->nterms);
+    wx->post = (const unsigned char *) wx->names + hdr->namelen;
+    return 0;
+}
+
+/*
+ * Function: widx_postings()
+ * -----------------------------
+ * Finds a term in the term directory of a word index (binary search) and 
+ * decodes its posting list into arrays of occurrences and distinct lines. The
+ * arrays are allocated by the function (freed with free_postings()). Terms 
+ * not in the index have no occurrences.
+ *
+ * wx: loaded word index
+ * term: term to look up (folded, see next_word())
+ * tlen: length of the term
+ * ps: struct filled in with the occurrences of the term
+ */
+void widx_postings(struct widx *wx, const char *term, size_t tlen, struct postings *ps) {
+    size_t lo = 0, hi = wx->hdr->nterms, mid;
+    const struct widx_term *t;
+
+    memset(ps, 0, sizeof(*ps));
+    // Binary search directory for term
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        t = &wx->dir[mid];
+        if (cmp_term(wx->names + t->name, t->nlen, term, tlen) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    if (lo == wx->hdr->nterms) return;
+    t = &wx->dir[lo];
+    if (cmp_term(wx->names + t->name, t->nlen, term, tlen)) return;
+
+    ps->line = (uint64_t *) malloc((t->count ? t->count : 1) * sizeof(uint64_t));
+    ps->pos = (uint32_t *) malloc((t->count ? t->count : 1) * sizeof(uint32_t));
+    ps->lines = (uint64_t *) malloc((t->lines ? t->lines : 1) * sizeof(uint64_t));
+    if (!ps->line || !ps->pos || !ps->lines) die("malloc");
+
+    // Decode occurrences, collecting the distinct lines as they are found
+    const unsigned char *p = wx->post + t->offset, *end = p + t->len;
+    uint64_t line = 0, pos = 0, delta;
+    while (p < end && ps->n < t->count) {
+        delta = get_varint(&p, end);
+        pos = delta ? get_varint(&p, end) : pos + get_varint(&p, end);
+        line += delta;
+        if (delta && ps->nlines < t->lines) ps->lines[ps->nlines++] = line;
+        ps->line[ps->n] = line;
+        ps->pos[ps->n++] = pos;
+    }
+}
+
+/*
+ * Function: free_postings()
+ * -----------------------------
+ * Frees the arrays of postings decoded by widx_postings().
+ *
+ * ps: decoded postings
+ */
+void free_postings(struct postings *ps) {
+    free(ps->line);
+    free(ps->pos);
+    free(ps->lines);
+}
+
+/*
+ * Function: gallop()
+ * -----------------------------
+ * Finds the first entry of a sorted array that is not less than a value, 
+ * starting from a given index. The search gallops forward in steps that double
+ * each time until it passes the value, then binary searches the last step, so
+ * it costs the log of the distance moved rather than of the array length. 
+ *
+ * a: sorted array
+ * n: length of the array
+ * from: index to start from
+ * val: value to find
+ *
+ * returns: index of the first entry not less than val (n if there is none)
+ */
+size_t gallop(const uint64_t *a, size_t n, size_t from, uint64_t val) {
+    size_t step = 1, lo = from, hi = from, mid;
+
+    // Double the step until an entry not less than val is passed
+    while (hi < n && a[hi] < val) {
+        lo = hi + 1;
+        hi += step;
+        step *= 2;
+    }
+    if (hi > n) hi = n;
+
+    // Binary search the last step
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (a[mid] < val) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+/*
+ * Function: intersect()
+ * -----------------------------
+ * Intersects a sorted list of lines with another in place. Each line of the 
+ * first list is looked for in the second with gallop(), so the cost depends 
+ * on the length of the first (shorter) list rather than the second.
+ *
+ * a: sorted list that is reduced to the intersection
+ * na: length of the list
+ * b: sorted list to intersect with
+ * nb: length of the list
+ *
+ * returns: length of the intersection
+ */
+size_t intersect(uint64_t *a, size_t na, const uint64_t *b, size_t nb) {
+    size_t i, j = 0, n = 0;
+
+    for (i = 0; i < na && j < nb; i++) {
+        j = gallop(b, nb, j, a[i]);
+        if (j < nb && b[j] == a[i]) a[n++] = a[i];
+    }
+    return n;
+}
+
+/*
+ * Function: phrase_lines()
+ * -----------------------------
+ * Finds the lines containing a phrase: a list of terms that must occur at 
+ * consecutive positions of a line (a single term is a phrase of one word). 
+ * The distinct lines of the term with the fewest lines are intersected with 
+ * those of the other terms, and for phrases of several terms the positions of
+ * each term on the remaining lines are then checked. The list is allocated by
+ * the function (must be freed outside of function in appropriate place).
+ *
+ * wx: loaded word index
+ * terms: terms of the phrase (each WIDX_TERM chars)
+ * tlens: lengths of the terms
+ * nterms: number of terms in the phrase
+ * out: pointer set to the allocated list of lines
+ *
+ * returns: number of lines in the list
+ */
+size_t phrase_lines(struct widx *wx, char (*terms)[WIDX_TERM], size_t *tlens, size_t nterms, uint64_t **out) {
+    struct postings *ps = (struct postings *) malloc(nterms * sizeof(struct postings));
+    size_t i, j, n, rare = 0;
+    if (!ps) die("malloc");
+
+    // Decode the postings of each term and find the term on the fewest lines
+    for (i = 0; i < nterms; i++) {
+        widx_postings(wx, terms[i], tlens[i], &ps[i]);
+        if (ps[i].nlines < ps[rare].nlines) rare = i;
+    }
+
+    // Intersect the lines of the rarest term with the lines of the other terms
+    *out = (uint64_t *) malloc((ps[rare].nlines ? ps[rare].nlines : 1) * sizeof(uint64_t));
+    if (!*out) die("malloc");
+    memcpy(*out, ps[rare].lines, ps[rare].nlines * sizeof(uint64_t));
+    n = ps[rare].nlines;
+    for (i = 0; i < nterms && n > 0; i++) {
+        if (i != rare) n = intersect(*out, n, ps[i].lines, ps[i].nlines);
+    }
+
+    // For phrases, keep the lines where the terms occur at consecutive positions
+    if (nterms > 1) {
+        size_t *cur = (size_t *) calloc(nterms, sizeof(size_t));
+        size_t kept = 0, s, e;
+        if (!cur) die("calloc");
+        for (j = 0; j < n; j++) {
+            // Find the occurrences of the first term on the line
+            cur[0] = gallop(ps[0].line, ps[0].n, cur[0], (*out)[j]);
+            for (s = cur[0]; s < ps[0].n && ps[0].line[s] == (*out)[j]; s++) {
+                // Check each following term occurs at the following position
+                for (i = 1; i < nterms; i++) {
+                    cur[i] = gallop(ps[i].line, ps[i].n, cur[i], (*out)[j]);
+                    for (e = cur[i]; e < ps[i].n && ps[i].line[e] == (*out)[j] && ps[i].pos[e] < ps[0].pos[s] + i; e++);
+                    if (e == ps[i].n || ps[i].line[e] != (*out)[j] || ps[i].pos[e] != ps[0].pos[s] + i) break;
+                }
+                if (i == nterms) break;
+            }
+            if (s < ps[0].n && ps[0].line[s] == (*out)[j]) (*out)[kept++] = (*out)[j];
         }
+        n = kept;
+        free(cur);
+    }
 
-        // Attempts to rename temp file to replace log file (with error handling)
-        if (rename(TEMPF, LOGF)) {
-            fprintf(stderr, "Error renaming temp file. Warning temp file will be remaining.\n");
-            die("rename");
+    for (i = 0; i < nterms; i++) free_postings(&ps[i]);
+    free(ps);
+    return n;
+}
+
+/*
+ * Function: merge_lines()
+ * -----------------------------
+ * Merges two sorted lists of lines into a new sorted list without duplicates
+ * (the union of the lists). The new list is allocated by the function (must be
+ * freed outside of function in appropriate place).
+ *
+ * a: first sorted list
+ * na: length of the first list
+ * b: second sorted list
+ * nb: length of the second list
+ * out: pointer set to the allocated list
+ *
+ * returns: length of the merged list
+ */
+size_t merge_lines(const uint64_t *a, size_t na, const uint64_t *b, size_t nb, uint64_t **out) {
+    size_t i = 0, j = 0, n = 0;
+
+    *out = (uint64_t *) malloc((na + nb ? na + nb : 1) * sizeof(uint64_t));
+    if (!*out) die("malloc");
+    while (i < na || j < nb) {
+        if (j == nb || (i < na && a[i] < b[j])) (*out)[n++] = a[i++];
+        else if (i == na || b[j] < a[i]) (*out)[n++] = b[j++];
+        else {
+            (*out)[n++] = a[i++];
+            j++;
         }
+    }
+    return n;
+}
 
-    // Otherwise, if logs does not exceed limit, close log file
-    } else {
-        fclose(fptr);
+/*
+ * Function: delta_view()
+ * -----------------------------
+ * Finds the parts of a file whose word index has a delta by replaying the 
+ * records of the delta: the file starts as a single run of the lines of the
+ * index, and each record keeps the parts before the lines it replaces, then
+ * its added lines, then the parts after the lines it replaces (splitting runs
+ * as needed). The cost depends on the size of the delta, not of the file. The
+ * parts are stored in the index (freed by free_widx()).
+ *
+ * wx: loaded word index with a delta
+ *
+ * returns: 0 if successful, else -1 if the delta does not describe the file
+ */
+int delta_view(struct widx *wx) {
+    const unsigned char *p = wx->delta, *end = wx->delta + wx->dhdr->len;
+    uint64_t r, line, removed, added, a, k, words, skip, cur, lines = wx->hdr->lines;
+    struct wseg *segs = (struct wseg *) malloc(sizeof(struct wseg)), *out;
+    size_t n = 0, nout, i;
+    if (!segs) die("malloc");
+
+    if (lines) {
+        segs[0].base = 1;
+        segs[0].count = lines;
+        segs[0].words = NULL;
+        n = 1;
+    }
+
+    // For each record of the delta
+    for (r = 0; r < wx->dhdr->records; r++) {
+        line = get_varint(&p, end);
+        removed = get_varint(&p, end);
+        added = get_varint(&p, end);
+        // Lines replaced must be lines of the file
+        if (line < 1 || line > lines + 1 || removed > lines + 1 - line || added > (uint64_t) (end - p)) break;
+
+        // Replacing lines splits at most one part in two
+        out = (struct wseg *) malloc((n + added + 1) * sizeof(struct wseg));
+        if (!out) die("malloc");
+        nout = 0;
+
+        // Keep the parts of the file before the lines replaced
+        for (i = 0, cur = 1; i < n && cur < line; cur += segs[i++].count) {
+            out[nout] = segs[i];
+            if (cur + segs[i].count > line) out[nout].count = line - cur;
+            nout++;
+        }
+
+        // Followed by the lines added (words are checked to be inside the delta)
+        for (a = 0; a < added && p < end; a++) {
+            out[nout].base = 0;
+            out[nout].count = 1;
+            out[nout++].words = p;
+            words = get_varint(&p, end);
+            for (k = 0; k < words && p < end; k++) p += 1 + *p;
+            if (k < words || p > end) break;
+        }
+        if (a < added) {
+            free(out);
+            break;
+        }
+
+        // And the parts of the file after the lines replaced
+        for (i = 0, cur = 1; i < n; cur += segs[i++].count) {
+            if (cur + segs[i].count <= line + removed) continue;
+            out[nout] = segs[i];
+            if (cur < line + removed) {
+                skip = line + removed - cur;
+                out[nout].base += skip;
+                out[nout].count -= skip;
+            }
+            nout++;
+        }
+
+        free(segs);
+        segs = out;
+        n = nout;
+        lines = lines - removed + added;
+    }
+
+    // If the delta ends early or gives a different number of lines, it is not used
+    if (r < wx->dhdr->records || p != end || lines != wx->dhdr->lines) {
+        free(segs);
+        return -1;
     }
+
+    wx->segs = segs;
+    wx->nsegs = n;
+    return 0;
 }
 
 /*
- * Function: change_log()
+ * Function: added_phrase()
  * -----------------------------
- * Write the provided logstr argment to the end of the log file (if log file 
- * does not exist, it is created). The logstr is written alongside a timestamp. 
- * After writing, truncateLog() is called to ensure the log file does not become
- * too long.
- * 
- * logstr: formatted log string (describing operation) to be appended to log file 
+ * Checks whether a line added by an edit contains a phrase, comparing the 
+ * terms of the phrase with the words of the line stored in the delta.
+ *
+ * words: words of the line in the delta (see struct wdelta_header)
+ * end: end of the delta
+ * terms: terms of the phrase (each WIDX_TERM chars)
+ * tlens: lengths of the terms
+ * nterms: number of terms in the phrase
+ *
+ * returns: 1 if the terms occur at consecutive positions of the line, else 0
  */
-void change_log(char *logstr) {
-    // Retrieve current time
-    time_t t = time(NULL);
-    struct tm* timeinfo;
-    timeinfo = localtime(&t);
-    
-    // Attempt to open log file in append plus mode (with error handling)
-    FILE *fptr = fopen(LOGF, "a+");
-    if (!fptr) die("fopen log");
+int added_phrase(const unsigned char *words, const unsigned char *end, char (*terms)[WIDX_TERM], size_t *tlens, size_t nterms) {
+    const unsigned char *p = words, *q;
+    uint64_t nwords = get_varint(&p, end), w;
+    size_t i;
+
+    // For each position the phrase could start at, compare the following words with the terms
+    for (w = 0; w + nterms <= nwords; w++, p += 1 + *p) {
+        for (i = 0, q = p; i < nterms; i++, q += 1 + *q) {
+            if (*q != tlens[i] || memcmp(q + 1, terms[i], tlens[i])) break;
+        }
+        if (i == nterms) return 1;
+    }
+    return 0;
+}
 
-    // Add time in correct format with log string to the end of the log file
-    fprintf(fptr, "[%04d-%02d-%02d %02d:%02d:%02d] %s\n", timeinfo->tm_year + 1900, timeinfo->tm_mon + 1, 
-        timeinfo->tm_mday, timeinfo->tm_hour, timeinfo->tm_min, timeinfo->tm_sec, logstr);
-    
-    // Close the log file
-    fclose(fptr);
-    // Manage log file length
-    truncate_log();
+/*
+ * Function: delta_lines()
+ * -----------------------------
+ * Turns the lines of the index found for a phrase by phrase_lines() into the
+ * lines of the file with the parts found by delta_view(): lines of the index
+ * removed by edits are dropped, the lines kept are renumbered, and the lines 
+ * added by edits that contain the phrase are added (checked with 
+ * added_phrase()). The list stays sorted, as edits do not reorder lines.
+ *
+ * wx: loaded word index with the parts of the file found
+ * terms: terms of the phrase (each WIDX_TERM chars)
+ * tlens: lengths of the terms
+ * nterms: number of terms in the phrase
+ * lines: pointer to the list of lines of the index (replaced by the new list)
+ * n: length of the list
+ *
+ * returns: length of the new list
+ */
+size_t delta_lines(struct widx *wx, char (*terms)[WIDX_TERM], size_t *tlens, size_t nterms, uint64_t **lines, size_t n) {
+    uint64_t *out = (uint64_t *) malloc((n + wx->nsegs + 1) * sizeof(uint64_t)), cur = 1;
+    const unsigned char *end = wx->delta + wx->dhdr->len;
+    size_t i, j = 0, m = 0;
+    const struct wseg *s;
+    if (!out) die("malloc");
+
+    for (i = 0; i < wx->nsegs; cur += wx->segs[i++].count) {
+        s = &wx->segs[i];
+        // Added lines are checked against the words stored in the delta
+        if (s->words) {
+            if (added_phrase(s->words, end, terms, tlens, nterms)) out[m++] = cur;
+            continue;
+        }
+        // Lines of the index before the run were removed, those in it are renumbered
+        j = gallop(*lines, n, j, s->base);
+        for (; j < n && (*lines)[j] < s->base + s->count; j++) out[m++] = cur + (*lines)[j] - s->base;
+    }
+
+    free(*lines);
+    *lines = out;
+    return m;
 }
 
 /*
- * Function display_log()
+ * Function: query_words()
  * -----------------------------
- * Verifies the log file is safe for reading with fgets and then proceeds to 
- * read logs from the log file. If a file path is specified, then only logs 
- * related to the file path will be printed, otherwise if the file path is NULL,
- * all the logs will be printed. This is done by searching for a search key in 
- * each of the lines and ensuring it occurs before any quotation marks used to 
- * encase literal strings that were added to the files.
- * 
- * fpath: path to file for which the change log is to be displayed (if NULL all
- * logs will be displayed)
+ * Answers a word query using the word index of a file, without reading the 
+ * file other than the lines printed. A query is a list of clauses separated by
+ * OR, and a clause is a list of items that must all be on a line (AND may be
+ * written between them). An item is a word, or a phrase of words that must be
+ * next to each other, written in double quotes (items joined by other chars,
+ * such as "e-mail", are also phrases). Words are matched as whole words 
+ * ignoring the case of ASCII letters. The lines of each item are found with 
+ * phrase_lines(), the items of a clause are intersected with intersect() and
+ * the clauses are merged with merge_lines(). Matching lines are printed in the
+ * same format as regex_search(), or only counted (--count), limited to the 
+ * first lines (--first), checked for existence (--quiet) or printed as JSON 
+ * records (--json). If the index has a delta, the lines of each item are 
+ * mapped to the edited file with delta_lines(), and the lines printed are 
+ * found by stepping through the file instead of using the line start table.
+ * If the file has no valid word index, error message is printed and program
+ * quits.
+ *
+ * fpath: path to file to query
+ * query: words to look for
  */
-void display_log(char *fpath) {
-    // If log file does not exist (or cannot be accessed), error message is printed and program quits
-    if (access(LOGF, F_OK)) {
-        printf("Log file does not exist.\n");
+void query_words(char *fpath, char *query) {
+    struct widx wx;
+
+    if (load_widx(fpath, &wx) || (wx.dhdr && delta_view(&wx))) {
+        if (wx.map) free_widx(&wx);
+        fprintf(stderr, "File \'%s\' has no valid word index (build one with -index-words).\n", fpath);
         exit(1);
     }
 
-    // Attempt to open log file in read mode (with error handling)
-    FILE *fptr = fopen(LOGF, "r");
-    if (!fptr) die("fopen log");
+    size_t len = strlen(query), i = 0, j, ilen, off, nterms, n;
+    size_t nresult = 0, nclause = 0, total = 0;
+    char (*terms)[WIDX_TERM] = (char (*)[WIDX_TERM]) malloc((len / 2 + 1) * WIDX_TERM);
+    size_t *tlens = (size_t *) malloc((len / 2 + 1) * sizeof(size_t));
+    uint64_t *result = NULL, *clause = NULL, *lines, *merged;
+    const char *item;
+    int started = 0, quoted;
+    if (!terms || !tlens) die("malloc");
 
-    // If log file is not safe for fgets(), error message is printed and program quits
-    if (verify_lines(&fptr, LOGLEN - 2) == -1){
-        puts("Warning: Log file has been edited by another program. Modify file to meet constraint or Delete file.\n");
-        fclose(fptr);
-        exit(1);
+    // For each item of the query (and once more at the end to finish the last clause)
+    while (1) {
+        while (i < len && isspace((unsigned char) query[i])) i++;
+
+        // Phrases are written in quotes, other items end at a space or quote
+        quoted = i < len && query[i] == '"';
+        if (quoted) {
+            item = query + i + 1;
+            for (j = i + 1; j < len && query[j] != '"'; j++);
+            ilen = j - i - 1;
+            i = j < len ? j + 1 : j;
+        } else {
+            item = query + i;
+            for (j = i; j < len && !isspace((unsigned char) query[j]) && query[j] != '"'; j++);
+            ilen = j - i;
+            i = j;
+            if (ilen == 3 && !memcmp(item, "AND", 3)) continue;
+        }
+
+        // At OR or the end of the query, the lines of the clause are added to the result
+        if (!quoted && (ilen == 0 || (ilen == 2 && !memcmp(item, "OR", 2)))) {
+            if (started) {
+                n = merge_lines(result, nresult, clause, nclause, &merged);
+                free(result);
+                free(clause);
+                result = merged;
+                nresult = n;
+                started = 0;
+            }
+            if (i >= len) break;
+            continue;
+        }
+
+        // Split item into terms (a single term or a phrase)
+        for (off = 0, nterms = 0; (tlens[nterms] = next_word(item, ilen, &off, terms[nterms])) > 0; nterms++);
+        if (!nterms) continue;
+        total += nterms;
+
+        // Intersect lines of the item with the lines of the rest of the clause
+        n = phrase_lines(&wx, terms, tlens, nterms, &lines);
+        if (wx.dhdr) n = delta_lines(&wx, terms, tlens, nterms, &lines, n);
+        if (started) {
+            nclause = intersect(clause, nclause, lines, n);
+            free(lines);
+        } else {
+            clause = lines;
+            nclause = n;
+            started = 1;
+        }
     }
+    free(terms);
+    free(tlens);
 
-    // File pointer is reset to start of file (with error handling)
-    if (fseek(fptr, 0, SEEK_SET)) {
-        fclose(fptr);
-        die("fseek");
+    // If query has no words, error message is printed and program quits
+    if (!total) {
+        fprintf(stderr, "Query \"%s\" has no words to look for.\n", query);
+        free_widx(&wx);
+        exit(1);
     }
 
-    // If fpath is not NULL, a search key is constructed 
-    char key[MAX];
-    if (fpath != NULL) {
-        snprintf(key, MAX, "File \'%s\'", fpath);    
+    // Existence checks only need to know if there is a matching line
+    if (opts.quiet) {
+        free(result);
+        free_widx(&wx);
+        exit(nresult ? 0 : 1);
     }
+    if (opts.first && nresult > opts.first) nresult = opts.first;
+
+    // Print matching lines from the file (unless only counting)
+    if (!opts.count && nresult) {
+        struct fbuf fb;
+        uint64_t nlines = wx.dhdr ? wx.dhdr->lines : wx.hdr->lines, start = 0, end, cur = 1;
+        const char *nl;
+        int digits = 1;
+        // Finds the number of digits needs to display the line numbers
+        while (nlines > 9) {
+            nlines /= 10;
+            digits ++;
+        }
 
-    char *line = (char *) malloc(LOGLEN);
-    char *found;
-    int index;
-    
-    // Read lines from log file until End Of File
-    while (fgets(line, LOGLEN - 1, fptr) != NULL) {
-        // If fpath is NULL, print all lines
-        if (fpath == NULL) {
-            printf("%s", line);
-        // Otherwise, if search key found in line
-        } else if ((found = strstr(line, key)) != NULL) {
-            // Ensure that the search key occurs before any quotation marks
-            index = found - line;
-            if ((found = strchr(line, '\"')) != NULL) {
-                if (index < found - line) {
-                    printf("%s", line);    
+        // Only the matching lines of the file are read (up to the last match if edits moved lines)
+        load_file(fpath, &fb, !wx.dhdr);
+        for (j = 0; j < nresult; j++) {
+            if (wx.dhdr) {
+                // Line start table does not describe the edited file, so lines are found by stepping through it
+                for (; cur < result[j] && start < fb.len; cur++) {
+                    nl = memchr(fb.data + start, '\n', fb.len - start);
+                    start = nl ? (size_t) (nl - fb.data) + 1 : fb.len;
                 }
+                nl = memchr(fb.data + start, '\n', fb.len - start);
+                end = nl ? (size_t) (nl - fb.data) : fb.len;
+            } else {
+                start = wx.lstart[result[j] - 1];
+                end = result[j] < wx.hdr->lines ? wx.lstart[result[j]] : wx.hdr->size;
+            }
+            if (end > fb.len) end = fb.len;
+            while (end > start && (fb.data[end - 1] == '\n' || fb.data[end - 1] == '\r')) end--;
+            if (opts.json) {
+                json_line("match", "query", fpath, result[j], start, fb.data + start, end - start);
+                json_end(0);
             } else {
-                printf("%s", line);
+                // Line is written with its length, as it may contain NULL chars
+                printf("%0*lu |", digits, result[j]);
+                fwrite(fb.data + start, 1, end - start, stdout);
+                printf("\n\n");
+            }
+        }
+        unload_file(&fb);
+    }
+
+    free(result);
+    free_widx(&wx);
+
+    // Print total lines matching the query
+    if (opts.json) json_summary("query", fpath, nresult, nresult);
+    else printf("%lu line matches found in the file.\n", nresult);
+}
+
+/*
+ * Function: delta_begin()
+ * -----------------------------
+ * Starts recording the changes an operation makes to a file in the delta of 
+ * its word index, so that the index does not have to be rebuilt after the 
+ * edit. Only files whose word index is valid (including any delta recorded 
+ * before) have their changes recorded; the records of the existing delta are
+ * copied so that the new records can be added to them. Must be called before
+ * the file is modified.
+ *
+ * fpath: path to the file being edited (NULL if changes cannot be recorded)
+ * wd: struct filled in to record the changes
+ */
+void delta_begin(const char *fpath, struct wdelta *wd) {
+    struct widx wx;
+
+    memset(wd, 0, sizeof(*wd));
+    if (!fpath || load_widx(fpath, &wx)) return;
+
+    // Continue the existing delta, or start one from the index
+    if (wx.dhdr) {
+        wd->hdr = *wx.dhdr;
+        if (put_bytes(&wd->rec, &wd->len, &wd->cap, wx.delta, wx.dhdr->len)) die("realloc");
+    } else {
+        memcpy(wd->hdr.magic, WDELTAMAGIC, sizeof(wd->hdr.magic));
+        wd->hdr.version = IDXVERSION;
+        wd->hdr.base_size = wx.hdr->size;
+        wd->hdr.base_sec = wx.hdr->mtime_sec;
+        wd->hdr.base_nsec = wx.hdr->mtime_nsec;
+        wd->hdr.lines = wx.hdr->lines;
+    }
+    free_widx(&wx);
+    wd->live = 1;
+}
+
+/*
+ * Function: delta_splice()
+ * -----------------------------
+ * Records that an edit replaced lines of a file with new lines, adding a 
+ * record with the words of each new line to the delta. Line numbers are those
+ * of the file after the changes recorded before. Once the delta grows past 
+ * WDELTA_RECORDS records or WDELTA_BYTES bytes, recording stops and the index
+ * is rebuilt once the edit is complete.
+ *
+ * wd: changes being recorded (see delta_begin())
+ * line: first line replaced
+ * removed: number of lines removed
+ * text: new lines (separated by newline chars), or NULL if no lines are added
+ * len: length of the new lines
+ */
+void delta_splice(struct wdelta *wd, uint64_t line, uint64_t removed, const char *text, size_t len) {
+    const char *start, *next, *end = text + len;
+    char term[WIDX_TERM];
+    size_t off, tlen, words;
+    unsigned char tl;
+
+    if (!wd->live || wd->merge) return;
+    uint64_t added = text ? count_newlines(text, len) + 1 : 0;
+    if (put_varint(&wd->rec, &wd->len, &wd->cap, line) || put_varint(&wd->rec, &wd->len, &wd->cap, removed)
+            || put_varint(&wd->rec, &wd->len, &wd->cap, added)) {
+        die("realloc");
+    }
+
+    // For each new line, write the number of words and then each term with its length
+    for (start = text; added && start <= end; start = next + 1) {
+        next = memchr(start, '\n', end - start);
+        if (!next) next = end;
+        for (off = 0, words = 0; next_word(start, next - start, &off, term) > 0; words++);
+        if (put_varint(&wd->rec, &wd->len, &wd->cap, words)) die("realloc");
+        for (off = 0; (tlen = next_word(start, next - start, &off, term)) > 0;) {
+            tl = (unsigned char) tlen;
+            if (put_bytes(&wd->rec, &wd->len, &wd->cap, &tl, 1) || put_bytes(&wd->rec, &wd->len, &wd->cap, term, tlen)) {
+                die("realloc");
             }
         }
     }
-
-    free(line);
-    // Close the log file
-    fclose(fptr);
+    wd->hdr.lines = wd->hdr.lines + added - removed;
+    wd->hdr.records++;
+
+    // Large deltas are merged by rebuilding the index instead
+    if (wd->hdr.records > WDELTA_RECORDS || wd->len > WDELTA_BYTES) {
+        wd->merge = 1;
+        free(wd->rec);
+        wd->rec = NULL;
+        wd->len = wd->cap = 0;
+    }
+}
+
+/*
+ * Function: delta_commit()
+ * -----------------------------
+ * Writes the delta of a word index once an edit recorded with delta_splice()
+ * is complete, with the size and modification time of the edited file, to a
+ * temporary path that is renamed into place. If the delta grew too large, it
+ * is merged into the index by rebuilding the index with build_widx() instead.
+ *
+ * fpath: path to the edited file
+ * wd: changes recorded (freed by the function)
+ * lines: number of lines in the file after the edit
+ *
+ * returns: 0 if the word index describes the edited file, else -1
+ */
+int delta_commit(const char *fpath, struct wdelta *wd, size_t lines) {
+    char dpath[MAXF + 16], tpath[MAXF + 24];
+    struct stat sb;
+
+    // Merge large deltas into the index
+    if (wd->merge) {
+        build_widx(fpath, 0);
+        return 0;
+    }
+
+    // If the lines recorded do not add up to the lines of the file, the delta is not trusted
+    if (wd->hdr.lines != lines || stat(fpath, &sb)) {
+        free(wd->rec);
+        return -1;
+    }
+    wd->hdr.size = sb.st_size;
+    wd->hdr.mtime_sec = sb.st_mtim.tv_sec;
+    wd->hdr.mtime_nsec = sb.st_mtim.tv_nsec;
+    wd->hdr.len = wd->len;
+
+    // Attempts to write delta to temporary sidecar file and rename it into place
+    snprintf(dpath, sizeof(dpath), "%s%s", fpath, WDELTAEXT);
+    snprintf(tpath, sizeof(tpath), "%s.tmp", dpath);
+    FILE *out = fopen(tpath, "w");
+    int err = !out || fwrite(&wd->hdr, sizeof(wd->hdr), 1, out) != 1 || fwrite(wd->rec, 1, wd->len, out) != wd->len;
+    if ((out && fclose(out)) || err || rename(tpath, dpath)) {
+        remove(tpath);
+        free(wd->rec);
+        return -1;
+    }
+
+    free(wd->rec);
+    return 0;
+}
+
+/*
+ * Function: after_edit()
+ * -----------------------------
+ * Updates the state kept about a file after an operation has modified it: the
+ * line and suffix array indexes of the file are removed, the word index is 
+ * kept if the operation recorded its changes in the delta of the index (with
+ * delta_commit()) and removed otherwise, and the new line count is cached in
+ * the metadata of the file with meta_store().
+ *
+ * fpath: path to the modified file
+ * lines: number of lines in the file after the operation
+ * wd: changes recorded by the operation (NULL if they were not recorded)
+ */
+void after_edit(const char *fpath, size_t lines, struct wdelta *wd) {
+    drop_sidecar(fpath, IDXEXT);
+    drop_sidecar(fpath, SAEXT);
+    if (!wd || !wd->live || delta_commit(fpath, wd, lines)) {
+        drop_sidecar(fpath, WIDXEXT);
+        drop_sidecar(fpath, WDELTAEXT);
+    }
+    meta_store(fpath, lines);
 }
 
 /* --- FILE OPERATIONS --- */
@@ -606,15 +5107,17 @@ void create_file(char *fpath) {
     if (!access(fpath, F_OK)) {
         // And the file is a regular file, user is prompted to confirm overwriting
         if (is_file(fpath)) {
-            printf("File \'%s\' already exists and will be overwritten.", fpath);
+            fprintf(opts.json ? stderr : stdout, "File \'%s\' already exists and will be overwritten.", fpath);
             // If user does not confirm, program quits
             if (!confirm()) {
-                printf("Overwrite aborted.\n");
+                if (opts.json) json_error("create", fpath, "Overwrite aborted.");
+                else printf("Overwrite aborted.\n");
                 exit(1);
             }
         // If file is not a regular file, error message is printed and program quits
         } else {
-            printf("File path refers to non-regular file and cannot be modified.\n");
+            if (opts.json) json_error("create", fpath, "File path refers to non-regular file and cannot be modified.");
+            else printf("File path refers to non-regular file and cannot be modified.\n");
             exit(1);
         }
     // If file does not exist, validity of file path is checked
@@ -629,12 +5132,18 @@ void create_file(char *fpath) {
     // Closes file
     fclose(fptr);
 
+    // Updates indexes and metadata of the file (now empty)
+    after_edit(fpath, 0, NULL);
+
     // Creates log string describing operation and number of lines after operation
     char *msg = (char *) malloc(LOGLEN);
     snprintf(msg, LOGLEN, "File \'%s\' created/overwritten | Lines After = 0", fpath);
     // Appends log string to log file
     change_log(msg);
     free(msg);
+
+    // Prints the result of the operation as a JSON record
+    if (opts.json) json_result("create", fpath, 0);
 }
 
 /*
@@ -651,12 +5160,336 @@ void del_file(char *fpath) {
         die("remove");
     }
 
+    // Removes index of the deleted file
+    drop_index(fpath);
+
     // Creates log string describing operation and number of lines after operation
     char *msg = (char *) malloc(LOGLEN);
     snprintf(msg, LOGLEN, "File \'%s\' deleted  | Lines After = n/a", fpath);
     // Appends log string to log file
     change_log(msg);
     free(msg);
+
+    // Prints the result of the operation as a JSON record
+    if (opts.json) json_result("delete", fpath, -1);
+}
+
+/*
+ * Function: copy_range()
+ * -----------------------------
+ * Copies the bytes between two offsets of the source file to the same offsets
+ * in the destination file, using pread() and pwrite() with the provided buffer.
+ * The newlines within the copied bytes are counted while they are in memory so
+ * that the source does not need to be read a second time for logging purposes.
+ * Either file may be opened with O_DIRECT: reads and writes are then rounded up
+ * to whole aligned blocks (the extra bytes written at the end of the file are
+ * removed when the destination is truncated), and O_DIRECT is turned off if 
+ * the filesystem refuses it. When the page cache is not to be kept, copied 
+ * chunks are dropped from it with drop_cache().
+ *
+ * src: file descriptor of the file being copied from
+ * dst: file descriptor of the file being copied to
+ * start: offset of the first byte to be copied
+ * end: offset after the last byte to be copied
+ * buf: buffer of CHUNK bytes used to hold the data being copied (aligned to 
+ *      IO_ALIGN for O_DIRECT)
+ * newlines: pointer to counter that is incremented by newlines copied
+ * nocache: whether copied chunks are dropped from the page cache
+ *
+ * returns: 0 if successful, else -1 (errno set by failing call)
+ */
+int copy_range(int src, int dst, off_t start, off_t end, char *buf, size_t *newlines, int nocache) {
+    ssize_t nread, nwrite, nwritten, done;
+
+    // Copy chunks of the range until the end offset is reached
+    while (start < end) {
+        // Read lengths are rounded up to whole aligned blocks for O_DIRECT (only the range is used)
+        nread = pread(src, buf, end - start < CHUNK ? (end - start + IO_ALIGN - 1) & ~((off_t) IO_ALIGN - 1) : CHUNK, start);
+        // If O_DIRECT reads are refused, continue with buffered reads
+        if (nread == -1 && errno == EINVAL && (fcntl(src, F_GETFL) & O_DIRECT)) {
+            fcntl(src, F_SETFL, fcntl(src, F_GETFL) & ~O_DIRECT);
+            continue;
+        }
+        if (nread == -1) return -1;
+        // Source has shrunk while being copied, stop at the new end
+        if (nread == 0) break;
+        if (nread > end - start) nread = end - start;
+        throttle(nread);
+        progress_add(nread, 0);
+
+        *newlines += count_newlines(buf, nread);
+
+        // O_DIRECT writes of the end of the file are padded with zeros to a whole block
+        nwrite = nread;
+        if ((nread & (IO_ALIGN - 1)) && (fcntl(dst, F_GETFL) & O_DIRECT)) {
+            nwrite = (nread + IO_ALIGN - 1) & ~((ssize_t) IO_ALIGN - 1);
+            memset(buf + nread, 0, nwrite - nread);
+        }
+
+        // Write the whole chunk (handling partial writes)
+        for (done = 0; done < nwrite; done += nwritten) {
+            nwritten = pwrite(dst, buf + done, nwrite - done, start + done);
+            // If O_DIRECT writes are refused, continue with buffered writes
+            if (nwritten == -1 && errno == EINVAL && (fcntl(dst, F_GETFL) & O_DIRECT)) {
+                fcntl(dst, F_SETFL, fcntl(dst, F_GETFL) & ~O_DIRECT);
+                nwrite = nread;
+                nwritten = 0;
+                continue;
+            }
+            if (nwritten == -1) return -1;
+            throttle(nwritten);
+        }
+
+        // Drop the chunk from the page cache (no effect on O_DIRECT files)
+        if (nocache) {
+            drop_cache(src, start, start + nread, 0);
+            drop_cache(dst, start, start + nread, 1);
+        }
+        start += nread;
+    }
+
+    return 0;
+}
+
+/*
+ * Function: splice_range()
+ * -----------------------------
+ * Appends the bytes between two offsets of the source file to the destination
+ * file at its current offset. Uses copy_file_range() so that the data is 
+ * copied inside the kernel without passing through user space. If the kernel
+ * or filesystem does not support it, falls back to pread() and write().
+ * 
+ * src: file descriptor of the file being copied from
+ * dst: file descriptor of the file being appended to
+ * start: offset of the first byte to be copied
+ * end: offset after the last byte to be copied
+ * 
+ * returns: 0 if successful, else -1 (errno set by failing call)
+ */
+int splice_range(int src, int dst, off_t start, off_t end) {
+    ssize_t n, done, nwritten;
+
+    // Copy inside the kernel until the end offset is reached (in CHUNK pieces when throttled)
+    while (start < end) {
+        n = copy_file_range(src, &start, dst, NULL, (opts.bwlimit || opts.iops) && end - start > CHUNK ? CHUNK : end - start, 0);
+        if (n == 0) return 0;
+        if (n == -1) break;
+        // Each piece is both read and written
+        throttle(n);
+        throttle(n);
+        progress_add(n, 0);
+    }
+    if (start >= end) return 0;
+
+    // If kernel copies are not supported, copy through a buffer instead
+    if (errno != EXDEV && errno != ENOSYS && errno != EINVAL && errno != EOPNOTSUPP) return -1;
+    char *buf = pool_get();
+    if (!buf) return -1;
+    while (start < end) {
+        n = pread(src, buf, end - start < CHUNK ? end - start : CHUNK, start);
+        if (n <= 0) break;
+        throttle(n);
+        progress_add(n, 0);
+        for (done = 0; done < n; done += nwritten) {
+            if ((nwritten = write(dst, buf + done, n - done)) == -1) {
+                pool_put(buf);
+                return -1;
+            }
+            throttle(nwritten);
+        }
+        start += n;
+    }
+    pool_put(buf);
+    return n == -1 ? -1 : 0;
+}
+
+/*
+ * Struct that describes a region of a file by its start and end offsets. Used
+ * for the data regions of sparse files and the ranges given to worker threads.
+ */
+struct extent {
+    off_t start;
+    off_t end;
+};
+
+/*
+ * Struct holding the state shared by the worker threads of a parallel copy.
+ * Workers take the next range to copy from the list under the lock, and add 
+ * the newlines they counted to the total once they run out of ranges.
+ */
+struct copy_job {
+    int src;
+    int dst;
+    struct extent *ranges;
+    size_t nranges;
+    size_t next;
+    size_t newlines;
+    int nocache;
+    int err;
+    pthread_mutex_t lock;
+};
+
+/*
+ * Function: find_extents()
+ * -----------------------------
+ * Builds a list of the data regions of a file using SEEK_DATA and SEEK_HOLE.
+ * Filesystems without hole support report the rest of the file as one data 
+ * region. The list is allocated by the function (must be freed outside of 
+ * function in appropriate place).
+ * 
+ * fd: file descriptor of file being examined
+ * size: length of the file
+ * list: pointer to be set to the allocated list of data regions
+ * 
+ * returns: number of data regions in the list, or -1 if allocation fails
+ */
+ssize_t find_extents(int fd, off_t size, struct extent **list) {
+    size_t count = 0;
+    size_t cap = 16;
+    off_t data = 0;
+    off_t hole, next;
+
+    *list = (struct extent *) malloc(cap * sizeof(struct extent));
+    if (!*list) return -1;
+
+    // Find each data region until the end of the file is reached
+    while (data < size) {
+        // Find start of next data region and the end of that region
+        next = lseek(fd, data, SEEK_DATA);
+        // If no data regions remain, the rest of the file is a hole
+        if (next == -1 && errno == ENXIO) break;
+        // If holes are not supported, the rest of the file is treated as data
+        if (next == -1 || (hole = lseek(fd, next, SEEK_HOLE)) == -1) hole = size;
+        else data = next;
+
+        // Grow the list when full (with error handling)
+        if (count == cap) {
+            struct extent *tmp = (struct extent *) realloc(*list, (cap *= 2) * sizeof(struct extent));
+            if (!tmp) {
+                free(*list);
+                return -1;
+            }
+            *list = tmp;
+        }
+
+        (*list)[count].start = data;
+        (*list)[count].end = hole;
+        count++;
+        data = hole;
+    }
+
+    return count;
+}
+
+/*
+ * Function: copy_worker()
+ * -----------------------------
+ * Thread function for parallel copies. Repeatedly takes the next unclaimed 
+ * range from the shared copy job and copies it with copy_range() using its own
+ * buffer, until no ranges remain or another worker has failed. The newlines 
+ * counted by the worker are added to the total of the job before returning.
+ * 
+ * arg: pointer to the shared copy_job struct
+ * 
+ * returns: NULL
+ */
+void *copy_worker(void *arg) {
+    struct copy_job *job = (struct copy_job *) arg;
+    size_t newlines = 0;
+    size_t i;
+    int err = 0;
+
+    // Buffer is taken from the pool of aligned buffers (for O_DIRECT)
+    char *buf = pool_get();
+    if (!buf) err = ENOMEM;
+
+    while (!err) {
+        // Claim the next range of the job (stopping if another worker failed)
+        pthread_mutex_lock(&job->lock);
+        i = job->err ? job->nranges : job->next++;
+        pthread_mutex_unlock(&job->lock);
+        if (i >= job->nranges) break;
+
+        // Copy the claimed range, recording errno if it fails
+        if (copy_range(job->src, job->dst, job->ranges[i].start, job->ranges[i].end, buf, &newlines, job->nocache)) err = errno;
+    }
+
+    pool_put(buf);
+
+    // Add the newline count and any error to the shared job
+    pthread_mutex_lock(&job->lock);
+    job->newlines += newlines;
+    if (err && !job->err) job->err = err;
+    pthread_mutex_unlock(&job->lock);
+
+    return NULL;
+}
+
+/*
+ * Function: copy_parallel()
+ * -----------------------------
+ * Copies the provided data regions of the source file to the destination file
+ * using multiple worker threads. The data regions are split into ranges of at
+ * most PAR_RANGE bytes which are handed out to the copy_worker() threads. If 
+ * the source has no holes, the destination is preallocated with fallocate() 
+ * so that the concurrent writes do not fragment the file.
+ * 
+ * src: file descriptor of the file being copied from
+ * dst: file descriptor of the file being copied to
+ * extents: list of data regions of the source file
+ * nextents: number of data regions in the list
+ * size: length of the source file
+ * threads: number of worker threads to use
+ * newlines: pointer to counter that is incremented by newlines copied
+ * nocache: whether copied chunks are dropped from the page cache
+ * 
+ * returns: 0 if successful, else -1 (with errno set)
+ */
+int copy_parallel(int src, int dst, struct extent *extents, size_t nextents, off_t size, int threads, size_t *newlines, int nocache) {
+    struct copy_job job = { src, dst, NULL, 0, 0, 0, nocache, 0, PTHREAD_MUTEX_INITIALIZER };
+    pthread_t tids[MAX_THREADS];
+    size_t i, cap = 0;
+    off_t pos;
+    int started;
+
+    // Count the ranges needed so that no region is given out in one piece over PAR_RANGE
+    for (i = 0; i < nextents; i++) cap += (extents[i].end - extents[i].start + PAR_RANGE - 1) / PAR_RANGE;
+
+    job.ranges = (struct extent *) malloc((cap ? cap : 1) * sizeof(struct extent));
+    if (!job.ranges) return -1;
+
+    // Split the data regions into ranges
+    for (i = 0; i < nextents; i++) {
+        for (pos = extents[i].start; pos < extents[i].end; pos += PAR_RANGE) {
+            job.ranges[job.nranges].start = pos;
+            job.ranges[job.nranges].end = extents[i].end - pos > PAR_RANGE ? pos + PAR_RANGE : extents[i].end;
+            job.nranges++;
+        }
+    }
+
+    // If source is fully allocated, preallocate the destination (failure is not fatal)
+    if (nextents == 1 && extents[0].start == 0 && extents[0].end == size) fallocate(dst, 0, 0, size);
+
+    // Start the worker threads, using the threads that could be created
+    for (started = 0; started < threads; started++) {
+        if (pthread_create(&tids[started], NULL, copy_worker, &job)) break;
+    }
+
+    // If no threads could be created, copy the ranges in this thread instead
+    if (started == 0) copy_worker(&job);
+
+    // Wait for all of the workers to finish
+    for (i = 0; i < (size_t) started; i++) pthread_join(tids[i], NULL);
+
+    free(job.ranges);
+    pthread_mutex_destroy(&job.lock);
+
+    *newlines += job.newlines;
+    if (job.err) {
+        errno = job.err;
+        return -1;
+    }
+    return 0;
 }
 
 /*
@@ -666,8 +5499,15 @@ void del_file(char *fpath) {
  * exists and is a regular file, the user is asked confirm the overwriting of 
  * the file. If the file is not a regular file, the program quits and if the 
  * file does not exist, the validty of the new filename is checked using 
- * valid_fname(). Copies contents from one file to another character by 
- * character, by opening the source in read mode and destination in read mode. 
+ * valid_fname(). The data regions of the source are found with find_extents()
+ * and only those regions are copied (with copy_range()) to the same offsets of
+ * the destination, leaving the holes unwritten. The number of threads and 
+ * whether the source is read with O_DIRECT are chosen by choose_io(). Files
+ * planned for more than one thread are copied by worker threads (with 
+ * copy_parallel()), which also count the lines in the same pass. The destination is 
+ * then truncated to the length of the source, which recreates any trailing 
+ * hole. Filesystems without hole support report the whole file as data. Lines
+ * are counted from the copied data only, as holes read back as NULL chars.
  * If successful, logs operation to log file with change_log(). 
  * 
  * fpath1: path to file to be copied from (source)
@@ -678,15 +5518,17 @@ void copy_file(char *fpath1, char *fpath2) {
     if (!access(fpath2, F_OK)) {
         // And the dest file is a regular file, user is prompted to confirm overwriting
         if (is_file(fpath2)) {
-            printf("File \'%s\' already exists and will be overwritten.", fpath2);
+            fprintf(opts.json ? stderr : stdout, "File \'%s\' already exists and will be overwritten.", fpath2);
             // If user does not confirm, program quits
             if (!confirm()) {
-                printf("Overwrite aborted.\n");
+                if (opts.json) json_error("copy", fpath2, "Overwrite aborted.");
+                else printf("Overwrite aborted.\n");
                 exit(1);
             }
         // If dest file is not a regular file, error message is printed and program quits
         } else {
-            printf("File path refers to non-regular file and cannot be modified.\n");
+            if (opts.json) json_error("copy", fpath2, "File path refers to non-regular file and cannot be modified.");
+            else printf("File path refers to non-regular file and cannot be modified.\n");
             exit(1);
         }
     // If destination file does not exist, validty of file path is checked
@@ -695,35 +5537,98 @@ void copy_file(char *fpath1, char *fpath2) {
     }
 
     // Attempts to open source file in read mode (with error handling)
-    FILE *fptr1 = fopen(fpath1, "r");
-    if (!fptr1) die("fopen src");
+    int src = open(fpath1, O_RDONLY);
+    if (src == -1) die("open src");
 
-    // Counts the number of lines in the source file for logging purposes
-    size_t lines = count_lines(&fptr1);
-
-    // Resets the file pointer to the start (with error handling)
-    if (fseek(fptr1, 0, SEEK_SET)) {
-        fclose(fptr1);
-        die("fseek");
+    // Retrieves the size of the source file (with error handling)
+    struct stat sb;
+    if (fstat(src, &sb)) {
+        close(src);
+        die("fstat");
     }
 
     // Attemps to open destination file in write mode (with error handling)
-    FILE *fptr2 = fopen(fpath2, "w");
-    if (!fptr2) {
-        fclose(fptr1);
-        die("fopen dst");
+    int dst = open(fpath2, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (dst == -1) {
+        close(src);
+        die("open dst");
+    }
+
+    struct extent *extents;
+    ssize_t nextents;
+    // Find the data regions of the source file (with error handling)
+    if ((nextents = find_extents(src, sb.st_size, &extents)) == -1) {
+        close(src);
+        close(dst);
+        die("malloc");
+    }
+
+    size_t newlines = 0;
+    // Choose how to copy the source, with direct copies bypassing the page cache for both files 
+    // (a failure to enable O_DIRECT leaves that file buffered, and dropped from the cache as it is copied)
+    struct io_plan plan = choose_io(fpath1, src, sb.st_size, LOAD_STREAM);
+    int nocache = plan.nocache;
+    if (nocache) {
+        fcntl(src, F_SETFL, fcntl(src, F_GETFL) | O_DIRECT);
+        fcntl(dst, F_SETFL, fcntl(dst, F_GETFL) | O_DIRECT);
+    }
+
+    progress_start("copy", sb.st_size, 0);
+
+    // Large files are copied by worker threads, when more than one thread is planned
+    if (plan.threads > 1) {
+        if (copy_parallel(src, dst, extents, nextents, sb.st_size, plan.threads, &newlines, nocache)) {
+            close(src);
+            close(dst);
+            die("copy");
+        }
+    // Otherwise each data region is copied in turn by this thread
+    } else {
+        char *buf = pool_get();
+        if (!buf) {
+            close(src);
+            close(dst);
+            die("malloc");
+        }
+
+        ssize_t i;
+        // Copy data regions to the same offsets in the destination (with error handling)
+        for (i = 0; i < nextents; i++) {
+            if (copy_range(src, dst, extents[i].start, extents[i].end, buf, &newlines, nocache)) {
+                close(src);
+                close(dst);
+                die("copy");
+            }
+        }
+
+        pool_put(buf);
+    }
+
+    free(extents);
+    progress_stop();
+
+    // Set destination length to source length, recreating trailing hole (with error handling)
+    if (ftruncate(dst, sb.st_size)) {
+        close(src);
+        close(dst);
+        die("ftruncate");
     }
 
-    // Reads char from source and writes to destination, while end of file not reached
-    char c = getc(fptr1);
-    while (c != EOF) {
-        fputc(c, fptr2);
-        c = getc(fptr1);
+    // Drop pages that straddled the edges of the copied chunks
+    if (nocache) {
+        drop_cache(src, 0, sb.st_size, 0);
+        drop_cache(dst, 0, sb.st_size, 1);
     }
 
     // Closes both source and destination files 
-    fclose(fptr1);
-    fclose(fptr2);
+    close(src);
+    close(dst);
+
+    // Non-empty files have one more line than newline characters
+    size_t lines = sb.st_size > 0 ? newlines + 1 : 0;
+
+    // Updates indexes and metadata of the destination file
+    after_edit(fpath2, lines, NULL);
 
     // Creates log string describing operation and number of lines after operation
     char *msg = (char *) malloc(LOGLEN);
@@ -731,6 +5636,15 @@ void copy_file(char *fpath1, char *fpath2) {
     // Appends log string to log file
     change_log(msg);
     free(msg);
+
+    // Prints the result of the operation as a JSON record
+    if (opts.json) {
+        json_begin("result", "copy", fpath2);
+        printf(",\"source\":");
+        json_str(fpath1, strlen(fpath1));
+        printf(",\"lines\":%lu", lines);
+        json_end(1);
+    }
 }
 
 /*
@@ -739,7 +5653,8 @@ void copy_file(char *fpath1, char *fpath2) {
  * Displays the contents of the specified file with line numbers along the left
  * side. Prints line numbers in an alligned formatted way. Reads characters one 
  * at a time and prints them to the screen, until the end of file is reached. If
- * a newline is reached, the line number is printed. 
+ * a newline is reached, the line number is printed. With --json, the file is
+ * read a line at a time instead and each line is printed as a record. 
  * 
  * fpath: path to file to be displayed to the command line
  */
@@ -748,8 +5663,8 @@ void show_file(char *fpath) {
     FILE *fptr = fopen(fpath, "r");
     if (!fptr) die("fopen");
 
-    // Counts the number of lines in the file 
-    size_t lines = count_lines(&fptr);
+    // Counts the number of lines in the file (or uses cached count)
+    size_t lines = file_lines(fpath);
     // Finds the number of digits needs to display the line numbers
     int digits = 1;
     while (lines > 9) {
@@ -763,6 +5678,22 @@ void show_file(char *fpath) {
         die("fseek");
     }
 
+    // With --json, each line is read whole and printed as a record
+    if (opts.json) {
+        char *line = NULL;
+        size_t cap = 0;
+        ssize_t len;
+        uint64_t offset = 0;
+        for (lines = 1; (len = getline(&line, &cap, fptr)) != -1; lines++) {
+            json_line("line", "show", fpath, lines, offset, line, len - (line[len - 1] == '\n'));
+            json_end(0);
+            offset += len;
+        }
+        free(line);
+        fclose(fptr);
+        return;
+    }
+
     char c; 
     lines = 1;
     printf("%0*lu |", digits, lines);
@@ -792,9 +5723,11 @@ void show_file(char *fpath) {
  * Write the provided string to a newline at the end of the provided file. The 
  * file is opened is append mode to write the string to the end of the file. If
  * the file is not empty, a newline character is added to ensure the string is 
- * written on a newline. The file is then reopened in read mode to count the 
- * number of lines for logging purposes. If successful, logs operation to log 
- * file with change_log(). 
+ * written on a newline. The number of lines after the append is found from the
+ * cached metadata of the file (with meta_load()) and the newlines written, or
+ * if there is no valid metadata, the file is reopened in read mode to count 
+ * the lines for logging purposes. If successful, logs operation to log file 
+ * with change_log(). 
  * 
  * fpath: path to file to which the line is appended to
  * line: string which is to be written to end of file
@@ -804,23 +5737,45 @@ void append_line(char *fpath, char *line) {
     FILE *fptr = fopen(fpath, "a");
     if (!fptr) die("fopen");
 
+    // Loads cached metadata (number of lines before append) if it is valid
+    struct file_meta meta;
+    int cached = !meta_load(fpath, &meta);
+    size_t newlines = count_newlines(line, strlen(line));
+
+    // Records the appended line in the delta of the word index (an empty line appended to an empty file adds no line)
+    struct wdelta wd;
+    delta_begin(fpath, &wd);
+    if (wd.hdr.lines || *line) delta_splice(&wd, wd.hdr.lines + 1, 0, line, strlen(line));
+
     // If the file is empty, the line is written to the end of the file
     if (is_empty(fpath)) fprintf(fptr, "%s", line);
     // Else the line is written with a newline character 
-    else fprintf(fptr, "\n%s", line);
+    else {
+        fprintf(fptr, "\n%s", line);
+        newlines++;
+    }
 
     // File is closed
     fclose(fptr);
 
-    // Attempts to open file in read mode (with error handling)
-    fptr = fopen(fpath, "r");
-    if (!fptr) die("fopen");
+    size_t lines;
+    // If line count was cached, add the newlines written (non-empty files have one more line than newlines)
+    if (cached) {
+        struct stat sb;
+        if (stat(fpath, &sb)) die("stat");
+        lines = sb.st_size > 0 ? (meta.lines > 0 ? meta.lines - 1 : 0) + newlines + 1 : 0;
+    // Otherwise, number of lines in file after append is counted for logging purposes
+    } else {
+        // Attempts to open file in read mode (with error handling)
+        fptr = fopen(fpath, "r");
+        if (!fptr) die("fopen");
+        lines = count_lines(&fptr);
+        // File is closed 
+        fclose(fptr);
+    }
 
-    // Number of lines in file after append is counted for logging purposes
-    size_t lines = count_lines(&fptr);
-    
-    // File is closed 
-    fclose(fptr);
+    // Updates indexes and metadata of the file
+    after_edit(fpath, lines, &wd);
 
     // Creates log string describing operation and number of lines after operation
     char *msg = (char *) malloc(LOGLEN);
@@ -828,117 +5783,442 @@ void append_line(char *fpath, char *line) {
     // Appends log string to log file
     change_log(msg);
     free(msg);
+
+    // Prints the result of the operation as a JSON record
+    if (opts.json) json_result("append", fpath, lines);
 }
 
 /*
- * Function: show_line()
+ * Struct for a line requested from show_lines(): its line number and its 
+ * position in the list of requested lines (the order it is printed in).
+ */
+struct line_req {
+    size_t lineno;
+    size_t order;
+};
+
+/*
+ * Function: cmp_req()
+ * -----------------------------
+ * Comparison function for qsort() ordering line requests by line number.
+ * 
+ * a: pointer to first line_req
+ * b: pointer to second line_req
+ * 
+ * returns: negative, zero or positive as a is before, equal to or after b
+ */
+int cmp_req(const void *a, const void *b) {
+    size_t x = ((const struct line_req *) a)->lineno;
+    size_t y = ((const struct line_req *) b)->lineno;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Function: show_lines()
+ * -----------------------------
+ * Displays the lines specified by the provided line numbers in the specified 
+ * file, in the order they were requested. Ensures that every line number is 
+ * within the range of the number of lines in the file. The requests are 
+ * sorted by line number and the file (loaded with load_file()) is stepped 
+ * through once with memchr(), recording where each requested line starts and
+ * ends. If the file has a valid line index, the pass jumps to the block 
+ * containing each requested line instead of stepping through the lines 
+ * before it. The recorded lines are then printed in the requested order 
+ * (without carriage returns, as before).
+ * 
+ * fpath: path to file from which lines are being displayed
+ * linenos: list of line numbers of lines to be displayed
+ * n: number of line numbers in the list
+ */
+void show_lines(char *fpath, size_t *linenos, size_t n) {
+    size_t lines = file_lines(fpath);
+    size_t i;
+
+    // If any provided lineno is greater than total lines in file (or zero)
+    for (i = 0; i < n; i++) {
+        if (linenos[i] == 0 || linenos[i] > lines) {
+            // Error message is printed and program quits
+            if (opts.json) json_error("show_lines", fpath, "Invalid Input: Line number out of range for file.");
+            else printf("Invalid Input: Line number out of range for file.\n");
+            exit(1);
+        }
+    }
+
+    // Sort the requests by line number, remembering the order they were requested in
+    struct line_req *reqs = (struct line_req *) malloc(n * sizeof(struct line_req));
+    struct extent *spans = (struct extent *) malloc(n * sizeof(struct extent));
+    if (!reqs || !spans) die("malloc");
+    for (i = 0; i < n; i++) {
+        reqs[i].lineno = linenos[i];
+        reqs[i].order = i;
+    }
+    qsort(reqs, n, sizeof(struct line_req), cmp_req);
+
+    struct fbuf fb;
+    struct lidx idx;
+    int indexed = !load_index(fpath, &idx);
+    // Only the requested lines are read when the index can be used to jump to them
+    load_file(fpath, &fb, indexed);
+
+    const char *pos = fb.data;
+    const char *end = fb.data + fb.len;
+    const char *next;
+    size_t line = 1;
+
+    // Find the requested lines in a single forward pass
+    for (i = 0; i < n; i++) {
+        size_t target = reqs[i].lineno;
+
+        // Jump to the last index block starting at or before the line, if that is ahead
+        if (indexed) {
+            size_t lo = 0, hi = idx.hdr->nblocks;
+            while (hi - lo > 1) {
+                size_t mid = (lo + hi) / 2;
+                if (idx.blocks[mid].line <= target) lo = mid;
+                else hi = mid;
+            }
+            if (hi > 0 && idx.blocks[lo].line <= target && idx.blocks[lo].line > line) {
+                pos = fb.data + idx.blocks[lo].offset;
+                line = idx.blocks[lo].line;
+            }
+        }
+
+        // Step through lines until the requested line is reached
+        while (line < target && pos < end) {
+            next = memchr(pos, '\n', end - pos);
+            pos = next ? next + 1 : end;
+            line++;
+        }
+
+        // Record where the line starts and ends
+        next = pos < end ? memchr(pos, '\n', end - pos) : NULL;
+        spans[reqs[i].order].start = pos - fb.data;
+        spans[reqs[i].order].end = (next ? next : end) - fb.data;
+    }
+
+    // Print lines in the requested order, without carriage returns
+    for (i = 0; i < n; i++) {
+        const char *c;
+        // With --json, each line is printed as a record (without trailing carriage return)
+        if (opts.json) {
+            size_t len = spans[i].end - spans[i].start;
+            if (len > 0 && fb.data[spans[i].end - 1] == '\r') len--;
+            json_line("line", "show_lines", fpath, linenos[i], spans[i].start, fb.data + spans[i].start, len);
+            json_end(0);
+            continue;
+        }
+        for (c = fb.data + spans[i].start; c < fb.data + spans[i].end; c++) {
+            if (*c != '\r') putchar(*c);
+        }
+        printf("\n");
+    }
+
+    if (indexed) free_index(&idx);
+    unload_file(&fb);
+    free(reqs);
+    free(spans);
+}
+
+/*
+ * Function: read_linenos()
+ * -----------------------------
+ * Reads the line numbers given to -lsh, either as arguments or from a file 
+ * named by an argument starting with '@' (line numbers separated by 
+ * whitespace). Each line number is validated with parse_num(). The list is 
+ * allocated by the function (must be freed outside of function in appropriate
+ * place).
+ * 
+ * args: arguments holding line numbers or @file
+ * nargs: number of arguments
+ * n: pointer set to the number of line numbers in the list
+ * 
+ * returns: pointer to list of line numbers
+ */
+size_t *read_linenos(char **args, int nargs, size_t *n) {
+    size_t cap = nargs;
+    size_t *list = (size_t *) malloc(cap * sizeof(size_t));
+    char token[32];
+    int a;
+
+    if (!list) die("malloc");
+    *n = 0;
+
+    for (a = 0; a < nargs; a++) {
+        // Plain arguments are line numbers
+        if (args[a][0] != '@') {
+            list[(*n)++] = parse_num(args[a], 20);
+            continue;
+        }
+
+        // Arguments starting with '@' name a file of line numbers (with error handling)
+        parse_string(args[a] + 1, MAXF, 1, a + 3);
+        FILE *fptr = fopen(args[a] + 1, "r");
+        if (!fptr) die("fopen");
+        while (fscanf(fptr, "%31s", token) == 1) {
+            // Grow the list when full (with error handling)
+            if (*n == cap) {
+                size_t *tmp = (size_t *) realloc(list, (cap *= 2) * sizeof(size_t));
+                if (!tmp) die("realloc");
+                list = tmp;
+            }
+            list[(*n)++] = parse_num(token, 20);
+        }
+        fclose(fptr);
+    }
+
+    // At least one line number must be given
+    if (*n == 0) {
+        fprintf(stderr, "Invalid Line number Input: No line numbers given\n");
+        exit(1);
+    }
+
+    return list;
+}
+
+/*
+ * Function: del_line()
  * -----------------------------
- * Displays the line specified by the provided line number in the specified file.
+ * Deletes the line specified by the provided line number in the specified file. 
  * Ensures that the line number is within the range of the number of lines in
- * the file. Proceeds to read characters one-by-one, until the required line is 
- * reached, after which the chars are printed to the screen, until the next line
- * or end of file is reached 
+ * the file. Opens a temporary file to write to and proceeds to read chars from 
+ * the original file one-by-one, writing them to the temp file, as long as the 
+ * line number was not the provided line number. This is done until the end of 
+ * the file, after which the original file is removed and the temporary file is 
+ * renamed to replace the original file. The change is recorded in the delta of
+ * the word index (with delta_splice()), so the index is kept. If successful, 
+ * logs operation to log file with change_log(). 
  * 
- * fpath: path to file from which line is being displayed
- * lineno: position of line to be displayed in file
+ * fpath: path to file from which line will be deleted
+ * lineno: position of line to delete in file
+ * resume: checkpoint to continue from (NULL to start from the beginning)
  */
-void show_line(char *fpath, size_t lineno) {
+void del_line(char *fpath, size_t lineno, struct checkpoint *resume) {
     // Attempts to open file in read mode (with error handling)
     FILE *fptr = fopen(fpath, "r");
     if (!fptr) die("fopen");
 
-    // If provided lineno is greater than total lines in file
-    if (lineno > count_lines(&fptr)) {
+    size_t lines;
+    // Obtains number of lines in file and If provided lineno is greater,
+    if (lineno > (lines = file_lines(fpath))) {
         // Error message is printed and program quits
-        printf("Invalid Input: Line number out of range for file.\n");
+        if (opts.json) json_error("delete_line", fpath, "Invalid Input: Line number out of range for file.");
+        else printf("Invalid Input: Line number out of range for file.\n");
         fclose(fptr);
         exit(1);
     }
 
-    // Resets file pointer to start of file (with error handling)
-    if (fseek(fptr, 0, SEEK_SET)) {
+    // Moves file pointer to start of file, or to the checkpoint being resumed (with error handling)
+    if (fseeko(fptr, resume ? resume->src_off : 0, SEEK_SET)) {
         fclose(fptr);
         die("fseek");
     }
 
-    char c;
-    size_t lines = 1;
-    // Reads characters from file, one by one, until required line is reached
-    while (lines != lineno) {
-        c = fgetc(fptr);
-        // If newline char read, lines counter is increased
-        if (c == '\n') lines ++;
+    // Records the deletion in the delta of the word index (lines before a resumed checkpoint are unknown)
+    struct wdelta wd;
+    delta_begin(resume ? NULL : fpath, &wd);
+    // Deleting a line after the first also drops the newline ending the line before it, joining the
+    // lines around it, so those lines are kept to record the joined line
+    int collect = wd.live && lineno > 1;
+    int after = 0;
+    char *joined = NULL;
+    size_t jlen = 0, jcap = 0;
+
+    struct checkpoint ck;
+    // Prepare checkpoints, or continue from the checkpoint being resumed
+    if (resume) ck = *resume;
+    else ckpt_init(&ck, CKPT_DEL_LINE, fpath, NULL, NULL, lineno);
+
+    // Attempts to open temp file in write mode (with error handling)
+    FILE *temp = ckpt_temp(resume);
+    if (!temp) {
+        fclose(fptr);
+        die("fopen temp");
     }
-    
-    // Reads chars from file and prints them to screen until end of file or line is reached
+
+    size_t count = resume ? resume->count : 1;
+    size_t newlines = resume ? resume->newlines : 0;
+    size_t done = 0;
+    size_t saved = 0;
+    int c = 0;
+    progress_start("delete line", file_size(fptr), 0);
+    progress_add(resume ? resume->src_off : 0, 0);
+    // While End-Of-File is not reached, 
     do {
-        c = fgetc(fptr);
-        // Prints non-special characters
-        if (c != '\n' && c != '\r' && c != EOF) printf("%c", c);
-    } while (c != '\n' && c != EOF);
+        // Read char from original file and increment line count if newline
+        c = getc(fptr);
+        if (c == '\n') count++;
+        if (count == lineno + 1) after = 1;
+        // Keep the chars of the lines joined around the deleted line
+        if (collect && c != EOF && c != '\n' && (count == lineno - 1 || count == lineno + 1)) {
+            if (jlen == jcap) buf_reserve(&joined, &jcap, jcap ? jcap * 2 : 256);
+            joined[jlen++] = c;
+        }
+        // If line count is not specified lineno (and EOF not reached), write char to temp file
+        if (count != lineno && c != EOF){
+            if (count != lineno + 1 || c != '\n') {
+                fputc(c, temp);
+                // Count newlines written to find number of lines after operation
+                if (c == '\n') newlines++;
+            }
+        }
 
-    printf("\n");
+        // Report progress in CHUNK batches, and save a checkpoint every CKPT_BYTES
+        if (++done == CHUNK) {
+            progress_add(done, 0);
+            done = 0;
+            if ((saved += CHUNK) >= CKPT_BYTES && c != EOF) {
+                ckpt_save(&ck, temp, ftello(fptr), count, count, newlines);
+                saved = 0;
+            }
+        }
+    } while (c != EOF);
+    progress_add(done, 0);
+    progress_stop();
 
-    // Closes the file
+    // Non-empty files have one more line than newline characters
+    lines = ftello(temp) > 0 ? newlines + 1 : 0;
+
+    // The first line is removed alone, later lines replace the line before them (and the line after
+    // them, if any) with the joined line (nothing is deleted for line 0)
+    if (lineno == 1) delta_splice(&wd, 1, 1, NULL, 0);
+    else if (lineno > 1) delta_splice(&wd, lineno - 1, after ? 3 : 2, joined ? joined : "", jlen);
+    free(joined);
+
+    // Close both original and temp files
     fclose(fptr);
+    fclose(temp);
+
+    // Attempts to delete original file (with error handling)
+    if (remove(fpath)) {
+        fprintf(stderr, "Error removing original file. Warning there will be temp files remaining.\n");
+        die("remove");
+    }
+
+    // Attempts to rename temp file to replace original file (with error handling)
+    if (rename(TEMPF, fpath)) {
+        fprintf(stderr, "Error renaming temp file. Warning temp file will be remaining.\n");
+        die("rename");
+    }
+
+    // Operation is complete, so it no longer needs to be resumed
+    remove(CKPTF);
+
+    // Updates indexes and metadata of the file
+    after_edit(fpath, lines, &wd);
+
+    // Creates log string describing operation and number of lines after operation
+    char *msg = (char *) malloc(LOGLEN);
+    snprintf(msg, LOGLEN, "File \'%s\': Line %lu deleted | Lines After = %lu", fpath, lineno, lines);
+    // Appends log string to log file
+    change_log(msg);
+    free(msg);
+
+    // Prints the result of the operation as a JSON record
+    if (opts.json) json_result("delete_line", fpath, lines);
 }
 
 /*
- * Function: del_line()
+ * Function: ins_line()
  * -----------------------------
- * Deletes the line specified by the provided line number in the specified file. 
+ * Inserts the line specified at the provided line number in the specified file.
  * Ensures that the line number is within the range of the number of lines in
- * the file. Opens a temporary file to write to and proceeds to read chars from 
- * the original file one-by-one, writing them to the temp file, as long as the 
- * line number was not the provided line number. This is done until the end of 
- * the file, after which the original file is removed and the temporary file is 
- * renamed to replace the original file. If successful, logs operation to log 
- * file with change_log(). 
+ * the file. Opens a temporary file to write to and proceeds to read chars from
+ * the original file one-by-one, writing them to the temp file. When the 
+ * provided line number is reached, the specified string is written to the file, 
+ * after which characters are read from the original and written to the temp 
+ * file until the end of file is reached. The original file is then removed and
+ * the temporary file is renamed to replace the original file. If successful, 
+ * logs operation to log file with change_log(). 
  * 
- * fpath: path to file from which line will be deleted
- * lineno: position of line to delete in file
+ * fpath: path to file to which line will be inserted
+ * line: string to be inserted to file 
+ * lineno: position at which line will be inserted in file
+ * resume: checkpoint to continue from (NULL to start from the beginning)
  */
-void del_line(char *fpath, size_t lineno) {
+void ins_line(char *fpath, char *line, size_t lineno, struct checkpoint *resume) {
     // Attempts to open file in read mode (with error handling)
     FILE *fptr = fopen(fpath, "r");
     if (!fptr) die("fopen");
 
+
     size_t lines;
     // Obtains number of lines in file and If provided lineno is greater,
-    if (lineno > (lines = count_lines(&fptr))) {
+    if (lineno > (lines = file_lines(fpath))) {
         // Error message is printed and program quits
-        printf("Invalid Input: Line number out of range for file.\n");
+        if (opts.json) json_error("insert_line", fpath, "Invalid Input: Line number out of range for file.");
+        else printf("Invalid Input: Line number out of range for file.\n");
         fclose(fptr);
         exit(1);
     }
 
-    // Resets file pointer to start of file (with error handling)
-    if (fseek(fptr, 0, SEEK_SET)) {
+    // Moves file pointer to start of file, or to the checkpoint being resumed (with error handling)
+    if (fseeko(fptr, resume ? resume->src_off : 0, SEEK_SET)) {
         fclose(fptr);
         die("fseek");
     }
+    
+    // Records the inserted line in the delta of the word index (lines before a resumed checkpoint are unknown)
+    struct wdelta wd;
+    delta_begin(resume ? NULL : fpath, &wd);
+    if (lineno > 0) delta_splice(&wd, lineno, 0, line, strlen(line));
+
+    struct checkpoint ck;
+    // Prepare checkpoints, or continue from the checkpoint being resumed
+    if (resume) ck = *resume;
+    else ckpt_init(&ck, CKPT_INS_LINE, fpath, line, NULL, lineno);
 
     // Attempts to open temp file in write mode (with error handling)
-    FILE *temp = fopen(TEMPF, "w");
+    FILE *temp = ckpt_temp(resume);
     if (!temp) {
         fclose(fptr);
         die("fopen temp");
     }
 
-    size_t count = 1;
-    char c;
-    // While End-Of-File is not reached, 
+    size_t count = resume ? resume->count : 1;
+    size_t newlines = resume ? resume->newlines : 0;
+    size_t done = 0;
+    size_t saved = 0;
+    int c = 0;
+    progress_start("insert line", file_size(fptr), 0);
+    progress_add(resume ? resume->src_off : 0, 0);
+
+    // While End-Of-File is not reached
     do {
-        // Read char from original file and increment line count if newline
-        c = getc(fptr);
-        if (c == '\n') count++;
-        // If line count is not specified lineno (and EOF not reached), write char to temp file
-        if (count != lineno && c != EOF){
-            if (count != lineno + 1 || c != '\n') fputc(c, temp);
+        // If line count is not the specified lineno
+        if (count != lineno) {
+            // Read char from original file and write to temp (if not end of file)
+            c = getc(fptr);
+            if (c != EOF) fputc(c, temp);
+            // Increment line counter (and newlines written) if newline char
+            if (c == '\n') {
+                count++;
+                newlines++;
+            }
+        }
+        // If specified line reached, write specified string to temp file, and continue
+        if (count == lineno) {
+            fprintf(temp, "%s\n", line);
+            newlines += count_newlines(line, strlen(line)) + 1;
+            count++;
+        }
+
+        // Report progress in CHUNK batches, and save a checkpoint every CKPT_BYTES
+        if (++done == CHUNK) {
+            progress_add(done, 0);
+            done = 0;
+            if ((saved += CHUNK) >= CKPT_BYTES && c != EOF) {
+                ckpt_save(&ck, temp, ftello(fptr), count, count, newlines);
+                saved = 0;
+            }
         }
     } while (c != EOF);
+    progress_add(done, 0);
+    progress_stop();
 
-    // Close both original and temp files
+    // Non-empty files have one more line than newline characters
+    lines = ftello(temp) > 0 ? newlines + 1 : 0;
+
+    // Close both the original and temp file 
     fclose(fptr);
     fclose(temp);
 
@@ -954,32 +6234,43 @@ void del_line(char *fpath, size_t lineno) {
         die("rename");
     }
 
+    // Operation is complete, so it no longer needs to be resumed
+    remove(CKPTF);
+
+    // Updates indexes and metadata of the file
+    after_edit(fpath, lines, &wd);
+
     // Creates log string describing operation and number of lines after operation
     char *msg = (char *) malloc(LOGLEN);
-    snprintf(msg, LOGLEN, "File \'%s\': Line %lu deleted | Lines After = %lu", fpath, lineno, lines - 1);
+    snprintf(msg, LOGLEN, "File \'%s\': Line \"%s\" inserted at Line %lu | Lines After = %lu", fpath, line, lineno, lines);
     // Appends log string to log file
     change_log(msg);
     free(msg);
+
+    // Prints the result of the operation as a JSON record
+    if (opts.json) json_result("insert_line", fpath, lines);
 }
 
 /*
- * Function: ins_line()
+ * Function: rep_line()
  * -----------------------------
- * Inserts the line specified at the provided line number in the specified file.
+ * Replaces the line specified at te provided line number in the specified file. 
  * Ensures that the line number is within the range of the number of lines in
  * the file. Opens a temporary file to write to and proceeds to read chars from
  * the original file one-by-one, writing them to the temp file. When the 
  * provided line number is reached, the specified string is written to the file, 
- * after which characters are read from the original and written to the temp 
- * file until the end of file is reached. The original file is then removed and
- * the temporary file is renamed to replace the original file. If successful, 
- * logs operation to log file with change_log(). 
+ * and the original file pointer is moved to the end of that line, after which 
+ * characters are read from the original and written to the temp file until the
+ * end of file is reached. The original file is then removed and the temporary 
+ * file is renamed to replace the original file. If successful, logs operation 
+ * to log file with change_log(). 
  * 
- * fpath: path to file to which line will be inserted
- * line: string to be inserted to file 
- * lineno: position at which line will be inserted in file
+ * fpath: path to file in which line will be replaced
+ * line: string to replace existing line in file
+ * lineno: position of the line to be replaced in file
+ * resume: checkpoint to continue from (NULL to start from the beginning)
  */
-void ins_line(char *fpath, char *line, size_t lineno) {
+void rep_line(char *fpath, char *line, size_t lineno, struct checkpoint *resume) {
     // Attempts to open file in read mode (with error handling)
     FILE *fptr = fopen(fpath, "r");
     if (!fptr) die("fopen");
@@ -987,194 +6278,832 @@ void ins_line(char *fpath, char *line, size_t lineno) {
 
     size_t lines;
     // Obtains number of lines in file and If provided lineno is greater,
-    if (lineno > (lines = count_lines(&fptr))) {
+    if (lineno > (lines = file_lines(fpath))) {
         // Error message is printed and program quits
-        printf("Invalid Input: Line number out of range for file.\n");
+        if (opts.json) json_error("replace_line", fpath, "Invalid Input: Line number out of range for file.");
+        else printf("Invalid Input: Line number out of range for file.\n");
         fclose(fptr);
         exit(1);
     }
 
-    // Resets file pointer to start of file (with error handling)
-    if (fseek(fptr, 0, SEEK_SET)) {
+    // Moves file pointer to start of file, or to the checkpoint being resumed (with error handling)
+    if (fseeko(fptr, resume ? resume->src_off : 0, SEEK_SET)) {
         fclose(fptr);
         die("fseek");
     }
-    
+
+    // Records the replaced line in the delta of the word index (lines before a resumed checkpoint are unknown)
+    struct wdelta wd;
+    delta_begin(resume ? NULL : fpath, &wd);
+    if (lineno > 0) delta_splice(&wd, lineno, 1, line, strlen(line));
+
+    struct checkpoint ck;
+    // Prepare checkpoints, or continue from the checkpoint being resumed
+    if (resume) ck = *resume;
+    else ckpt_init(&ck, CKPT_REP_LINE, fpath, line, NULL, lineno);
+
     // Attempts to open temp file in write mode (with error handling)
-    FILE *temp = fopen(TEMPF, "w");
+    FILE *temp = ckpt_temp(resume);
     if (!temp) {
         fclose(fptr);
         die("fopen temp");
     }
 
-    size_t count = 1;
-    char c;
+    size_t count = resume ? resume->count : 1;
+    size_t newlines = resume ? resume->newlines : 0;
+    size_t done = 0;
+    size_t saved = 0;
+    int c = 0;
+    progress_start("replace line", file_size(fptr), 0);
+    progress_add(resume ? resume->src_off : 0, 0);
+
+    // While End-Of-File is not reached
+    do {
+        // If line count is not the specified lineno
+        if (count != lineno) {
+            // Read char from original file and write to temp (if not end of file)
+            c = getc(fptr);
+            if (c != EOF) fputc(c, temp);
+            // Increment line counter (and newlines written) if newline char
+            if (c == '\n') {
+                count++;
+                newlines++;
+            }
+        }
+        if (count == lineno) {
+            // Move file pointer to end of line in original file
+            do {
+                c = getc(fptr);
+            } while (c != '\n' && c != EOF);
+            //  Write specified string to tmp file
+            fputs(line, temp);
+            newlines += count_newlines(line, strlen(line));
+            if (c == '\n') {
+                fputc(c, temp);
+                newlines++;
+            }
+            count++;
+        }
+
+        // Report progress in CHUNK batches, and save a checkpoint every CKPT_BYTES
+        if (++done == CHUNK) {
+            progress_add(done, 0);
+            done = 0;
+            if ((saved += CHUNK) >= CKPT_BYTES && c != EOF) {
+                ckpt_save(&ck, temp, ftello(fptr), count, count, newlines);
+                saved = 0;
+            }
+        }
+    } while (c != EOF);
+    progress_add(done, 0);
+    progress_stop();
+
+    // Non-empty files have one more line than newline characters
+    lines = ftello(temp) > 0 ? newlines + 1 : 0;
+
+    // Close both the original and temp file 
+    fclose(fptr);
+    fclose(temp);
+
+    // Attempts to delete original file (with error handling)
+    if (remove(fpath)) {
+        fprintf(stderr, "Error removing original file. Warning there will be temp files remaining.\n");
+        die("remove");
+    }
+
+    // Attempts to rename temp file to replace original file (with error handling)
+    if (rename(TEMPF, fpath)) {
+        fprintf(stderr, "Error renaming temp file. Warning temp file will be remaining.\n");
+        die("rename");
+    }
+
+    // Operation is complete, so it no longer needs to be resumed
+    remove(CKPTF);
+
+    // Updates indexes and metadata of the file
+    after_edit(fpath, lines, &wd);
+
+    // Creates log string describing operation and number of lines after operation
+    char *msg = (char *) malloc(LOGLEN);
+    snprintf(msg, LOGLEN, "File \'%s\': Line %lu was replaced by \"%s\" | Lines After = %lu", fpath, lineno, line, lines);
+    // Appends log string to log file
+    change_log(msg);
+    free(msg);
+
+    // Prints the result of the operation as a JSON record
+    if (opts.json) json_result("replace_line", fpath, lines);
+}
+
+/* --- OTHER OPERATIONS --- */
+
+/*
+ * Function: search_ranges()
+ * -----------------------------
+ * Finds the ranges of lines of a file that need to be read to search for a 
+ * string, and loads the file with load_file(). If the file has a valid line 
+ * index (with load_index()), the index narrows the ranges to the blocks that 
+ * may contain the string (using index_candidates()) and the file is loaded 
+ * sparsely, so only those blocks are read. Otherwise the whole file is a 
+ * single range. The number of lines is taken from the index or the cached 
+ * metadata of the file when possible, else the lines of the loaded file are 
+ * counted with count_buffer() (except for existence checks with --quiet, 
+ * which would otherwise read the whole file before stopping at the first 
+ * match). The count is not cached, as searches must not modify the file or
+ * its attributes (only edits store metadata, with after_edit()). Searches step through the loaded file with explicit lengths, so the
+ * file may have lines of any length and contain any bytes (including NULL
+ * chars). The list of ranges is allocated by the function (must be freed 
+ * outside of function in appropriate place).
+ * 
+ * fpath: path to file being searched
+ * fb: struct filled in with the contents of the file (with load_file())
+ * key: string that must be contained by matching lines (NULL if none known)
+ * ranges: pointer set to the allocated list of ranges to be searched
+ * lines: pointer set to the total number of lines in the file
+ * 
+ * returns: number of ranges in the list
+ */
+size_t search_ranges(char *fpath, struct fbuf *fb, char *key, struct lidx_range **ranges, ssize_t *lines) {
+    struct lidx idx;
+    ssize_t count = -1;
+    int narrowed = 0;
+
+    // If file has a valid index, it gives the number of lines
+    if (!load_index(fpath, &idx)) {
+        *lines = idx.hdr->lines;
+        // Narrow search to the candidate blocks of the key
+        if (key) narrowed = (count = index_candidates(&idx, key, strlen(key), ranges)) != -1;
+        // If index cannot narrow search, whole file is searched
+        if (count == -1) {
+            *ranges = (struct lidx_range *) malloc(sizeof(struct lidx_range));
+            if (!*ranges) die("malloc");
+            (*ranges)[0].start = 0;
+            (*ranges)[0].end = idx.hdr->size;
+            (*ranges)[0].line = 1;
+            count = 1;
+        }
+        free_index(&idx);
+        load_file(fpath, fb, narrowed);
+        return count;
+    }
+
+    struct io_plan plan = load_file(fpath, fb, 0);
+
+    struct file_meta meta;
+    // Existence checks (--quiet) print no lines and stop at the first match, so lines are not counted
+    if (opts.quiet) {
+        *lines = 0;
+    // If cached metadata is valid, use cached number of lines
+    } else if (!meta_load(fpath, &meta)) {
+        *lines = meta.lines;
+    } else {
+        // Count lines of the loaded file (non-empty files have one more line than newline chars)
+        *lines = fb->len > 0 ? count_buffer(fb->data, fb->len, plan.threads, NULL) + 1 : 0;
+    }
+
+    // Whole file is searched as one range
+    *ranges = (struct lidx_range *) malloc(sizeof(struct lidx_range));
+    if (!*ranges) die("malloc");
+    (*ranges)[0].start = 0;
+    (*ranges)[0].end = UINT64_MAX;
+    (*ranges)[0].line = 1;
+    return 1;
+}
+
+/*
+ * Function: range_bytes()
+ * -----------------------------
+ * Finds the number of bytes of a loaded file covered by a list of ranges from
+ * search_ranges() (used as the total for progress reporting).
+ * 
+ * fb: struct filled in by load_file()
+ * ranges: list of ranges
+ * nranges: number of ranges in the list
+ * 
+ * returns: number of bytes in the ranges
+ */
+uint64_t range_bytes(struct fbuf *fb, struct lidx_range *ranges, size_t nranges) {
+    uint64_t total = 0;
+    size_t r;
+
+    for (r = 0; r < nranges; r++) total += (ranges[r].end < fb->len ? ranges[r].end : fb->len) - ranges[r].start;
+    return total;
+}
+
+/*
+ * Struct for printing context lines around matches (-A, -B and -C options).
+ * The spans of the last opts.before lines are kept in a ring buffer pointing 
+ * into the loaded file (no lines are copied), so they can be printed once a 
+ * match is found after them.
+ * starts, lens, linenos - ring buffer of the spans and line numbers of lines
+ * head - index of the oldest line in the ring buffer
+ * filled - number of lines in the ring buffer
+ * after - number of lines of after context still to be printed
+ * last - line number of the last line printed (0 if none yet)
+ * digits - number of digits used to display line numbers
+ * fpath, base - file searched and start of the loaded file (for --json)
+ * key, klen, reg - string or compiled regex searched for (for --json spans)
+ */
+struct context {
+    const char **starts;
+    size_t *lens;
+    size_t *linenos;
+    int head;
+    int filled;
+    int after;
+    size_t last;
+    int digits;
+    const char *fpath;
+    const char *base;
+    const char *key;
+    size_t klen;
+    regex_t *reg;
+};
+
+/*
+ * Function: ctx_init()
+ * -----------------------------
+ * Prepares the context state of a search, allocating the ring buffer for the
+ * before context (with error handling).
+ * 
+ * cx: context state being prepared
+ * digits: number of digits used to display line numbers
+ * fpath: path to the file searched
+ * base: start of the loaded file
+ * key: string searched for (NULL for regex searches)
+ * reg: compiled regex searched for (NULL for string searches)
+ */
+void ctx_init(struct context *cx, int digits, const char *fpath, const char *base, const char *key, regex_t *reg) {
+    int n = opts.before > 0 ? opts.before : 1;
+
+    cx->starts = (const char **) malloc(n * sizeof(const char *));
+    cx->lens = (size_t *) malloc(n * sizeof(size_t));
+    cx->linenos = (size_t *) malloc(n * sizeof(size_t));
+    if (!cx->starts || !cx->lens || !cx->linenos) die("malloc");
+    cx->head = cx->filled = cx->after = 0;
+    cx->last = 0;
+    cx->digits = digits;
+    cx->fpath = fpath;
+    cx->base = base;
+    cx->key = key;
+    cx->klen = key ? strlen(key) : 0;
+    cx->reg = reg;
+}
+
+/*
+ * Function: ctx_print()
+ * -----------------------------
+ * Prints a line of a context window: matching lines with '|' after the line 
+ * number and context lines with '-'. Windows that do not continue the last 
+ * window printed are separated from it by a "--" line. With --json, lines are
+ * printed as "match" and "context" records instead.
+ * 
+ * cx: context state of the search
+ * line: pointer to the start of the line
+ * len: length of the line (without newline chars)
+ * lineno: line number of the line
+ * match: whether the line is a match
+ */
+void ctx_print(struct context *cx, const char *line, size_t len, size_t lineno, int match) {
+    // With --json, lines are records and matches list their spans (no separators are needed)
+    if (opts.json) {
+        json_line(match ? "match" : "context", cx->reg ? "regex_search" : "search", cx->fpath, lineno, line - cx->base, line, len);
+        // Matches of strings also give their number of instances, as in search()
+        if (match) {
+            int n = json_spans(line, len, cx->key, cx->klen, cx->reg);
+            if (!cx->reg) printf(",\"count\":%d", n);
+        }
+        json_end(0);
+        cx->last = lineno;
+        return;
+    }
+    if (cx->last && lineno > cx->last + 1) printf("--\n");
+    printf("%0*lu %c", cx->digits, lineno, match ? '|' : '-');
+    fwrite(line, 1, len, stdout);
+    printf("\n");
+    cx->last = lineno;
+}
+
+/*
+ * Function: ctx_line()
+ * -----------------------------
+ * Handles a line of a search with context. A match flushes the before context
+ * held in the ring buffer, is printed, and starts opts.after lines of after 
+ * context. Other lines are printed while after context remains, and are 
+ * otherwise added to the ring buffer (replacing the oldest line). Overlapping
+ * windows are merged, as each line is printed at most once.
+ * 
+ * cx: context state of the search
+ * line: pointer to the start of the line
+ * len: length of the line (without newline chars)
+ * lineno: line number of the line
+ * match: whether the line is a match
+ */
+void ctx_line(struct context *cx, const char *line, size_t len, size_t lineno, int match) {
+    if (match) {
+        // Print the before context, oldest first
+        for (; cx->filled > 0; cx->filled--) {
+            ctx_print(cx, cx->starts[cx->head], cx->lens[cx->head], cx->linenos[cx->head], 0);
+            cx->head = (cx->head + 1) % opts.before;
+        }
+        ctx_print(cx, line, len, lineno, 1);
+        cx->after = opts.after;
+    } else if (cx->after > 0) {
+        ctx_print(cx, line, len, lineno, 0);
+        cx->after--;
+    } else if (opts.before > 0) {
+        // Add line to the ring buffer, replacing the oldest line when full
+        int slot = (cx->head + cx->filled) % opts.before;
+        if (cx->filled == opts.before) cx->head = (cx->head + 1) % opts.before;
+        else cx->filled++;
+        cx->starts[slot] = line;
+        cx->lens[slot] = len;
+        cx->linenos[slot] = lineno;
+    }
+}
+
+/*
+ * Function: ctx_free()
+ * -----------------------------
+ * Frees the ring buffer of the context state of a search.
+ * 
+ * cx: context state of the search
+ */
+void ctx_free(struct context *cx) {
+    free(cx->starts);
+    free(cx->lens);
+    free(cx->linenos);
+}
+
+/*
+ * Function: search()
+ * -----------------------------
+ * Searches for specified string in file. If the file has a suffix array index,
+ * the search is answered by sa_search(). Otherwise, finds the ranges of the
+ * file to be read with search_ranges() (which loads the file and finds its
+ * number of lines). Finds the number of digits to use to display the line
+ * numbers aligned on the left. Proceeds to step through the lines of each
+ * range of the loaded file with memchr() and checks for instances of the
+ * search key in each line with memmem(). Lines are handled by their lengths,
+ * so any bytes (including NULL chars) can be searched. If found, the number of
+ * instances, the line number and the line itself are printed. With context
+ * options (-A, -B, -C), every line of the file is read and each line is passed
+ * to ctx_line() instead, which prints matches with the lines around them. Once
+ * all lines are read, the total number of occurences of the search key in the
+ * file is printed. When only counting (--count), lines are not split and
+ * memmem() steps through each range as a whole. Searches with --first stop
+ * after that many matching lines, and existence checks (--quiet) exit at the
+ * first match with status 0 (or 1 if there is none), so they only read the
+ * file up to the first match. With --json, matching lines and the total are
+ * printed as JSON records (with the spans of the matches). Searches ignoring
+ * case (-i) or for whole words (-w) find instances with find_key() instead of
+ * memmem(), and are not answered by the suffix array.
+ * 
+ * fpath: path to file in which to search for string
+ * key: string to search for in file
+ */
+void search(char *fpath, char *key) {
+    int context = (opts.before || opts.after) && !opts.count && !opts.quiet;
+    // If file has a valid suffix array index, search is answered from the index (unless context is needed)
+    if (!context && sa_search(fpath, key)) return;
+    icase_key(key);
+
+    struct fbuf fb;
+    ssize_t lines;
+    struct lidx_range *ranges;
+    // Find the ranges of the file to search and the number of lines in the file (all lines if context is needed)
+    // (trigrams only fold ASCII letters, so they cannot narrow searches ignoring the case of other chars)
+    size_t nranges = search_ranges(fpath, &fb, context || opts.icase == ICASE_UTF8 ? NULL : key, &ranges, &lines);
+
+    // Finds the number of digits needs to display the line numbers
+    int digits = 1;
+    while (lines > 9) {
+        lines /= 10;
+        digits ++;
+    }
+
+    size_t klen = strlen(key);
+    const char *line, *end, *next, *buffer;
+    int count = 0;
+    int counted = 0;
+    size_t linelen, mlen;
+    int subcount;
+    size_t r;
+    size_t scanned = 0;
+    size_t matched = 0;
+    // Instances cannot span lines unless the key contains line breaks, so counts need no line splitting
+    int raw = opts.count && !strpbrk(key, "\r\n");
+    struct context cx;
+    if (context) ctx_init(&cx, digits, fpath, fb.data, key, NULL);
+    progress_start("search", range_bytes(&fb, ranges, nranges), 1);
+
+    // For each range of the file (until the first opts.first matching lines have been printed)
+    for (r = 0; r < nranges && !(opts.first && matched >= opts.first && !(context && cx.after)); r++) {
+        line = fb.data + ranges[r].start;
+        end = fb.data + (ranges[r].end < fb.len ? ranges[r].end : fb.len);
+        lines = ranges[r].line - 1;
+
+        // If only counting, count instances of search key in whole range
+        if (raw) {
+            for (buffer = line; (buffer = find_key(fb.data, buffer, end - buffer, key, klen, &mlen)) != NULL; count++) {
+                buffer += mlen;
+                // Report progress in CHUNK batches
+                if (buffer - line >= CHUNK) {
+                    progress_add(buffer - line, count + 1 - counted);
+                    counted = count + 1;
+                    line = buffer;
+                }
+            }
+            scanned += end - line;
+            continue;
+        }
+
+        // Steps through lines until the end of the range
+        for (; line < end && !(opts.first && matched >= opts.first && !(context && cx.after)); line = next) {
+            // Increment line counter
+            lines++;
+
+            // Find end of line and remove trailing newline chars
+            next = memchr(line, '\n', end - line);
+            next = next ? next + 1 : end;
+            linelen = next - line;
+            while (linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r')) linelen--;
+
+            buffer = line;
+            subcount = 0;
+            // Count number of instances of search key in line (lines after the first opts.first matches are only context)
+            while((!opts.first || matched < opts.first) && (buffer = find_key(fb.data, buffer, line + linelen - buffer, key, klen, &mlen)) != NULL) {
+                buffer += mlen;
+                subcount++;
+            }
+
+            // Existence checks stop at the first match
+            if (opts.quiet && subcount) {
+                progress_stop();
+                unload_file(&fb);
+                exit(0);
+            }
+
+            // Increment count by number of occurrences
+            count += subcount;
+            if (subcount) matched++;
+
+            // If context is needed, line is printed as a match or context (or kept for later)
+            if (context) {
+                ctx_line(&cx, line, linelen, lines, subcount != 0);
+            // If instance of search key found in line, print line with number of instances (unless only counting)
+            } else if (subcount != 0 && !opts.count){
+                if (opts.json) {
+                    json_line("match", "search", fpath, lines, line - fb.data, line, linelen);
+                    printf(",\"count\":%d", subcount);
+                    json_spans(line, linelen, key, klen, NULL);
+                    json_end(0);
+                } else {
+                    // Line is written with its length, as it may contain NULL chars
+                    printf("%d instance/s:\n%0*lu |", subcount, digits, lines);
+                    fwrite(line, 1, linelen, stdout);
+                    printf("\n\n");
+                }
+            }
+
+            // Report progress in CHUNK batches
+            if ((scanned += next - line) >= CHUNK) {
+                progress_add(scanned, count - counted);
+                counted = count;
+                scanned = 0;
+            }
+        }
+    }
+    progress_add(scanned, count - counted);
+    progress_stop();
+
+    if (context) {
+        ctx_free(&cx);
+        if (!opts.json) printf("\n");
+    }
+    free(ranges);
+
+    // Release the file
+    unload_file(&fb);
+
+    // Existence checks that reach the end of the file found no match
+    if (opts.quiet) exit(1);
+
+    // Print total instances of search key in file
+    if (opts.json) json_summary("search", fpath, count, raw ? -1 : (long) matched);
+    else printf("%d instance/s found in the file.\n", count);
+}
+
+/*
+ * Function: regex_search()
+ * -----------------------------
+ * Searches for specified regex pattern in file. Finds the longest literal
+ * string required by the pattern with regex_literal() and finds the ranges of
+ * the file that may contain it with search_ranges() (which loads the file and
+ * finds its number of lines). Finds the number of digits to use to display the
+ * line numbers aligned on the left. Compiles the regex string to a pattern and
+ * handles any errors during this process. Proceeds to run the regex pattern on
+ * each line of each range in place with regex_match(), so lines may be of any
+ * length and contain any bytes. If a match is found in the line, the line is
+ * printed with the line number in a well-formatted way (or with the lines
+ * around it by ctx_line(), if context options are given, in which case every
+ * line of the file is read). Once all lines are read, the total number of
+ * matches made in the file is printed. As with search(), --count only prints
+ * the total, --first stops after that many matching lines and --quiet exits at
+ * the first match. With --json, records are printed as in search().
+ * 
+ * fpath: path to file in which to search for regex matches
+ * key: regex expression as string
+ */
+void regex_search(char *fpath, char *key) {
+    struct fbuf fb;
+    ssize_t lines;
+    struct lidx_range *ranges;
+    char literal[MAXF + 1];
+    int context = (opts.before || opts.after) && !opts.count && !opts.quiet;
+    // Find the ranges of the file that may contain the literal part of the pattern (all lines if context is needed)
+    size_t nranges = search_ranges(fpath, &fb, !context && regex_literal(key, literal) ? literal : NULL, &ranges, &lines);
+
+    // Finds the number of digits needs to display the line numbers
+    int digits = 1;
+    while (lines > 9) {
+        lines /= 10;
+        digits ++;
+    }
+
+    char buffer[MAX];
+
+    regex_t reg;
+    regmatch_t m;
+    int temp;
+    // Attempts to compiles regex expression provided
+    // (match positions are only needed for the spans of JSON records)
+    if (temp = regcomp(&reg, key, REG_EXTENDED | REG_ICASE | (opts.json ? 0 : REG_NOSUB))) {
+        // If error, error message printed and program quits
+        regerror(temp, &reg, buffer, sizeof(buffer));
+        fprintf(stderr,"grep: %s (%s)\n", buffer, key);
+        unload_file(&fb);
+        exit(1);
+    }
+
+    int count = 0;
+    int counted = 0;
+    size_t linelen;
+    const char *line, *end, *next;
+    size_t r;
+    size_t scanned = 0;
+    struct context cx;
+    if (context) ctx_init(&cx, digits, fpath, fb.data, NULL, &reg);
+    progress_start("regex search", range_bytes(&fb, ranges, nranges), 1);
+
+    // For each range of the file (until the first opts.first matching lines have been printed)
+    for (r = 0; r < nranges && !(opts.first && (size_t) count >= opts.first && !(context && cx.after)); r++) {
+        line = fb.data + ranges[r].start;
+        end = fb.data + (ranges[r].end < fb.len ? ranges[r].end : fb.len);
+        lines = ranges[r].line - 1;
+
+        // Steps through lines until the end of the range
+        for (; line < end && !(opts.first && (size_t) count >= opts.first && !(context && cx.after)); line = next) {
+            // Increment line counter
+            lines++;
+
+            // Find end of line and remove trailing newline chars
+            next = memchr(line, '\n', end - line);
+            next = next ? next + 1 : end;
+            linelen = next - line;
+            while (linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r')) linelen--;
+
+            // Runs the compiled regex pattern on the LINE in place to check for matches (lines after the first opts.first matches are only context)
+            temp = opts.first && (size_t) count >= opts.first ? REG_NOMATCH : regex_match(&reg, line, 0, linelen, &m, 0);
+            if (temp == 0) count++;
 
-    // While End-Of-File is not reached
-    do {
-        // If line count is not the specified lineno
-        if (count != lineno) {
-            // Read char from original file and write to temp (if not end of file)
-            c = getc(fptr);
-            if (c != EOF) fputc(c, temp);
-            // Increment line counter if newline char
-            if (c == '\n') count++;
-        }
-        // If specified line reached, write specified string to temp file, and continue
-        if (count == lineno) {
-            fprintf(temp, "%s\n", line);
-            count++;
-        }
-    } while (c != EOF);
+            // Existence checks stop at the first match
+            if (opts.quiet && temp == 0) {
+                progress_stop();
+                unload_file(&fb);
+                exit(0);
+            }
 
-    // Close both the original and temp file 
-    fclose(fptr);
-    fclose(temp);
+            // If context is needed, line is printed as a match or context (or kept for later)
+            if (context) {
+                ctx_line(&cx, line, linelen, lines, temp == 0);
+            // If matches found, print line (unless only counting)
+            } else if (temp == 0 && !opts.count) {
+                if (opts.json) {
+                    json_line("match", "regex_search", fpath, lines, line - fb.data, line, linelen);
+                    json_spans(line, linelen, NULL, 0, &reg);
+                    json_end(0);
+                } else {
+                    // Line is written with its length, as it may contain NULL chars
+                    printf("%0*lu |", digits, lines);
+                    fwrite(line, 1, linelen, stdout);
+                    printf("\n\n");
+                }
+            }
 
-    // Attempts to delete original file (with error handling)
-    if (remove(fpath)) {
-        fprintf(stderr, "Error removing original file. Warning there will be temp files remaining.\n");
-        die("remove");
+            // Report progress in CHUNK batches
+            if ((scanned += next - line) >= CHUNK) {
+                progress_add(scanned, count - counted);
+                counted = count;
+                scanned = 0;
+            }
+        }
     }
+    progress_add(scanned, count - counted);
+    progress_stop();
 
-    // Attempts to rename temp file to replace original file (with error handling)
-    if (rename(TEMPF, fpath)) {
-        fprintf(stderr, "Error renaming temp file. Warning temp file will be remaining.\n");
-        die("rename");
+    if (context) {
+        ctx_free(&cx);
+        if (!opts.json) printf("\n");
     }
+    free(ranges);
+    regfree(&reg);
+    // Release file
+    unload_file(&fb);
 
-    // Creates log string describing operation and number of lines after operation
-    char *msg = (char *) malloc(LOGLEN);
-    snprintf(msg, LOGLEN, "File \'%s\': Line \"%s\" inserted at Line %lu | Lines After = %lu", fpath, line, lineno, lines + 1);
-    // Appends log string to log file
-    change_log(msg);
-    free(msg);
+    // Existence checks that reach the end of the file found no match
+    if (opts.quiet) exit(1);
+
+    // Print total matches to regex pattern found in the file
+    if (opts.json) json_summary("regex_search", fpath, count, count);
+    else printf("%d line matches found in the file.\n", count);
 }
 
 /*
- * Function: rep_line()
+ * Struct holding the state of the bit-parallel approximate matcher used by
+ * fuzzy_search(), which is Myers' algorithm in the blocked form of Hyyrö. 
+ * The key is split into blocks of 64 chars, with one word per block in each
+ * bit vector, so keys of up to 64 chars take a single word.
+ * peq - for each char, the bits of the positions in the key holding the char
+ * pv, mv - vertical deltas of the current column (bits of +1 and -1 deltas)
+ * blocks - number of blocks in the key
+ * last - bit of the last char of the key in the last block
+ * score - edit distance of the best match of the key ending at the current char
+ */
+struct fuzzy {
+    uint64_t *peq;
+    uint64_t *pv;
+    uint64_t *mv;
+    int blocks;
+    uint64_t last;
+    size_t score;
+};
+
+/*
+ * Function: fuzzy_init()
  * -----------------------------
- * Replaces the line specified at te provided line number in the specified file. 
- * Ensures that the line number is within the range of the number of lines in
- * the file. Opens a temporary file to write to and proceeds to read chars from
- * the original file one-by-one, writing them to the temp file. When the 
- * provided line number is reached, the specified string is written to the file, 
- * and the original file pointer is moved to the end of that line, after which 
- * characters are read from the original and written to the temp file until the
- * end of file is reached. The original file is then removed and the temporary 
- * file is renamed to replace the original file. If successful, logs operation 
- * to log file with change_log(). 
+ * Prepares the approximate matcher for a key, building the bit vector of the
+ * positions of each char in the key (ASCII letters set the bits of both cases
+ * when ignoring case with -i). Allocates the bit vectors with error handling.
  * 
- * fpath: path to file in which line will be replaced
- * line: string to replace existing line in file
- * lineno: position of the line to be replaced in file
+ * fz: matcher being prepared
+ * key: string being searched for
+ * klen: length of the string (at least 1)
  */
-void rep_line(char *fpath, char *line, size_t lineno) {
-    // Attempts to open file in read mode (with error handling)
-    FILE *fptr = fopen(fpath, "r");
-    if (!fptr) die("fopen");
-
-
-    size_t lines;
-    // Obtains number of lines in file and If provided lineno is greater,
-    if (lineno > (lines = count_lines(&fptr))) {
-        // Error message is printed and program quits
-        printf("Invalid Input: Line number out of range for file.\n");
-        fclose(fptr);
-        exit(1);
+void fuzzy_init(struct fuzzy *fz, const char *key, size_t klen) {
+    size_t i;
+    unsigned char c;
+
+    fz->blocks = (klen + 63) / 64;
+    fz->last = 1ull << ((klen - 1) % 64);
+    fz->peq = (uint64_t *) calloc(256 * fz->blocks, sizeof(uint64_t));
+    fz->pv = (uint64_t *) malloc(fz->blocks * sizeof(uint64_t));
+    fz->mv = (uint64_t *) malloc(fz->blocks * sizeof(uint64_t));
+    if (!fz->peq || !fz->pv || !fz->mv) die("malloc");
+
+    for (i = 0; i < klen; i++) {
+        c = key[i];
+        fz->peq[c * fz->blocks + i / 64] |= 1ull << (i % 64);
+        // Ignoring case, the other case of a letter matches too
+        if (opts.icase && isalpha(c)) fz->peq[(c ^ 0x20) * fz->blocks + i / 64] |= 1ull << (i % 64);
     }
+}
 
-    // Resets file pointer to start of file (with error handling)
-    if (fseek(fptr, 0, SEEK_SET)) {
-        fclose(fptr);
-        die("fseek");
+/*
+ * Function: fuzzy_line()
+ * -----------------------------
+ * Finds the smallest edit distance (insertions, deletions and substitutions) 
+ * between the key and any part of a line. The matcher steps through the line
+ * one char at a time, advancing every block of its bit vectors with the 
+ * horizontal delta carried out of the block below, and the score of the last
+ * char of the key gives the distance of the best match ending at each char. 
+ * As the score falls by at most one per char, the rest of the line is skipped
+ * once it cannot bring the score down to a better match within the limit 
+ * (lines too short to match are not read at all), and a line stops at the 
+ * first exact match. Keys of a single block take a loop without the carries
+ * between blocks.
+ * 
+ * fz: matcher prepared with fuzzy_init()
+ * line: pointer to the start of the line
+ * len: length of the line
+ * klen: length of the key
+ * k: maximum edit distance of matches
+ * end: set to the end offset of the first best match in the line
+ * 
+ * returns: smallest edit distance, or k + 1 if there is no match within k
+ */
+size_t fuzzy_line(struct fuzzy *fz, const char *line, size_t len, size_t klen, size_t k, size_t *end) {
+    uint64_t eq, pv, mv, xv, xh, ph, mh, top;
+    size_t i, best = k + 1;
+    int b, hin, hout;
+    const uint64_t *peq;
+
+    // Each column starts at the distances of a match before the line (the row number)
+    for (b = 0; b < fz->blocks; b++) {
+        fz->pv[b] = ~0ull;
+        fz->mv[b] = 0;
     }
-
-    // Attempts to open temp file in write mode (with error handling)
-    FILE *temp = fopen(TEMPF, "w");
-    if (!temp) {
-        fclose(fptr);
-        die("fopen temp");
+    fz->score = klen;
+
+    // Keys of up to 64 chars keep their single word of each bit vector in registers
+    if (fz->blocks == 1) {
+        pv = ~0ull;
+        mv = 0;
+        for (i = 0; i < len && fz->score < best + (len - i); i++) {
+            eq = fz->peq[(unsigned char) line[i]];
+            xv = eq | mv;
+            xh = (((eq & pv) + pv) ^ pv) | eq;
+            ph = mv | ~(xh | pv);
+            mh = pv & xh;
+            if (ph & fz->last) fz->score++;
+            else if (mh & fz->last) fz->score--;
+            ph <<= 1;
+            mh <<= 1;
+            pv = mh | ~(xv | ph);
+            mv = ph & xv;
+
+            // Keep the first best match in the line
+            if (fz->score < best) {
+                best = fz->score;
+                *end = i + 1;
+                if (best == 0) break;
+            }
+        }
+        return best;
     }
 
-    size_t count = 1;
-    char c;
-
-    // While End-Of-File is not reached
-    do {
-        // If line count is not the specified lineno
-        if (count != lineno) {
-            // Read char from original file and write to temp (if not end of file)
-            c = getc(fptr);
-            fputc(c, temp);
-            // Increment line counter if newline char
-            if (c == '\n') count++;
-        }
-        if (count == lineno) {
-            // Move file pointer to end of line in original file
-            do {
-                c = getc(fptr);
-            } while (c != '\n' && c != EOF);
-            //  Write specified string to tmp file
-            fputs(line, temp);
-            if (c == '\n') fputc(c, temp);
-            count++;
+    for (i = 0; i < len && fz->score < best + (len - i); i++) {
+        peq = fz->peq + (unsigned char) line[i] * fz->blocks;
+        // Matches may start anywhere, so no delta is carried into the first block
+        hin = 0;
+        for (b = 0; b < fz->blocks; b++) {
+            eq = peq[b];
+            pv = fz->pv[b];
+            mv = fz->mv[b];
+            xv = eq | mv;
+            if (hin < 0) eq |= 1;
+            xh = (((eq & pv) + pv) ^ pv) | eq;
+            ph = mv | ~(xh | pv);
+            mh = pv & xh;
+
+            // Horizontal delta of the top row of the block is carried into the next block
+            top = b == fz->blocks - 1 ? fz->last : 1ull << 63;
+            hout = (ph & top) ? 1 : (mh & top) ? -1 : 0;
+            ph <<= 1;
+            mh <<= 1;
+            if (hin < 0) mh |= 1;
+            else if (hin > 0) ph |= 1;
+
+            fz->pv[b] = mh | ~(xv | ph);
+            fz->mv[b] = ph & xv;
+            hin = hout;
         }
-    } while (c != EOF);
-
-    // Close both the original and temp file 
-    fclose(fptr);
-    fclose(temp);
-
-    // Attempts to delete original file (with error handling)
-    if (remove(fpath)) {
-        fprintf(stderr, "Error removing original file. Warning there will be temp files remaining.\n");
-        die("remove");
-    }
+        fz->score += hin;
 
-    // Attempts to rename temp file to replace original file (with error handling)
-    if (rename(TEMPF, fpath)) {
-        fprintf(stderr, "Error renaming temp file. Warning temp file will be remaining.\n");
-        die("rename");
+        // Keep the first best match in the line
+        if (fz->score < best) {
+            best = fz->score;
+            *end = i + 1;
+            if (best == 0) break;
+        }
     }
 
-    // Creates log string describing operation and number of lines after operation
-    char *msg = (char *) malloc(LOGLEN);
-    snprintf(msg, LOGLEN, "File \'%s\': Line %lu was replaced by \"%s\" | Lines After = %lu", fpath, lineno, line, lines);
-    // Appends log string to log file
-    change_log(msg);
-    free(msg);
+    return best;
 }
 
-/* --- OTHER OPERATIONS --- */
-
 /*
- * Function: search()
+ * Function: fuzzy_search()
  * -----------------------------
- * Searches for specified string in file. Verifies that the file is safe for 
- * reading with fgets(). Finds the number of digits to use to display the line
- * numbers aligned on the left. Proceeds to read lines from the file and checks 
- * for instances of the search key in each line. If found, the number of 
- * instances, the line number and the line itself are printed. Once all lines 
- * are read and the end of file is reached, the total number of occurences of 
- * the search key in the file is printed. 
+ * Searches for lines of a file containing approximate matches of a string: 
+ * parts of the line within k edits (insertions, deletions or substitutions of
+ * a char) of the string. Loads the file and finds its number of lines with 
+ * search_ranges() (every line is read, as the index only holds exact 
+ * trigrams). Each line is checked with fuzzy_line(), and lines with a match 
+ * are printed with the edit distance of their best match. Once all lines are 
+ * read, the number of matching lines is printed. As with search(), --count 
+ * only prints the total, --first stops after that many matching lines, --quiet
+ * exits at the first match and --json prints records (with the distance and 
+ * end offset of the best match); context options are not used.
  * 
  * fpath: path to file in which to search for string
  * key: string to search for in file
+ * k: maximum number of edits (less than the length of the string)
  */
-void search(char *fpath, char *key) {
-    // Attempts to open file in read mode (with error handling)
-    FILE *fptr = fopen(fpath, "r");
-    if (!fptr) die("fopen");
-
-
+void fuzzy_search(char *fpath, char *key, size_t k) {
+    struct fbuf fb;
     ssize_t lines;
-    // Obtain number of logs in log file and check if log file is safe for fgets()
-    if ((lines = verify_lines(&fptr, MAX - 2)) == -1) {
-        // If not safe for fgets, user prompted and program quits
-        fclose(fptr);
-        exit(1);
-    }
+    struct lidx_range *ranges;
+    // Find the number of lines in the file (whole file is searched)
+    size_t nranges = search_ranges(fpath, &fb, NULL, &ranges, &lines);
 
     // Finds the number of digits needs to display the line numbers
     int digits = 1;
@@ -1183,216 +7112,632 @@ void search(char *fpath, char *key) {
         digits ++;
     }
 
-    // Resets the file pointer to the start of the file (with error handling)
-    if (fseek(fptr, 0, SEEK_SET)) {
-        fclose(fptr);
-        die("fseek");
-    }
+    size_t klen = strlen(key);
+    struct fuzzy fz;
+    fuzzy_init(&fz, key, klen);
 
-    char *line = (char *) malloc(MAX);
-    char const *buffer;
     int count = 0;
-    int linelen;
-    int subcount;
-    lines = 0;
+    int counted = 0;
+    size_t linelen, dist, mend = 0;
+    const char *line, *end, *next;
+    size_t r;
+    size_t scanned = 0;
+    progress_start("fuzzy search", range_bytes(&fb, ranges, nranges), 1);
+
+    // For each range of the file (until the first opts.first matching lines have been printed)
+    for (r = 0; r < nranges && !(opts.first && (size_t) count >= opts.first); r++) {
+        line = fb.data + ranges[r].start;
+        end = fb.data + (ranges[r].end < fb.len ? ranges[r].end : fb.len);
+        lines = ranges[r].line - 1;
+
+        // Steps through lines until the end of the range
+        for (; line < end && !(opts.first && (size_t) count >= opts.first); line = next) {
+            // Increment line counter
+            lines++;
 
-    // Reads line from the file until the End-Of-File
-    while (fgets(line, MAX - 1, fptr) != NULL) {
-        // Increment line counter
-        lines++;
+            // Find end of line and remove trailing newline chars
+            next = memchr(line, '\n', end - line);
+            next = next ? next + 1 : end;
+            linelen = next - line;
+            while (linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r')) linelen--;
 
-        // Remove trailing newline char
-        linelen = strlen(line);
-        while (linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r')) linelen--;
-        if (linelen != MAX) line[linelen] = '\0';
+            // Find the best approximate match in the line
+            dist = fuzzy_line(&fz, line, linelen, klen, k, &mend);
+            if (dist <= k) {
+                count++;
 
-        buffer = line;
-        subcount = 0;
-        // Count number of instances of search key in line
-        while((buffer = strstr(buffer, key)) != NULL) {
-            buffer += strlen(key);
-            subcount++;
-        }
+                // Existence checks stop at the first match
+                if (opts.quiet) {
+                    progress_stop();
+                    unload_file(&fb);
+                    exit(0);
+                }
 
-        // Increment count by number of occurrences
-        count += subcount;
+                // Print line with the distance of its best match (unless only counting)
+                if (opts.json && !opts.count) {
+                    json_line("match", "fuzzy", fpath, lines, line - fb.data, line, linelen);
+                    printf(",\"distance\":%lu,\"end\":%lu", dist, mend);
+                    json_end(0);
+                } else if (!opts.count) {
+                    // Line is written with its length, as it may contain NULL chars
+                    printf("distance %lu:\n%0*lu |", dist, digits, lines);
+                    fwrite(line, 1, linelen, stdout);
+                    printf("\n\n");
+                }
+            }
 
-        // If instance of search key found in line, print line with number of instances
-        if (subcount != 0){
-            printf("%d instance/s:\n%0*lu |%s\n\n", subcount, digits, lines, line);
+            // Report progress in CHUNK batches
+            if ((scanned += next - line) >= CHUNK) {
+                progress_add(scanned, count - counted);
+                counted = count;
+                scanned = 0;
+            }
         }
     }
+    progress_add(scanned, count - counted);
+    progress_stop();
+
+    free(fz.peq);
+    free(fz.pv);
+    free(fz.mv);
+    free(ranges);
+    // Release file
+    unload_file(&fb);
+
+    // Existence checks that reach the end of the file found no match
+    if (opts.quiet) exit(1);
+
+    // Print total lines with approximate matches found in the file
+    if (opts.json) json_summary("fuzzy", fpath, count, count);
+    else printf("%d line matches found in the file.\n", count);
+}
 
-    free(line);
-
-    // Close the file
-    fclose(fptr);
-
-    // Print total instances of search key in file
-    printf("%d instance/s found in the file.\n", count);
+/*
+ * Function: line_after()
+ * -----------------------------
+ * Finds the start of the first line that starts at or after an offset of a 
+ * loaded file, used to realign the probes of lookup() to lines.
+ *
+ * data: contents of the file
+ * len: length of the file
+ * off: offset in the file
+ *
+ * returns: offset of the start of the line (len if no line starts after off)
+ */
+size_t line_after(const char *data, size_t len, size_t off) {
+    if (off == 0) return 0;
+    const char *nl = memchr(data + off - 1, '\n', len - off + 1);
+    return nl ? (size_t) (nl - data) + 1 : len;
 }
 
 /*
- * Function: regex_search()
+ * Function: cmp_prefix()
  * -----------------------------
- * Searched for specified regex pattern in file. Verifies that the file is safe 
- * for reading with fgets(). Finds the number of digits to use to display the 
- * line numbers aligned on the left. Compiles the regex string to a pattern and 
- * handles any errors during this process. Proceeds to read lines from file and 
- * run the regex pattern on the lines. If a match is found in the line, the 
- * line is printed with the line number in a well-formatted way. Once the end of
- * file is reached, the total number of matches made in the file is printed.
- * 
- * fpath: path to file in which to search for regex matches
- * key: regex expression as string
+ * Compares the start of a line with a prefix, comparing bytes as unsigned 
+ * chars (the order of files sorted with LC_ALL=C sort). Lines shorter than the
+ * prefix sort before it if they match it as far as they go.
+ *
+ * line: line to compare (without its line ending)
+ * len: length of the line
+ * key: prefix to compare with
+ * klen: length of the prefix
+ *
+ * returns: negative if the line sorts before the prefix, 0 if it starts with 
+ *          the prefix, else positive
  */
-void regex_search(char *fpath, char *key) {
-    // Attempts to open file in read mode (with error handling)
-    FILE *fptr = fopen(fpath, "r");
-    if (!fptr) die("fopen");
+int cmp_prefix(const char *line, size_t len, const char *key, size_t klen) {
+    int c = memcmp(line, key, len < klen ? len : klen);
+    if (c) return c;
+    return len < klen ? -1 : 0;
+}
 
-    ssize_t lines;
-    // Obtain number of logs in log file and check if log file is safe for fgets()
-    if ((lines = verify_lines(&fptr, MAX - 2)) == -1) {
-        // If not safe for fgets, user prompted and program quits
-        fclose(fptr);
-        exit(1);
+/*
+ * Function: lookup()
+ * -----------------------------
+ * Prints the lines of a sorted file (sorted by bytes, as with LC_ALL=C sort) 
+ * that start with a prefix, without reading the whole file. The file is loaded
+ * with load_file() as a sparse memory map, and the first line not sorting 
+ * before the prefix is found by binary searching byte offsets of the file, 
+ * realigning each probe to the start of the next line with line_after(). The 
+ * search touches a few pages for each of the log2 of the file size probes, and
+ * matching lines are then read in order from the first one found. Line 
+ * numbers are found from the line index of the file (-index) if it has a 
+ * valid one, by counting the lines from the start of the block of the match;
+ * otherwise lines are printed with their byte offset (marked with '@') 
+ * instead, as counting lines would read the whole file. Matching lines are 
+ * only counted (--count), limited to the first lines (--first), checked for 
+ * existence (--quiet) or printed as JSON records (--json, with line 0 when the
+ * line number is not known). Results for files that are not sorted are not 
+ * meaningful.
+ *
+ * fpath: path to sorted file in which to look up the prefix
+ * key: prefix of the lines to look up
+ */
+void lookup(char *fpath, char *key) {
+    struct fbuf fb;
+    struct lidx idx;
+    size_t klen = strlen(key);
+    int indexed = !load_index(fpath, &idx);
+    load_file(fpath, &fb, 1);
+
+    size_t lo = 0, hi = fb.len, mid, start, end, b, bl, bh;
+    const char *nl;
+
+    // Binary search for the smallest offset whose next line does not sort before the prefix
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        start = line_after(fb.data, fb.len, mid);
+        if (start == fb.len) {
+            hi = mid;
+            continue;
+        }
+        nl = memchr(fb.data + start, '\n', fb.len - start);
+        end = nl ? (size_t) (nl - fb.data) : fb.len;
+        if (end > start && fb.data[end - 1] == '\r') end--;
+        if (cmp_prefix(fb.data + start, end - start, key, klen) < 0) lo = mid + 1;
+        else hi = mid;
     }
+    // Lines before the line starting after lo all sort before the prefix
+    start = line_after(fb.data, fb.len, lo);
 
     // Finds the number of digits needs to display the line numbers
+    uint64_t lines = indexed ? idx.hdr->lines : 0, lineno = 0;
     int digits = 1;
     while (lines > 9) {
         lines /= 10;
         digits ++;
     }
 
-    // Resets the file pointer to the start of the file (with error handling)
-    if (fseek(fptr, 0, SEEK_SET)) {
-        fclose(fptr);
-        die("fseek");
+    size_t matches = 0;
+    // For each line starting with the prefix (up to the first opts.first lines)
+    for (; start < fb.len && (!opts.first || matches < opts.first); start = nl ? (size_t) (nl - fb.data) + 1 : fb.len) {
+        nl = memchr(fb.data + start, '\n', fb.len - start);
+        end = nl ? (size_t) (nl - fb.data) : fb.len;
+        if (end > start && fb.data[end - 1] == '\r') end--;
+        if (cmp_prefix(fb.data + start, end - start, key, klen)) break;
+        matches++;
+
+        // Existence checks stop at the first match
+        if (opts.quiet) {
+            unload_file(&fb);
+            if (indexed) free_index(&idx);
+            exit(0);
+        }
+        if (opts.count) continue;
+
+        // Line number is the line of the last index block starting at or before the line, plus the lines between
+        if (indexed) {
+            bl = 0;
+            bh = idx.hdr->nblocks;
+            while (bh - bl > 1) {
+                b = (bl + bh) / 2;
+                if (idx.blocks[b].offset <= start) bl = b;
+                else bh = b;
+            }
+            lineno = idx.blocks[bl].line + count_newlines(fb.data + idx.blocks[bl].offset, start - idx.blocks[bl].offset);
+        }
+
+        if (opts.json) {
+            json_line("match", "lookup", fpath, lineno, start, fb.data + start, end - start);
+            json_end(0);
+        } else {
+            // Line is written with its length, as it may contain NULL chars
+            if (indexed) printf("%0*lu |", digits, lineno);
+            else printf("@%lu |", start);
+            fwrite(fb.data + start, 1, end - start, stdout);
+            printf("\n\n");
+        }
     }
 
-    char *buffer = (char *) malloc(MAX);
+    unload_file(&fb);
+    if (indexed) free_index(&idx);
+    if (opts.quiet) exit(1);
 
-    regex_t reg;
-    int temp;
-    // Attempts to compiles regex expression provided
-    if (temp = regcomp(&reg, key, REG_EXTENDED | REG_NOSUB | REG_ICASE)) {
-        // If error, error message printed and program quits
-        regerror(temp, &reg, buffer, sizeof(buffer));
-        fprintf(stderr,"grep: %s (%s)\n", buffer, key);
-        fclose(fptr);
+    // Print total lines starting with the prefix
+    if (opts.json) json_summary("lookup", fpath, matches, matches);
+    else printf("%lu line matches found in the file.\n", matches);
+}
+
+/*
+ * Struct holding one of the sorted files read by merge_files(). The file is 
+ * read with read() into a buffer of IO_BUFSIZE bytes (grown only for lines 
+ * longer than the buffer), so memory use does not depend on the size of the
+ * file. The current line (without its line ending) and its key point into the
+ * buffer, and the key of the previous line is copied to check the order of 
+ * the file.
+ * fpath - path to the file
+ * fd - file descriptor of the file
+ * buf, cap - buffer and its size
+ * pos, len - offset of the next line in the buffer, and number of bytes in it
+ * base - offset in the file of the start of the buffer
+ * eof - the end of the file has been read into the buffer
+ * line, llen - current line and its length
+ * key, klen - key of the current line and its length
+ * off - offset in the file of the current line
+ * lineno - line number of the current line
+ * prev, plen, pcap - key of the previous line, its length and buffer size
+ * started - prev holds the key of a previous line
+ */
+struct sorted_file {
+    const char *fpath;
+    int fd;
+    char *buf;
+    size_t cap;
+    size_t pos;
+    size_t len;
+    off_t base;
+    int eof;
+    const char *line;
+    size_t llen;
+    const char *key;
+    size_t klen;
+    off_t off;
+    size_t lineno;
+    char *prev;
+    size_t plen;
+    size_t pcap;
+    int started;
+};
+
+/*
+ * Function: sorted_open()
+ * -----------------------------
+ * Opens a sorted file for merge_files(), advising the kernel that it is read 
+ * sequentially so that it reads ahead. If there is an error, error message is
+ * printed and program quits.
+ *
+ * sf: struct filled in for the file
+ * fpath: path to the file
+ */
+void sorted_open(struct sorted_file *sf, const char *fpath) {
+    memset(sf, 0, sizeof(*sf));
+    sf->fpath = fpath;
+    sf->fd = open(fpath, O_RDONLY);
+    if (sf->fd == -1) die("open");
+    posix_fadvise(sf->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    sf->cap = IO_BUFSIZE;
+    sf->buf = (char *) malloc(sf->cap);
+    if (!sf->buf) die("malloc");
+}
+
+/*
+ * Function: sorted_close()
+ * -----------------------------
+ * Closes a sorted file opened with sorted_open() and frees its buffers.
+ *
+ * sf: file to close
+ */
+void sorted_close(struct sorted_file *sf) {
+    close(sf->fd);
+    free(sf->buf);
+    free(sf->prev);
+}
+
+/*
+ * Function: sorted_next()
+ * -----------------------------
+ * Reads the next line of a sorted file, refilling the buffer from the file as
+ * needed (the rest of a line at the end of the buffer is moved to the start 
+ * first). A line ending after the last line is not a line of its own. The key
+ * of the line is the line itself, or for joins the part of the line before 
+ * the first separator (opts.sep, or a tab). Keys must not sort before the key
+ * of the previous line (compared by bytes, see cmp_term()).
+ *
+ * sf: file to read from
+ * join: whether lines are keyed for a join
+ *
+ * returns: 1 if a line was read, 0 at the end of the file, -1 if the line is 
+ *          out of order
+ */
+int sorted_next(struct sorted_file *sf, int join) {
+    const char *sep = opts.sep ? opts.sep : "\t";
+    const char *nl = NULL;
+    ssize_t n;
+
+    // Keep the key of the current line to check the order of the next line
+    if (sf->line) {
+        buf_reserve(&sf->prev, &sf->pcap, sf->klen);
+        memcpy(sf->prev, sf->key, sf->klen);
+        sf->plen = sf->klen;
+        sf->started = 1;
+    }
+    sf->line = NULL;
+
+    // Find the end of the next line, reading more of the file until it is in the buffer
+    while (!(nl = memchr(sf->buf + sf->pos, '\n', sf->len - sf->pos)) && !sf->eof) {
+        // Move the start of the line to the start of the buffer, growing the buffer if the line fills it
+        memmove(sf->buf, sf->buf + sf->pos, sf->len - sf->pos);
+        sf->base += sf->pos;
+        sf->len -= sf->pos;
+        sf->pos = 0;
+        if (sf->len == sf->cap) {
+            char *grown = (char *) realloc(sf->buf, sf->cap * 2);
+            if (!grown) die("realloc");
+            sf->buf = grown;
+            sf->cap *= 2;
+        }
+        n = pread(sf->fd, sf->buf + sf->len, sf->cap - sf->len, sf->base + sf->len);
+        if (n == -1 && errno == EINTR) continue;
+        if (n == -1) die("read");
+        if (n == 0) sf->eof = 1;
+        throttle(n);
+        progress_add(n, 0);
+        sf->len += n;
+    }
+    if (sf->pos == sf->len) return 0;
+
+    sf->line = sf->buf + sf->pos;
+    sf->llen = (nl ? nl - sf->buf : (ssize_t) sf->len) - sf->pos;
+    sf->off = sf->base + sf->pos;
+    sf->pos += sf->llen + (nl ? 1 : 0);
+    sf->lineno++;
+    if (sf->llen > 0 && sf->line[sf->llen - 1] == '\r') sf->llen--;
+
+    // Key of joins ends at the separator
+    sf->key = sf->line;
+    sf->klen = sf->llen;
+    if (join) {
+        const char *at = memmem(sf->line, sf->llen, sep, strlen(sep));
+        if (at) sf->klen = at - sf->line;
+    }
+
+    return sf->started && cmp_term(sf->key, sf->klen, sf->prev, sf->plen) < 0 ? -1 : 1;
+}
+
+/*
+ * Function: sorted_seek()
+ * -----------------------------
+ * Moves a sorted file back to a line read before, so that it is read again by
+ * the next call to sorted_next(). If the line is still in the buffer, no read
+ * is needed. The order of the lines read again is checked from that line on.
+ *
+ * sf: file to move back
+ * off: offset in the file of the line
+ * lineno: line number of the line
+ */
+void sorted_seek(struct sorted_file *sf, off_t off, size_t lineno) {
+    if (off >= sf->base && off <= sf->base + (off_t) sf->len) {
+        sf->pos = off - sf->base;
+    } else {
+        sf->base = off;
+        sf->pos = sf->len = 0;
+        sf->eof = 0;
+    }
+    sf->lineno = lineno - 1;
+    sf->line = NULL;
+    sf->started = 0;
+}
+
+/*
+ * Function: merge_files()
+ * -----------------------------
+ * Merges a sorted file into another sorted file (-merge), or joins the lines
+ * of two files sorted by key (-join), streaming both files once. Files are 
+ * read a line at a time with sorted_next() and compared by bytes (as sorted 
+ * with LC_ALL=C sort). A merge writes the lines of both files in order (lines
+ * of the first file come first when equal). A join writes, for each pair of 
+ * lines with the same key (the part of the line before the separator, 
+ * opts.sep or a tab), the line of the first file followed by the rest of the 
+ * line of the second file from its separator on. Lines of the second file 
+ * with the key of several lines of the first file are read again for each of
+ * them with sorted_seek(), so memory use stays constant. The result is 
+ * written to the temp file with LF line endings (and no line ending after the
+ * last line), which is renamed to replace the first file. If either file is
+ * not sorted, error message is printed, the temp file is removed and program
+ * quits. If successful, logs operation to the log file with change_log().
+ *
+ * fpath: path to sorted file that is replaced with the result
+ * other: path to sorted file merged or joined into it
+ * join: join lines by key instead of merging them
+ */
+void merge_files(char *fpath, char *other, int join) {
+    const char *op = join ? "join" : "merge";
+    struct sorted_file a, b;
+    struct stat sa, sb;
+
+    // Attempts to open both files and the temp file (with error handling)
+    sorted_open(&a, fpath);
+    sorted_open(&b, other);
+    if (fstat(a.fd, &sa) || fstat(b.fd, &sb)) die("fstat");
+    // Any checkpoint of an interrupted operation refers to the temp file overwritten here
+    remove(CKPTF);
+    FILE *temp = fopen(TEMPF, "w");
+    if (!temp) die("fopen temp");
+    setvbuf(temp, NULL, _IOFBF, IO_BUFSIZE);
+
+    size_t lines = 0, glineno = 0;
+    off_t group = 0;
+    int ra, rb, c;
+    int err = 0;
+    progress_start(op, sa.st_size + sb.st_size, 0);
+
+    ra = sorted_next(&a, join);
+    rb = sorted_next(&b, join);
+    // While both files have lines left (and are in order)
+    while (ra == 1 && rb == 1 && !err) {
+        c = cmp_term(a.key, a.klen, b.key, b.klen);
+        if (!join) {
+            // Write the lower line, and move to the next line of its file
+            struct sorted_file *lo = c <= 0 ? &a : &b;
+            err = (lines && putc('\n', temp) == EOF) || fwrite(lo->line, 1, lo->llen, temp) != lo->llen;
+            lines++;
+            if (lo == &a) ra = sorted_next(&a, join);
+            else rb = sorted_next(&b, join);
+        } else if (c < 0) {
+            ra = sorted_next(&a, join);
+        } else if (c > 0) {
+            rb = sorted_next(&b, join);
+        } else {
+            // Join the line with each line of the second file with its key
+            group = b.off;
+            glineno = b.lineno;
+            while (rb == 1 && !err && !cmp_term(a.key, a.klen, b.key, b.klen)) {
+                err = (lines && putc('\n', temp) == EOF) || fwrite(a.line, 1, a.llen, temp) != a.llen
+                    || fwrite(b.line + b.klen, 1, b.llen - b.klen, temp) != b.llen - b.klen;
+                lines++;
+                rb = sorted_next(&b, join);
+            }
+            // If the next line of the first file has the same key, the lines of the group are read again
+            ra = sorted_next(&a, join);
+            if (ra == 1 && !cmp_term(a.key, a.klen, a.prev, a.plen)) {
+                sorted_seek(&b, group, glineno);
+                rb = sorted_next(&b, join);
+            }
+        }
+    }
+
+    // The rest of the lines of a merge are written as they are (checking their order)
+    while (!join && !err && (ra == 1 || rb == 1)) {
+        struct sorted_file *rest = ra == 1 ? &a : &b;
+        err = (lines && putc('\n', temp) == EOF) || fwrite(rest->line, 1, rest->llen, temp) != rest->llen;
+        lines++;
+        if (rest == &a) ra = sorted_next(&a, join);
+        else rb = sorted_next(&b, join);
+    }
+    progress_stop();
+
+    // If either file is out of order, the result is not used
+    if (ra == -1 || rb == -1) {
+        struct sorted_file *bad = ra == -1 ? &a : &b;
+        if (opts.json) json_error(op, bad->fpath, "File is not sorted.");
+        else fprintf(stderr, "File \'%s\' is not sorted (line %lu is out of order).\n", bad->fpath, bad->lineno);
+        fclose(temp);
+        remove(TEMPF);
         exit(1);
     }
+    sorted_close(&a);
+    sorted_close(&b);
 
-    int count = 0;
-    int linelen;
-    lines = 0;
+    // Attempts to write the rest of the temp file (with error handling)
+    if (fclose(temp) || err) {
+        remove(TEMPF);
+        die("fwrite");
+    }
+
+    // Attempts to delete original file (with error handling)
+    if (remove(fpath)) {
+        fprintf(stderr, "Error removing original file. Warning there will be temp files remaining.\n");
+        die("remove");
+    }
 
-    // Reads lines from file until End-Of-File
-    while (fgets(buffer, MAX - 1, fptr) != NULL) {
-        // Increment line counter
-        lines++;
+    // Attempts to rename temp file to replace original file (with error handling)
+    if (rename(TEMPF, fpath)) {
+        fprintf(stderr, "Error renaming temp file. Warning temp file will be remaining.\n");
+        die("rename");
+    }
 
-        // Removing trailing newline char
-        linelen = strlen(buffer);
-        while (linelen > 0 && (buffer[linelen - 1] == '\n' || buffer[linelen - 1] == '\r')) linelen--;
-        if (linelen != MAX) buffer[linelen] = '\0';
+    // Updates indexes and metadata of the file
+    after_edit(fpath, lines, NULL);
 
-        // Runs the compiled regex pattern on the LINE to check for matches
-        if ((temp = regexec(&reg, buffer, 0, NULL, 0)) == 0) {
-            // If matches found, increment counter and print line
-            count++;
-            printf("%0*lu |%s\n\n", digits, lines, buffer);
-        }
+    // Creates log string describing operation and number of lines after operation
+    char *msg = (char *) malloc(LOGLEN);
+    snprintf(msg, LOGLEN, "File \'%s\': %s with \'%s\' | Lines After = %lu", fpath, join ? "Joined" : "Merged", other, lines);
+    // Appends log string to log file
+    change_log(msg);
+    free(msg);
 
+    // Prints the result of the operation
+    if (opts.json) {
+        json_begin("result", op, fpath);
+        printf(",\"source\":");
+        json_str(other, strlen(other));
+        printf(",\"lines\":%lu", lines);
+        json_end(1);
+    } else {
+        printf("%lu lines written to the file.\n", lines);
     }
-
-    free(buffer);
-    regfree(&reg);
-    // Close file
-    fclose(fptr);
-
-    // Print total matches to regex pattern found in the file
-    printf("%d line matches found in the file.\n", count);
 }
 
 /*
  * Function: string_sub()
  * -----------------------------
  * Substitutes all elements of a specified key substring with another substring 
- * in a provided line string. Allocates enough memory in order to hold 
- * substituted string (with error handling if it fails). Proceeds to build 
- * string, by copying parts from the original string, and replacing any 
- * occurence of the key substring with the replacement substring, and moving 
- * along the original string using pointers. A pointer to the result is then 
- * returned (must be freed outside of function in appropriate place)
- * 
- * line: string in which replacements will be done
- * key: strings whose instances will be replaced
+ * in a provided line. The line, key and substitute are given with their 
+ * lengths, so lines may contain any bytes (including NULL chars). Grows the 
+ * result buffer, which is reused between calls, to hold the substituted line
+ * if needed (with error handling if it fails). Proceeds to build the result,
+ * by copying parts from the original line, and replacing any occurence of the
+ * key substring with the replacement substring, moving along the original 
+ * line with find_key() (so instances are found ignoring case with -i, and 
+ * only as whole words with -w). The result is not NULL terminated.
+ * 
+ * line: line in which replacements will be done
+ * len: length of the line
+ * key: string whose instances will be replaced
+ * klen: length of the key
  * sub: string with which to replace instances of key substring
- * occur: number of replacements to make
+ * slen: length of the substitute
+ * occur: number of instances of the key in the line
+ * buf: pointer to the result buffer (NULL to allocate one)
+ * cap: pointer to the size of the result buffer
  * 
- * returns: pointer to resulting string
+ * returns: length of the resulting line
  */
-char *string_sub(char *line, char *key, char *sub, int occur) {
-    int len_key = strlen(key);
-    if (len_key == 0) return NULL;
-    int len_sub = strlen(sub);
-
-    // Allocate required memory for resulting string (with error handling)
-    char *result = (char *) malloc(strlen(line) + (len_sub - len_key) * occur + 1);
-    if (!result) return NULL;
-    
-    char *pos;
-    char *tmp = result;
-    int offset;
-
-    // Whilst more replacements need to be made
-    while (occur--) {
-        // Find next occurence of key substring in remainder of original line
-        pos = strstr(line, key);
-        offset = pos - line;
-        // Copy substring before instance into to result string
-        tmp = strncpy(tmp, line, offset) + offset;
-        // Copy replacement substring into result string
-        tmp = strcpy(tmp, sub) + len_sub;
+size_t string_sub(const char *line, size_t len, const char *key, size_t klen, const char *sub, size_t slen, int occur, char **buf, size_t *cap) {
+    const char *base = line, *end = line + len;
+    const char *pos;
+    size_t mlen;
+
+    // Grow result buffer to hold the resulting line
+    buf_reserve(buf, cap, len + slen * occur);
+
+    char *tmp = *buf;
+    // Whilst more instances of key substring are found in remainder of original line
+    while ((pos = find_key(base, line, end - line, key, klen, &mlen)) != NULL) {
+        // Copy part before instance and then replacement substring into result
+        memcpy(tmp, line, pos - line);
+        tmp += pos - line;
+        memcpy(tmp, sub, slen);
+        tmp += slen;
         // Move along original line pointer
-        line += offset + len_key; 
+        line = pos + mlen;
     }
-    strcpy(tmp, line);
+    memcpy(tmp, line, end - line);
+    tmp += end - line;
 
-    return result;
+    return tmp - *buf;
 }
 
 /*
  * Function: replace()
  * -----------------------------
- * Replaces are instances of a provided key substring with another provided 
- * substring in a file. Verifies that the file is safe for reading with fgets().
- * Finds the number of digits to use to display the line numbers aligned on the
- * left. Opens a temporary file to write to and reads line from the original 
- * file. If an instance of the key substring is found in the line, the number of
- * instances are counted and then substitutions are made by calling string_sub()
- * and the modified line is written to the temp file and the modification is 
- * also printed. If no modification are made, the line is written as is to the 
- * temp file. Once the end of file is reached, the number of instances replaced 
- * is printed. The original file is then removed and the temporary file is 
- * renamed to replace the original file. If successful, logs operation to the 
- * log file with change_log(). 
- */
-void replace(char *fpath, char *key, char *sub) {
-    // Attempts to open file in read mode (with error handling)
-    FILE *fptr = fopen(fpath, "r");
-    if (!fptr) die("fopen");
-
+ * Replaces all instances of a provided key substring with another provided
+ * substring in a file. Finds the ranges of the file that may contain the key
+ * with search_ranges() (which loads the file and finds its number of lines).
+ * Lines are handled by their lengths (see string_sub()), so the file may
+ * contain any bytes. Finds the number of digits to use to display the line
+ * numbers aligned on the left. Opens a temporary file to write to. The parts
+ * of the file between the ranges cannot contain the key, so they are copied to
+ * the temp file with splice_range() without being read. Lines are stepped
+ * through in the ranges of the loaded file. If an instance of the key
+ * substring is found in the line, the number of instances are counted and then
+ * substitutions are made by calling string_sub() and the modified line is
+ * written to the temp file and the modification is also printed. If no
+ * modification are made, the line is written as is to the temp file. Once the
+ * end of file is reached, the number of instances replaced is printed. When
+ * the plan of the file keeps it out of the page cache (direct I/O), the file
+ * and temp file are dropped from the page cache as they are streamed through
+ * (with drop_streamed()). The original file is then removed and the temporary
+ * file is renamed to replace the original file. If successful, logs operation
+ * to the log file with change_log(). A checkpoint is saved every CKPT_BYTES of
+ * the file (with ckpt_save()), so that an interrupted replace can be resumed
+ * with -resume, which calls the function again with the checkpoint to continue
+ * from. With --json, each modified line and the final result are printed as
+ * JSON records instead. With -i, instances of the key are found ignoring case,
+ * and with -w only instances that are whole words are replaced.
+ * 
+ * fpath: path to file in which to replace strings
+ * key: string whose instances will be replaced
+ * sub: string with which to replace instances of key
+ * resume: checkpoint to continue from (NULL to start from the beginning)
+ */
+void replace(char *fpath, char *key, char *sub, struct checkpoint *resume) {
+    struct fbuf fb;
     ssize_t lines;
-    // Obtain number of logs in log file and check if log file is safe for fgets()
-    if ((lines = verify_lines(&fptr, MAX - 2)) == -1){
-        // If not safe for fgets, user prompted and program quits
-        fclose(fptr);
-        exit(1);
-    }
+    struct lidx_range *ranges;
+    icase_key(key);
+    // Find the ranges of the file that may contain the key and the number of lines in the file
+    size_t nranges = search_ranges(fpath, &fb, opts.icase == ICASE_UTF8 ? NULL : key, &ranges, &lines);
 
     size_t total = lines;
 
@@ -1403,79 +7748,168 @@ void replace(char *fpath, char *key, char *sub) {
         digits ++;
     }
 
-    // Resets the file pointer to the start of the file (with error handling)
-    if (fseek(fptr, 0, SEEK_SET)) {
-        fclose(fptr);
-        die("fseek");
-    }
+    // Records modified lines in the delta of the word index (unless resumed, or keys may span lines)
+    struct wdelta wd;
+    delta_begin(resume || strchr(key, '\n') ? NULL : fpath, &wd);
+    uint64_t shift = 0;
+
+    struct checkpoint ck;
+    // Prepare checkpoints, or continue from the checkpoint being resumed
+    if (resume) ck = *resume;
+    else ckpt_init(&ck, CKPT_REPLACE, fpath, key, sub, 0);
 
     // Attempts to open temp file in write mode (with error handling)
-    FILE *temp = fopen(TEMPF, "w");
+    FILE *temp = ckpt_temp(resume);
     if (!temp) {
-        fclose(fptr);
+        unload_file(&fb);
         die("fopen temp");
     } 
 
-    char *line = (char *) malloc(MAX);
-    char *buffer;
-    char *result;
-    size_t linelen;
+    size_t klen = strlen(key);
+    size_t slen = strlen(sub);
+    const char *start, *end, *next, *buffer;
+    char *result = NULL;
+    size_t rcap = 0, rlen;
+    size_t linelen, mlen;
     int subcount;
-    int count = 0;
-    lines = 0;
+    int count = resume ? resume->count : 0;
+    int added = resume ? resume->newlines : 0;
+    size_t r;
+    uint64_t pos = resume ? resume->src_off : 0;
+    uint64_t saved = pos;
+    // Direct replaces drop the file and temp file from the page cache as they are streamed through
+    int nocache = fb.plan.nocache;
+    size_t dropped = 0;
+    off_t tdropped = 0;
+    size_t moved = 0;
+    int counted = count;
+    progress_start("replace", fb.len, 1);
+    progress_add(pos, count);
+
+    // For each range of the file, and then the rest of the file after the last range
+    for (r = 0; r <= nranges; r++) {
+        // Copy the part of the file before the range without reading it (with error handling)
+        uint64_t gap = r < nranges ? ranges[r].start : UINT64_MAX;
+        if (gap > fb.len) gap = fb.len;
+        if (gap > pos) {
+            if (fflush(temp)) {
+                unload_file(&fb);
+                fclose(temp);
+                die("fflush");
+            }
+            if (splice_range(fb.fd, fileno(temp), pos, gap)) {
+                unload_file(&fb);
+                fclose(temp);
+                fprintf(stderr, "\nError copying file. Warning: Temporary files will remain.\n");
+                die("copy_file_range");
+            }
+            pos = gap;
+            if (nocache) drop_streamed(&fb, pos, &dropped, temp, &tdropped, 0);
+        }
+        if (r == nranges) break;
+        // A resumed replace skips the parts of ranges processed before the checkpoint
+        if (ranges[r].end <= pos) continue;
+
+        // Moves the temp file pointer to the end of the temp file (with error handling)
+        if (fseeko(temp, 0, SEEK_END)) {
+            unload_file(&fb);
+            fclose(temp);
+            die("fseek");
+        }
+        start = fb.data + (ranges[r].start > pos ? ranges[r].start : pos);
+        end = fb.data + (ranges[r].end < fb.len ? ranges[r].end : fb.len);
+        lines = resume && ranges[r].start < pos ? resume->line : ranges[r].line - 1;
 
-    // Reads lines from original file until End-Of-File
-    while (fgets(line, MAX - 1, fptr) != NULL) {
-        // Incrmeent line counter
-        lines++;
+        // Steps through lines of original file until the end of the range
+        for (; start < end; start = next) {
+            // Incrmeent line counter
+            lines++;
+            next = memchr(start, '\n', end - start);
+            next = next ? next + 1 : end;
+            linelen = next - start;
+            pos = next - fb.data;
+
+            buffer = start;
+            // If instance of key substring found in line
+            if ((buffer = find_key(fb.data, buffer, next - buffer, key, klen, &mlen)) != NULL) {
+                // Count number of instance of key substring in line
+                subcount = 1;
+                buffer += mlen;
+                while ((buffer = find_key(fb.data, buffer, next - buffer, key, klen, &mlen)) != NULL) {
+                    subcount++;
+                    buffer += mlen;
+                }
 
-        buffer = line;
-        // If instance of key substring found in line
-        if ((buffer = strstr(buffer, key)) != NULL) {
-            // Count number of instance of key substring in line
-            subcount = 1;
-            buffer += strlen(key);
-            while ((buffer = strstr(buffer, key)) != NULL) {
-                subcount++;
-                buffer += strlen(key);
-            }
+                // Increment count by number of occurrences
+                count += subcount;
 
-            // Increment count by number of occurrences
-            count += subcount;
+                // Remove trailing newline chars (a last line without one gains one when written)
+                if (start[linelen - 1] != '\n') added = 1;
+                while (linelen > 0 && (start[linelen - 1] == '\n' || start[linelen - 1] == '\r')) linelen--;
 
-            // Removing trailing newline chars
-            linelen = strlen(line);
-            while (linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r')) linelen--;
-            if (linelen != MAX) line[linelen] = '\0';
+                // Print line before substition (written with its length, as it may contain NULL chars)
+                if (!opts.json) {
+                    printf("%d substitution\\s:\n", subcount);
+                    printf("%0*lu |", digits, lines);
+                    fwrite(start, 1, linelen, stdout);
+                    printf("\n");
+                }
 
-            // Print line before substition
-            printf("%d substitution\\s:\n", subcount);
-            printf("%0*lu |%s\n", digits, lines, line);
+                // Make all substitions in line
+                rlen = string_sub(start, linelen, key, klen, sub, slen, subcount, &result, &rcap);
+
+                // Write modified to temp file and print
+                fwrite(result, 1, rlen, temp);
+                fputc('\n', temp);
+                // Record modified line (later lines move down by newlines in the result)
+                delta_splice(&wd, lines + shift, 1, result, rlen);
+                shift += count_newlines(result, rlen);
+                if (opts.json) {
+                    json_line("replace", "replace", fpath, lines, start - fb.data, start, linelen);
+                    printf(",\"count\":%d", subcount);
+                    json_spans(start, linelen, key, klen, NULL);
+                    printf(",\"result\":");
+                    json_str(result, rlen);
+                    json_end(0);
+                } else {
+                    printf(" to\n%0*lu |", digits, lines);
+                    fwrite(result, 1, rlen, stdout);
+                    printf("\n\n");
+                }
+            // Else if no instance, write unmodified line to temp file
+            } else {
+                fwrite(start, 1, linelen, temp);
+            }
 
-            // Make all substitions in line (with error handling)
-            if ((result = string_sub(line, key, sub, subcount)) == NULL) {
-                fclose(fptr);
-                fclose(temp);
-                fprintf(stderr, "\nError replacing string. Warning: Temporary files will remain.\n");
-                exit(1);
+            // Throttle and report progress in CHUNK batches, counting each line once read and once written
+            if ((moved += 2 * (next - start)) >= CHUNK) {
+                throttle(moved);
+                progress_add(moved / 2, count - counted);
+                counted = count;
+                moved = 0;
             }
 
-            // Write modified to temp file and print
-            fprintf(temp, "%s\n", result);
-            printf(" to\n%0*lu |%s\n\n", digits, lines, result);
-            free(result);
-        // Else if no instance, write unmodified line to temp file
-        } else {
-            fputs(line, temp);
+            if (nocache) drop_streamed(&fb, pos, &dropped, temp, &tdropped, 0);
+
+            // Save a checkpoint every CKPT_BYTES of the file
+            if (pos - saved >= CKPT_BYTES) {
+                ckpt_save(&ck, temp, pos, lines, count, added);
+                saved = pos;
+            }
         }
     }
 
-    free(line);
-    // Print total number of replacement made in file 
-    printf("%d instances replaced in the file.\n", count);
+    if (nocache) drop_streamed(&fb, pos, &dropped, temp, &tdropped, 1);
+    progress_add(moved / 2, count - counted);
+    progress_stop();
 
-    // Close both the original and temp file 
-    fclose(fptr);
+    free(ranges);
+    free(result);
+    // Print total number of replacement made in file (JSON result record is printed once the file is replaced)
+    if (!opts.json) printf("%d instances replaced in the file.\n", count);
+
+    // Release the original file and close the temp file 
+    unload_file(&fb);
     fclose(temp);
     
     // Attempts to delete original file (with error handling)
@@ -1490,14 +7924,467 @@ void replace(char *fpath, char *key, char *sub) {
         die("rename");
     }
 
+    // Operation is complete, so it no longer needs to be resumed
+    remove(CKPTF);
+
+    // Lines are added by newlines in the substitute string and by ending the last line
+    total += count * count_newlines(sub, strlen(sub)) + added;
+    if (added) delta_splice(&wd, wd.hdr.lines + 1, 0, "", 0);
+
+    // Updates indexes and metadata of the file
+    after_edit(fpath, total, &wd);
+
+    // Creates log string describing operation and number of lines after operation
+    char *msg = (char *) malloc(LOGLEN);
+    snprintf(msg, LOGLEN, "File \'%s\': Instances of \"%s\"%s%s replaced by \"%s\" | Lines After = %lu", fpath, key,
+            opts.icase ? " (ignoring case)" : "", opts.word ? " (whole words)" : "", sub, total);
+    // Appends log string to log file
+    change_log(msg);
+    free(msg);
+
+    // Prints the result of the operation as a JSON record
+    if (opts.json) {
+        json_begin("result", "replace", fpath);
+        printf(",\"matches\":%d,\"lines\":%lu", count, total);
+        json_end(1);
+    }
+}
+
+/*
+ * Function: resume()
+ * -----------------------------
+ * Resumes the rewrite operation interrupted after its last checkpoint. The 
+ * checkpoint is loaded and checked with ckpt_load(), and the operation is 
+ * called again with the checkpoint, continuing from the source offset and 
+ * temp file length it records. If there is nothing to resume, or it cannot 
+ * be resumed, error message is printed and program quits.
+ */
+void resume() {
+    struct checkpoint ck;
+
+    if (ckpt_load(&ck)) exit(1);
+
+    if (opts.json) {
+        json_begin("resume", "resume", ck.fpath);
+        printf(",\"offset\":%lu,\"size\":%lu", (unsigned long) ck.src_off, (unsigned long) ck.size);
+        json_end(0);
+    } else {
+        printf("Resuming operation on '%s' from byte %lu of %lu.\n", ck.fpath, (unsigned long) ck.src_off, (unsigned long) ck.size);
+    }
+    switch (ck.op) {
+        case CKPT_REPLACE:
+            // Replace matches in the same way as before being interrupted
+            if (ck.flags & CKPT_ICASE) opts.icase = ICASE_ASCII;
+            if (ck.flags & CKPT_WORD) opts.word = 1;
+            replace(ck.fpath, ck.key, ck.sub, &ck);
+            break;
+        case CKPT_DEL_LINE:
+            del_line(ck.fpath, ck.lineno, &ck);
+            break;
+        case CKPT_INS_LINE:
+            ins_line(ck.fpath, ck.key, ck.lineno, &ck);
+            break;
+        case CKPT_REP_LINE:
+            rep_line(ck.fpath, ck.key, ck.lineno, &ck);
+            break;
+        default:
+            fprintf(stderr, "Checkpoint file '%s' is not valid.\n", CKPTF);
+            exit(1);
+    }
+}
+
+/* --- REWRITES --- */
+
+/*
+ * Struct describing a line by line rewrite of a file done by rewrite_file().
+ * For each line, the line function is given the line (without its line 
+ * ending) and the length of its line ending, and either builds the new line 
+ * (with its line ending) in the output buffer or reports that the line is 
+ * unchanged, so that runs of unchanged lines are copied in large writes.
+ * name - name of the operation (used for progress and JSON records)
+ * desc - description of the change written to the log
+ * line - function rewriting a line (returns length of new line, or -1 if unchanged)
+ * eol - line ending written by -eol (EOL_LF or EOL_CRLF)
+ * tabs - distance between tab stops for -expandtab and -unexpand
+ * lines - number of lines in the file
+ * modified - number of lines changed
+ * lf, crlf - number of lines read that ended with LF and with CRLF
+ */
+struct rewrite {
+    const char *name;
+    const char *desc;
+    ssize_t (*line)(struct rewrite *rw, const char *line, size_t len, size_t endlen, char **out, size_t *cap);
+    int eol;
+    int tabs;
+    size_t lines;
+    size_t modified;
+    size_t lf;
+    size_t crlf;
+};
+
+/*
+ * Function: rewrite_file()
+ * -----------------------------
+ * Rewrites a file line by line in a single streaming pass. The file is loaded
+ * with load_file() and stepped through with memchr(), finding the line ending
+ * of each line (LF, CRLF, or none for a last line without one). Each line is
+ * passed to the line function of the rewrite; changed lines are written to the
+ * temp file, and unchanged lines are copied from the loaded file in runs of up
+ * to CHUNK bytes. Writes are throttled and progress is reported as in 
+ * replace(), and the direct method drops the file and temp file from the page
+ * cache as they are streamed through. If lines were changed, the temp file is
+ * renamed to replace the original file and its indexes and metadata are 
+ * updated with after_edit(); otherwise the temp file is removed and the file 
+ * is left untouched. The operation is logged with change_log(). If there are 
+ * any errors, error message is printed and program quits.
+ * 
+ * fpath: path to file being rewritten
+ * rw: rewrite to be done (counts are filled in)
+ */
+void rewrite_file(char *fpath, struct rewrite *rw) {
+    struct fbuf fb;
+    struct wdelta wd;
+    // Rewrites only change whitespace and line endings, so the word index only needs the new size and time
+    delta_begin(fpath, &wd);
+    load_file(fpath, &fb, 0);
+
+    // Attempts to open temp file in write mode (with error handling), dropping
+    // any checkpoint of an interrupted operation, whose temp file is overwritten
+    remove(CKPTF);
+    FILE *temp = fopen(TEMPF, "w");
+    if (!temp) {
+        unload_file(&fb);
+        die("fopen temp");
+    }
+
+    const char *start = fb.data, *end = fb.data + fb.len, *next, *nl;
+    const char *run = fb.data;
+    char *out = NULL;
+    size_t cap = 0;
+    ssize_t outlen;
+    size_t len, endlen;
+    // Direct rewrites drop the file and temp file from the page cache as they are streamed through
+    int nocache = fb.plan.nocache;
+    size_t dropped = 0;
+    off_t tdropped = 0;
+    size_t moved = 0;
+    int err = 0;
+    rw->lines = rw->modified = rw->lf = rw->crlf = 0;
+    progress_start(rw->name, fb.len, 0);
+
+    // Steps through lines until the end of the file
+    for (; start < end && !err; start = next) {
+        // Find end of line and its line ending
+        nl = memchr(start, '\n', end - start);
+        next = nl ? nl + 1 : end;
+        endlen = !nl ? 0 : nl > start && nl[-1] == '\r' ? 2 : 1;
+        len = next - start - endlen;
+        if (endlen == 2) rw->crlf++;
+        else if (endlen == 1) rw->lf++;
+
+        // If line is changed, write unchanged lines before it and then the new line
+        if ((outlen = rw->line(rw, start, len, endlen, &out, &cap)) >= 0) {
+            rw->modified++;
+            err = fwrite(run, 1, start - run, temp) != (size_t) (start - run) || fwrite(out, 1, outlen, temp) != (size_t) outlen;
+            run = next;
+        // Otherwise unchanged lines are written in runs of up to CHUNK bytes
+        } else if (next - run >= CHUNK) {
+            err = fwrite(run, 1, next - run, temp) != (size_t) (next - run);
+            run = next;
+        }
+
+        // Throttle and report progress in CHUNK batches, counting each line once read and once written
+        if ((moved += 2 * (next - start)) >= CHUNK) {
+            throttle(moved);
+            progress_add(moved / 2, 0);
+            moved = 0;
+        }
+
+        if (nocache) drop_streamed(&fb, run - fb.data, &dropped, temp, &tdropped, 0);
+    }
+
+    // Write the last run of unchanged lines (with error handling)
+    if (!err && end > run) err = fwrite(run, 1, end - run, temp) != (size_t) (end - run);
+    if (err || fflush(temp)) {
+        unload_file(&fb);
+        fclose(temp);
+        fprintf(stderr, "\nError writing temp file. Warning: Temporary files will remain.\n");
+        die("fwrite");
+    }
+    if (nocache) drop_streamed(&fb, fb.len, &dropped, temp, &tdropped, 1);
+    progress_add(moved / 2, 0);
+    progress_stop();
+
+    // Non-empty files have one more line than newline characters
+    rw->lines = fb.len > 0 ? rw->lf + rw->crlf + 1 : 0;
+    free(out);
+
+    // Release the original file and close the temp file 
+    unload_file(&fb);
+    fclose(temp);
+
+    if (rw->modified) {
+        // Attempts to delete original file (with error handling)
+        if (remove(fpath)) {
+            fprintf(stderr, "Error removing original file. Warning there will be temp files remaining.\n");
+            die("remove");
+        }
+
+        // Attempts to rename temp file to replace original file (with error handling)
+        if (rename(TEMPF, fpath)) {
+            fprintf(stderr, "Error renaming temp file. Warning temp file will be remaining.\n");
+            die("rename");
+        }
+
+        // Updates indexes and metadata of the file (rewrites keep the words of each line)
+        after_edit(fpath, rw->lines, &wd);
+    } else {
+        // File is unchanged, so the temp file is not needed (and its word index stays as it is)
+        remove(TEMPF);
+        free(wd.rec);
+    }
+
     // Creates log string describing operation and number of lines after operation
     char *msg = (char *) malloc(LOGLEN);
-    snprintf(msg, LOGLEN, "File \'%s\': Instances of \"%s\" replaced by \"%s\" | Lines After = %lu", fpath, key, sub, total);
+    snprintf(msg, LOGLEN, "File \'%s\': %s (%lu lines modified) | Lines After = %lu", fpath, rw->desc, rw->modified, rw->lines);
     // Appends log string to log file
     change_log(msg);
     free(msg);
 }
 
+/*
+ * Function: eol_line()
+ * -----------------------------
+ * Line function of -eol for rewrite_file(). Gives the line the line ending 
+ * the file is being converted to. Lines that already have it, and a last line
+ * without a line ending, are unchanged. Lone carriage returns within lines 
+ * are left as they are.
+ * 
+ * rw: rewrite being done
+ * line: pointer to the start of the line
+ * len: length of the line without its line ending
+ * endlen: length of the line ending of the line
+ * out: pointer to the output buffer
+ * cap: pointer to the size of the output buffer
+ * 
+ * returns: length of the new line, or -1 if the line is unchanged
+ */
+ssize_t eol_line(struct rewrite *rw, const char *line, size_t len, size_t endlen, char **out, size_t *cap) {
+    size_t want = rw->eol == EOL_CRLF ? 2 : 1;
+    if (endlen == 0 || endlen == want) return -1;
+
+    // Copy line and add the new line ending
+    buf_reserve(out, cap, len + want);
+    memcpy(*out, line, len);
+    if (want == 2) (*out)[len++] = '\r';
+    (*out)[len++] = '\n';
+    return len;
+}
+
+/*
+ * Function: eol_file()
+ * -----------------------------
+ * Converts the line endings of a file to LF or CRLF with rewrite_file(), and 
+ * prints the number of lines changed along with the mix of line endings the 
+ * file had. If no line ending is given, the file is not changed and the mix 
+ * of line endings (LF, CRLF and lone CR) is counted by count_buffer() in the 
+ * same pass used to count lines, and printed.
+ * 
+ * fpath: path to file whose line endings are converted
+ * eol: line ending to convert to (EOL_LF or EOL_CRLF, 0 to only report)
+ */
+void eol_file(char *fpath, int eol) {
+    if (!eol) {
+        struct fbuf fb;
+        struct eol_mix mix;
+        struct io_plan plan = load_file(fpath, &fb, 0);
+
+        // Non-empty files have one more line than newline characters
+        size_t lines = fb.len > 0 ? count_buffer(fb.data, fb.len, plan.threads, &mix) + 1 : 0;
+        if (fb.len == 0) mix.lf = mix.crlf = mix.cr = 0;
+        unload_file(&fb);
+
+        if (opts.json) {
+            json_begin("result", "eol", fpath);
+            printf(",\"lines\":%lu,\"lf\":%lu,\"crlf\":%lu,\"cr\":%lu", lines, mix.lf, mix.crlf, mix.cr);
+            json_end(1);
+        } else {
+            printf("\'%s\' has %lu lines: %lu LF, %lu CRLF and %lu CR line endings\n", fpath, lines, mix.lf, mix.crlf, mix.cr);
+        }
+        return;
+    }
+
+    struct rewrite rw;
+    memset(&rw, 0, sizeof(rw));
+    rw.name = "eol";
+    rw.desc = eol == EOL_CRLF ? "Line endings converted to CRLF" : "Line endings converted to LF";
+    rw.line = eol_line;
+    rw.eol = eol;
+    rewrite_file(fpath, &rw);
+
+    if (opts.json) {
+        json_begin("result", "eol", fpath);
+        printf(",\"lines\":%lu,\"modified\":%lu,\"lf\":%lu,\"crlf\":%lu", rw.lines, rw.modified, rw.lf, rw.crlf);
+        json_end(1);
+    } else {
+        printf("%lu line endings converted to %s (file had %lu LF and %lu CRLF line endings).\n", rw.modified,
+            eol == EOL_CRLF ? "CRLF" : "LF", rw.lf, rw.crlf);
+    }
+}
+
+/*
+ * Function: trim_line()
+ * -----------------------------
+ * Line function of -trim for rewrite_file(). Removes the spaces and tabs at 
+ * the end of the line, keeping its line ending. Only the last char of the line
+ * needs to be checked to find that a line is unchanged.
+ * 
+ * rw: rewrite being done
+ * line: pointer to the start of the line
+ * len: length of the line without its line ending
+ * endlen: length of the line ending of the line
+ * out: pointer to the output buffer
+ * cap: pointer to the size of the output buffer
+ * 
+ * returns: length of the new line, or -1 if the line is unchanged
+ */
+ssize_t trim_line(struct rewrite *rw, const char *line, size_t len, size_t endlen, char **out, size_t *cap) {
+    size_t keep = len;
+    // Trimming has no options
+    (void) rw;
+    while (keep > 0 && (line[keep - 1] == ' ' || line[keep - 1] == '\t')) keep--;
+    if (keep == len) return -1;
+
+    // Copy line without trailing whitespace, followed by its line ending
+    buf_reserve(out, cap, keep + endlen);
+    memcpy(*out, line, keep);
+    memcpy(*out + keep, line + len, endlen);
+    return keep + endlen;
+}
+
+/*
+ * Function: expand_line()
+ * -----------------------------
+ * Line function of -expandtab for rewrite_file(). Replaces each tab with the 
+ * spaces up to the next tab stop, jumping from tab to tab with memchr(). 
+ * Columns are counted in chars, so UTF-8 continuation bytes do not take up a 
+ * column. Lines without tabs are unchanged.
+ * 
+ * rw: rewrite being done
+ * line: pointer to the start of the line
+ * len: length of the line without its line ending
+ * endlen: length of the line ending of the line
+ * out: pointer to the output buffer
+ * cap: pointer to the size of the output buffer
+ * 
+ * returns: length of the new line, or -1 if the line is unchanged
+ */
+ssize_t expand_line(struct rewrite *rw, const char *line, size_t len, size_t endlen, char **out, size_t *cap) {
+    const char *end = line + len, *tab, *c;
+    size_t col = 0, olen = 0, fill;
+
+    if (!memchr(line, '\t', len)) return -1;
+
+    // Each tab takes up at most rw->tabs columns
+    buf_reserve(out, cap, len * rw->tabs + endlen);
+    while (line < end) {
+        // Copy the text before the next tab and count its columns
+        tab = memchr(line, '\t', end - line);
+        if (!tab) tab = end;
+        memcpy(*out + olen, line, tab - line);
+        olen += tab - line;
+        for (c = line; c < tab; c++) {
+            if ((*c & 0xC0) != 0x80) col++;
+        }
+        if (tab == end) break;
+
+        // Replace tab with spaces up to the next tab stop
+        fill = rw->tabs - col % rw->tabs;
+        memset(*out + olen, ' ', fill);
+        olen += fill;
+        col += fill;
+        line = tab + 1;
+    }
+
+    memcpy(*out + olen, end, endlen);
+    return olen + endlen;
+}
+
+/*
+ * Function: unexpand_line()
+ * -----------------------------
+ * Line function of -unexpand for rewrite_file(). Rewrites the indentation of
+ * the line (its leading spaces and tabs) as tabs for each full tab stop 
+ * followed by spaces, as unexpand does by default. Spaces and tabs after the 
+ * first other char are left as they are. Lines whose indentation is already 
+ * written this way are unchanged.
+ * 
+ * rw: rewrite being done
+ * line: pointer to the start of the line
+ * len: length of the line without its line ending
+ * endlen: length of the line ending of the line
+ * out: pointer to the output buffer
+ * cap: pointer to the size of the output buffer
+ * 
+ * returns: length of the new line, or -1 if the line is unchanged
+ */
+ssize_t unexpand_line(struct rewrite *rw, const char *line, size_t len, size_t endlen, char **out, size_t *cap) {
+    size_t indent, col = 0, tabs, spaces, i;
+
+    // Find the end of the indentation and the column it reaches
+    for (indent = 0; indent < len && (line[indent] == ' ' || line[indent] == '\t'); indent++) {
+        col = line[indent] == '\t' ? col + rw->tabs - col % rw->tabs : col + 1;
+    }
+    tabs = col / rw->tabs;
+    spaces = col % rw->tabs;
+
+    // Indentation is unchanged if it already has the tabs followed by the spaces
+    if (indent == tabs + spaces) {
+        for (i = 0; i < tabs && line[i] == '\t'; i++);
+        if (i == tabs && !memchr(line + tabs, '\t', spaces)) return -1;
+    }
+
+    // Write new indentation, then copy the rest of the line and its line ending
+    buf_reserve(out, cap, tabs + spaces + len - indent + endlen);
+    memset(*out, '\t', tabs);
+    memset(*out + tabs, ' ', spaces);
+    memcpy(*out + tabs + spaces, line + indent, len - indent + endlen);
+    return tabs + spaces + len - indent + endlen;
+}
+
+/*
+ * Function: space_file()
+ * -----------------------------
+ * Rewrites the whitespace of a file with rewrite_file(): trims trailing 
+ * whitespace (-trim), expands tabs to spaces (-expandtab) or turns the spaces
+ * indenting lines into tabs (-unexpand), with tab stops every opts.tabs 
+ * columns (8 by default). Prints the number of lines modified, which is also 
+ * recorded in the change log.
+ * 
+ * fpath: path to file being rewritten
+ * mode: whitespace rewrite to do (WS_TRIM, WS_EXPAND or WS_UNEXPAND)
+ */
+void space_file(char *fpath, int mode) {
+    static const char *names[] = { NULL, "trim", "expandtab", "unexpand" };
+    static const char *descs[] = { NULL, "Trailing whitespace trimmed", "Tabs expanded to spaces", "Indentation converted to tabs" };
+    struct rewrite rw;
+
+    memset(&rw, 0, sizeof(rw));
+    rw.name = names[mode];
+    rw.desc = descs[mode];
+    rw.line = mode == WS_TRIM ? trim_line : mode == WS_EXPAND ? expand_line : unexpand_line;
+    rw.tabs = opts.tabs ? opts.tabs : 8;
+    rewrite_file(fpath, &rw);
+
+    if (opts.json) {
+        json_begin("result", rw.name, fpath);
+        printf(",\"lines\":%lu,\"modified\":%lu", rw.lines, rw.modified);
+        json_end(1);
+    } else {
+        printf("%lu lines modified in the file.\n", rw.modified);
+    }
+}
+
 /* --- USAGE --- */
 
 /*
@@ -1508,33 +8395,176 @@ void replace(char *fpath, char *key, char *sub) {
  * as well. After printing the program quits.  
  */
 void usage() {
-    printf("Simple Text Editor\n\nUSAGE\n./editor [OPTION] [ARGUMENTS]...\n\nOPTIONS\n");
+    printf("Simple Text Editor\n\nUSAGE\n./editor [GLOBAL OPTION]... [OPTION] [ARGUMENTS]...\n\nGLOBAL OPTIONS\n");
+    printf("--io=<auto|stdio|mmap|buf|direct>\n    method used to read files (auto picks by file size and filesystem) - direct\n");
+    printf("    also keeps copies and replaces (-cp, -rp) out of the page cache\n\n");
+    printf("--threads=<n>\n    number of worker threads used for large files (1 to %d)\n\n", MAX_THREADS);
+    printf("--verbose\n    print the I/O method and threads chosen for each file\n\n");
+    printf("--bwlimit=<rate>[K|M|G]\n    limit bytes read and written per second by copies and replaces (-cp, -rp)\n\n");
+    printf("--iops=<n>\n    limit reads and writes per second by copies and replaces (-cp, -rp)\n\n");
+    printf("--idle\n    only use the disk when no other program is using it (idle I/O priority)\n\n");
+    printf("--progress, --no-progress\n    show (or hide) progress of long operations on stderr (default: shown if stderr is a terminal)\n\n");
+    printf("-A <n>, -B <n>, -C <n>\n    print n lines of context after, before, or around matches of searches (-sch, -schreg)\n\n");
+    printf("--count\n    only print the number of matches found by searches (-sch, -schreg)\n\n");
+    printf("--first=<n>\n    stop searches (-sch, -schreg) after n matching lines\n\n");
+    printf("--quiet\n    print nothing and stop searches (-sch, -schreg) at the first match - exit status is 0\n");
+    printf("    if a match was found, else 1\n\n");
+    printf("--json\n    print results as JSON Lines records (one JSON object per line) instead of text -\n    bytes that are not valid UTF-8 are written as \\u00XX (the latin-1 char of the byte)\n\n");
+    printf("-i, --icase\n    searches and replaces (-sch, -rp) ignore case (regex searches always ignore case)\n\n");
+    printf("-w, --word\n    searches and replaces (-sch, -rp) only match whole words (not next to letters,\n");
+    printf("    digits, underscores or any non-ASCII byte, so -w never matches next to non-ASCII text)\n\n");
+    printf("--tabs=<n>\n    columns between tab stops used by -expandtab and -unexpand (1 to 99, default 8)\n\n");
+    printf("--sep=<chars>\n    separator ending the key of lines joined by -join (default: tab)\n\nOPTIONS\n");
     printf("-cr <file>\n    create empty file (will overwrite if file exists)\n\n");
     printf("-dl <file>\n    delete existing file\n\n");
     printf("-cp <src> <dst>\n    copy existing file from source path to destination path\n\n");
     printf("-sh <file>\n    display contents of file with line numbers\n\n");
-    printf("-lsh <file> <linenum>\n    display specified line of file\n\n");
+    printf("-lsh <file> <linenum|@file>...\n    display specified lines of file in the order given (@file reads line numbers from file)\n\n");
     printf("-la <file> <line>\n    append line to end of file on new line\n\n");
     printf("-ldl <file> <linenum>\n    delete specified line of file\n\n");
     printf("-lin <file> <line> <linenum>\n    insert line into specified position in file\n\n");
     printf("-lrp <file> <line> <linenum>\n    replace line at linenum in file with given string\n\n");
     printf("-sch <file> <key>\n    search for string in file\n\n");
+    printf("-lookup <file> <prefix>\n    display lines starting with prefix in file sorted by bytes (LC_ALL=C sort) using\n");
+    printf("    binary search - lines are numbered if the file has a line index (-index), else shown with their offset\n\n");
     printf("-schreg <file> <key>\n    regex search in file [RegEx Standard depends on System - POSIX on most linux]\n\n");
+    printf("-fuzzy <file> <key> <k>\n    search for lines matching string with at most k edits (inserted, deleted or\n");
+    printf("    changed chars) and display the edit distance of each line\n\n");
     printf("-rp <file> <key> <sub>\n    replace all occurences of <key> with <sub>\n\n");
     printf("-chlog <file>\n    display change log (will display universal change log, if no file specified)\n\n");
     printf("-cl <file>\n    display number of lines in file (0 if empty)\n\n");
+    printf("-eol <file> [lf|crlf]\n    convert line endings of file to LF or CRLF (displays mix of LF, CRLF and CR line\n");
+    printf("    endings in file, if no line ending specified)\n\n");
+    printf("-merge <file> <other>\n    merge lines of sorted file other into sorted file (sorted by bytes, LC_ALL=C sort)\n\n");
+    printf("-join <file> <other>\n    replace lines of file with lines joined with lines of other with the same key\n");
+    printf("    (text before --sep, files sorted by key) - written as line of file then rest of line of other\n\n");
+    printf("-trim <file>\n    remove spaces and tabs at the end of lines in file\n\n");
+    printf("-expandtab <file>\n    replace tabs in file with spaces up to the next tab stop\n\n");
+    printf("-unexpand <file>\n    replace spaces indenting lines in file with tabs\n\n");
+    printf("-resume\n    continue the replace or line operation (-rp, -ldl, -lin, -lrp) that was interrupted\n\n");
+    printf("-index <file> [trigram|bloom|both]\n    build line index of file used to speed up repeated searches and replaces\n");
+    printf("    (-sch, -schreg, -rp) - bloom builds a smaller index of per-block Bloom filters\n\n");
+    printf("-index-sa <file>\n    build suffix array of file used to answer searches (-sch) without reading file\n\n");
+    printf("-index-words <file>\n    build word index of file used to answer word queries (-query) - kept up to date\n");
+    printf("    by -la, -lin, -lrp, -rp, -eol and whitespace rewrites, which record their changes in a delta\n\n");
+    printf("-query <file> <query>\n    display lines of indexed file containing all words of query (ignoring case) -\n");
+    printf("    \"quoted words\" must be next to each other and OR separates alternatives\n\n");
     printf("EXAMPLES\n./editor -cr foo.bar\n./editor -la ../foo.txt \"THE END\"\n");
     printf("./editor -cp foo.c ../foo/bar/out.c\n./editor -lin foo.c \"The New Beginning\" 1\n");
     printf("./editor -sch foo.c the\n\nNOTE\n");
     printf("Program only works with regular files and program must have permission to read/write ");
     printf("read/write to file depending on operation. Please ensure temp file used by program is not in use.\n");
-    printf("Temp File: %s\tLog File: %s\nMax File-path Len: %d\t", TEMPF, LOGF, MAXF);
+    printf("Indexes are stored next to the file (<file>%s, <file>%s, <file>%s, <file>%s) and are ignored once the file changes.\n",
+            IDXEXT, SAEXT, WIDXEXT, WDELTAEXT);
+    printf("Edits cache the line count of the file in its %s extended attribute, which searches and line counts\n", META_XATTR);
+    printf("read (but never write) to skip counting lines.\n");
+    printf("Temp File: %s\tLog File: %s\tCheckpoint File: %s\nMax File-path Len: %d\t", TEMPF, LOGF, CKPTF, MAXF);
     printf("\tMax String Len: %d\nMax Regex String Len: %d\tMax Number of Logs Kept: %d\n", MAX, MAXF, CLOG_BUFFER);
     exit(1);
 }
 
 /* --- MAIN --- */
 
+/*
+ * Function: parse_opts()
+ * -----------------------------
+ * Parses the global options given before the flag argument into opts. Options
+ * start with "--" and are of the form --name or --name=value, apart from the
+ * context options (-A, -B and -C) which are followed by a number. Unknown 
+ * options and invalid values result in usage() being called to inform user 
+ * how to use program.
+ * 
+ * argc: number of command line arguments passed into program
+ * argv: array of command line arguments read from terminal
+ * 
+ * returns: number of options parsed
+ */
+int parse_opts(int argc, char *argv[]) {
+    int i, m;
+
+    for (i = 1; i < argc; i++) {
+        char *opt = argv[i] + 2;
+
+        // Context options take the number of lines as the next argument
+        if (!strcmp(argv[i], "-A") || !strcmp(argv[i], "-B") || !strcmp(argv[i], "-C")) {
+            if (i + 1 >= argc || !argv[i + 1][0] || strlen(argv[i + 1]) > 4 || is_number(argv[i + 1])) usage();
+            int n = atoi(argv[++i]);
+            if (opt[-1] != 'B') opts.after = n;
+            if (opt[-1] != 'A') opts.before = n;
+            continue;
+        }
+        if (!strcmp(argv[i], "-i") || !strcmp(argv[i], "--icase")) {
+            opts.icase = ICASE_ASCII;
+            continue;
+        }
+        if (!strcmp(argv[i], "-w") || !strcmp(argv[i], "--word")) {
+            opts.word = 1;
+            continue;
+        }
+        if (strncmp(argv[i], "--", 2)) break;
+
+        if (!strncmp(opt, "io=", 3)) {
+            // Find the named I/O method
+            for (m = 0; m < (int) (sizeof(IO_NAMES) / sizeof(IO_NAMES[0])) && strcmp(opt + 3, IO_NAMES[m]); m++);
+            if (m == sizeof(IO_NAMES) / sizeof(IO_NAMES[0])) usage();
+            opts.io = m;
+        } else if (!strncmp(opt, "threads=", 8)) {
+            // Thread count must be a number between 1 and MAX_THREADS
+            if (!opt[8] || strlen(opt + 8) > 2 || is_number(opt + 8)) usage();
+            opts.threads = atoi(opt + 8);
+            if (opts.threads < 1 || opts.threads > MAX_THREADS) usage();
+        } else if (!strcmp(opt, "verbose")) {
+            opts.verbose = 1;
+        } else if (!strncmp(opt, "bwlimit=", 8) || !strncmp(opt, "iops=", 5)) {
+            // Limits are positive numbers (bandwidth may have a K, M or G suffix)
+            char *val = strchr(opt, '=') + 1;
+            char *end;
+            errno = 0;
+            uint64_t limit = strtoull(val, &end, 10);
+            if (opt[0] == 'b' && *end) {
+                if (*end == 'K' || *end == 'k') limit <<= 10;
+                else if (*end == 'M' || *end == 'm') limit <<= 20;
+                else if (*end == 'G' || *end == 'g') limit <<= 30;
+                else usage();
+                end++;
+            }
+            if (!isdigit(*val) || *end || errno || limit == 0) usage();
+            if (opt[0] == 'b') opts.bwlimit = limit;
+            else opts.iops = limit;
+        } else if (!strcmp(opt, "idle")) {
+            opts.idle = 1;
+        } else if (!strcmp(opt, "progress")) {
+            opts.progress = 1;
+        } else if (!strcmp(opt, "no-progress")) {
+            opts.progress = -1;
+        } else if (!strcmp(opt, "count")) {
+            opts.count = 1;
+        } else if (!strncmp(opt, "first=", 6)) {
+            // Number of matching lines must be a positive number
+            if (!opt[6] || strlen(opt + 6) > 9 || is_number(opt + 6)) usage();
+            opts.first = atol(opt + 6);
+            if (opts.first == 0) usage();
+        } else if (!strcmp(opt, "quiet")) {
+            opts.quiet = 1;
+        } else if (!strcmp(opt, "json")) {
+            opts.json = 1;
+        } else if (!strncmp(opt, "tabs=", 5)) {
+            // Tab stops must be between 1 and 99 columns apart
+            if (!opt[5] || strlen(opt + 5) > 2 || is_number(opt + 5)) usage();
+            opts.tabs = atoi(opt + 5);
+            if (opts.tabs < 1) usage();
+        } else if (!strncmp(opt, "sep=", 4)) {
+            // Separator must be 1 to 8 chars (not containing line breaks)
+            if (!opt[4] || strlen(opt + 4) > 8 || strpbrk(opt + 4, "\r\n")) usage();
+            opts.sep = opt + 4;
+        } else {
+            usage();
+        }
+    }
+
+    return i - 1;
+}
+
 /*
  * Function: main()
  * -----------------------------
@@ -1550,15 +8580,25 @@ void usage() {
  * returns: 
  */
 int main(int argc, char *argv[]) {
-    // If there are too little or too many arguments, user is shown how to use program
-    if (argc < 2 || argc > 5) usage();
+    // Global options are parsed and removed, so that the flag argument comes first
+    int nopts = parse_opts(argc, argv);
+    argv[nopts] = argv[0];
+    argv += nopts;
+    argc -= nopts;
+
+    // Idle I/O priority class (3) only gets disk time no other program wants (failure is not fatal)
+    if (opts.idle && syscall(SYS_ioprio_set, 1, 0, 3 << 13) == -1) perror("ioprio_set");
+    if (opts.json) json_init();
+
+    // If there are too little or too many arguments, user is shown how to use program (-lsh takes any number of lines)
+    if (argc < 2 || (argc > 5 && strcmp(argv[1], "-lsh"))) usage();
 
     int flag = strlen(argv[1]);
     // If flag argument is too short (or long) or doesn't start with '-', user is shown how to use program
-    if (flag < 3 || argv[1][0] != '-' || flag > 7) usage();
+    if (flag < 3 || argv[1][0] != '-' || flag > 12) usage();
 
-    // For all operations other than change log
-    if (strcmp(argv[1], "-chlog")) {
+    // For all operations other than change log and resume
+    if (strcmp(argv[1], "-chlog") && strcmp(argv[1], "-resume")) {
         // If not enough arguments given, user is shown how to use program
         if (argc < 3) usage();
 
@@ -1593,17 +8633,19 @@ int main(int argc, char *argv[]) {
 
             } else if (!strcmp(argv[1], "-lsh")) {
 
-                if (argc != 4) usage();
-                // Parse line number to show and call show line with validated arguments
-                size_t line = parse_num(argv[3], 20);
-                show_line(argv[2], line);
+                if (argc < 4) usage();
+                // Read line numbers to show and call show lines with validated arguments
+                size_t n;
+                size_t *linenos = read_linenos(argv + 3, argc - 3, &n);
+                show_lines(argv[2], linenos, n);
+                free(linenos);
 
             } else if (!strcmp(argv[1], "-ldl")) {
 
                 if (argc != 4) usage();
                 // Parse line number to delete and call delete line  with validated arguments
                 size_t line = parse_num(argv[3], 20);
-                del_line(argv[2], line);
+                del_line(argv[2], line, NULL);
 
             } else if (!strcmp(argv[1], "-lin")) {
 
@@ -1612,7 +8654,7 @@ int main(int argc, char *argv[]) {
                 parse_string(argv[3], MAX, 0, 3);
                 size_t line = parse_num(argv[4], 20);
                 // Call insert line with validated arguments
-                ins_line(argv[2], argv[3], line);
+                ins_line(argv[2], argv[3], line, NULL);
                 
             } else if (!strcmp(argv[1], "-lrp")) {
 
@@ -1621,8 +8663,15 @@ int main(int argc, char *argv[]) {
                 parse_string(argv[3], MAX, 0, 3);
                 size_t line = parse_num(argv[4], 20);
                 // Call replace line with validated arguments
-                rep_line(argv[2], argv[3], line);
+                rep_line(argv[2], argv[3], line, NULL);
+
+
+            } else if (!strcmp(argv[1], "-lookup")) {
 
+                if (argc != 4) usage();
+                // Validate prefix string and call lookup with validated arguments
+                parse_string(argv[3], MAX, 1, 3);
+                lookup(argv[2], argv[3]);
 
             } else {
                 usage();
@@ -1651,13 +8700,9 @@ int main(int argc, char *argv[]) {
                 case 'l':
 
                     if (argc != 3) usage();
-                    // Attempts to open file in read mode (with error handling)
-                    FILE *fptr = fopen(argv[2], "r");
-                    if (!fptr) die("fopen");
-                    // Counts number of lines and prints it
-                    printf("\'%s\' has %lu lines\n", argv[2], count_lines(&fptr));
-                    // Closes the file
-                    fclose(fptr);
+                    // Counts number of lines (or uses cached count) and prints it
+                    if (opts.json) json_result("count_lines", argv[2], file_lines(argv[2]));
+                    else printf("\'%s\' has %lu lines\n", argv[2], file_lines(argv[2]));
                     break;
 
                 case 'h':
@@ -1707,6 +8752,37 @@ int main(int argc, char *argv[]) {
                 usage();
             }
 
+            break;
+        case 'i':
+            if (!strcmp(argv[1], "-index")) {
+
+                if (argc != 3 && argc != 4) usage();
+                int flags = IDX_TRIGRAM;
+                // If index type specified, validate type of index to build
+                if (argc == 4) {
+                    if (!strcmp(argv[3], "bloom")) flags = IDX_BLOOM;
+                    else if (!strcmp(argv[3], "both")) flags = IDX_TRIGRAM | IDX_BLOOM;
+                    else if (strcmp(argv[3], "trigram")) usage();
+                }
+                // Call build index with validated arguments
+                build_index(argv[2], flags);
+
+            } else if (!strcmp(argv[1], "-index-sa")) {
+
+                if (argc != 3) usage();
+                // Call build suffix array with validated argument
+                build_sa(argv[2]);
+
+            } else if (!strcmp(argv[1], "-index-words")) {
+
+                if (argc != 3) usage();
+                // Call build word index with validated argument
+                build_widx(argv[2], 1);
+
+            } else {
+                usage();
+            }
+
             break;
         default:
             if (!strcmp(argv[1], "-dl")) {
@@ -1721,7 +8797,64 @@ int main(int argc, char *argv[]) {
                 // Validate search and replace substrings and call replace with validated arguments
                 parse_string(argv[3], MAX, 1, 3);
                 parse_string(argv[4], MAX, 0, 4);
-                replace(argv[2], argv[3], argv[4]);
+                replace(argv[2], argv[3], argv[4], NULL);
+
+            } else if (!strcmp(argv[1], "-merge") || !strcmp(argv[1], "-join")) {
+
+                if (argc != 4) usage();
+                // Validate path of second file and ensure it is a regular file that can be accessed
+                parse_string(argv[3], MAXF, 1, 3);
+                if (access(argv[3], F_OK) || !is_file(argv[3])) {
+                    fprintf(stderr, "Given file path either does not exist or does not refer to a regular file.\n");
+                    return 1;
+                }
+                // Call merge (or join) with validated arguments
+                merge_files(argv[2], argv[3], argv[1][1] == 'j');
+
+            } else if (!strcmp(argv[1], "-eol")) {
+
+                if (argc != 3 && argc != 4) usage();
+                int eol = 0;
+                // If line ending specified, validate line ending to convert to
+                if (argc == 4) {
+                    if (!strcmp(argv[3], "lf")) eol = EOL_LF;
+                    else if (!strcmp(argv[3], "crlf")) eol = EOL_CRLF;
+                    else usage();
+                }
+                // Call line ending conversion (or report) with validated arguments
+                eol_file(argv[2], eol);
+
+            } else if (!strcmp(argv[1], "-query")) {
+
+                if (argc != 4) usage();
+                // Validate query string and call word query with validated arguments
+                parse_string(argv[3], MAX, 1, 3);
+                query_words(argv[2], argv[3]);
+
+            } else if (!strcmp(argv[1], "-fuzzy")) {
+
+                if (argc != 5) usage();
+                // Validate search string and number of edits and call fuzzy search with validated arguments
+                parse_string(argv[3], MAX, 1, 3);
+                if (!argv[4][0] || strlen(argv[4]) > 4 || is_number(argv[4])) usage();
+                size_t k = atoi(argv[4]);
+                if (k >= strlen(argv[3])) {
+                    fprintf(stderr, "Number of edits must be less than the length of the search string.\n");
+                    exit(1);
+                }
+                fuzzy_search(argv[2], argv[3], k);
+
+            } else if (!strcmp(argv[1], "-trim") || !strcmp(argv[1], "-expandtab") || !strcmp(argv[1], "-unexpand")) {
+
+                if (argc != 3) usage();
+                // Call whitespace rewrite chosen by flag with validated argument
+                space_file(argv[2], argv[1][1] == 't' ? WS_TRIM : argv[1][1] == 'e' ? WS_EXPAND : WS_UNEXPAND);
+
+            } else if (!strcmp(argv[1], "-resume")) {
+
+                if (argc != 2) usage();
+                // Call resume to continue interrupted operation
+                resume();
 
             } else {
                 usage();